@@ -0,0 +1,71 @@
+// REPLと同じ経路(Interpreter::run)で，1項目(defかトップレベルの式)あたりのコンパイル時間を測る
+// usage: bench_compile_latency [項目数]
+
+#include <kaleidoscope/interpreter.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace kaleidoscope;
+
+namespace
+{
+std::string makeSource(size_t n)
+{
+    // 前のdefを呼ぶdefと，それを呼ぶトップレベルの式を交互に並べる
+    std::ostringstream src;
+    src << "def f0(x, y) x * y + 1;\n";
+    for (size_t i = 1; i < n; ++i) {
+        if (i % 2)
+            src << "def f" << i << "(x, y) if x < y then f" << i - 1 << "(x, y) * " << i << " else x - y * 2;\n";
+        else
+            src << "f" << i - 1 << "(" << i << ", " << i + 1 << ");\n";
+    }
+    return src.str();
+}
+
+double percentile(std::vector<double> v, double p)
+{
+    auto k = static_cast<size_t>(p * (v.size() - 1));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    size_t n = argc > 1 ? std::stoul(argv[1]) : 2000;
+
+    std::istringstream input{makeSource(n)};
+    Interpreter interpreter{input, "bench"};
+
+    // 評価結果の出力は測定の邪魔なので捨てる
+    std::ostringstream sink;
+    auto* orig = std::cout.rdbuf(sink.rdbuf());
+
+    std::vector<double> latency;
+    for (;;) {
+        auto start = std::chrono::steady_clock::now();
+        if (!interpreter.run())
+            break;
+        latency.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    std::cout.rdbuf(orig);
+
+    if (latency.empty())
+        return 1;
+
+    double total = 0;
+    for (auto t : latency)
+        total += t;
+    std::cout << "items: " << latency.size() << '\n'
+              << "mean:  " << total / latency.size() << " us\n"
+              << "p50:   " << percentile(latency, 0.50) << " us\n"
+              << "p99:   " << percentile(latency, 0.99) << " us\n"
+              << "total: " << total / 1000 << " ms" << std::endl;
+}
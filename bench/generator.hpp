@@ -0,0 +1,197 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kaleidoscope::bench
+{
+
+// 生成するプログラムの形
+struct CorpusShape
+{
+    std::size_t defs = 100;
+    unsigned depth = 4;          // 式の木の深さの上限
+    unsigned fanout = 2;         // 1つのdefの本体にある呼び出しの数の上限
+    double call_density = 0.3;   // 葉を関数呼び出しにする確率
+    double extern_ratio = 0.2;   // 関数呼び出しのうちexternを呼ぶ割合
+    unsigned max_arity = 3;
+    std::size_t top_levels = 10;
+    std::uint64_t call_budget = 256;  // 1回の呼び出しから推移的に呼ばれる回数の上限
+    std::uint32_t seed = 1;
+};
+
+// shapeの形をした.ksのソースを作る．同じshapeからは同じソースができる
+// 呼び出し先は前に定義したdefだけなので再帰はなく，実行時間はcall_budgetで抑えられる
+class CorpusGenerator
+{
+public:
+    explicit CorpusGenerator(const CorpusShape& shape) : shape{shape}, rng{shape.seed} {}
+
+    std::string generate()
+    {
+        std::ostringstream src;
+        for (auto& ext : externs)
+            src << "extern " << ext << "(x);\n";
+
+        for (std::size_t i = 0; i < shape.defs; ++i) {
+            auto arity = 1 + static_cast<unsigned>(next() % std::max(1u, shape.max_arity));
+            arities.push_back(arity);
+            calls_left = shape.fanout;
+            cost = 1;
+
+            src << "def f" << i << "(";
+            for (unsigned a = 0; a < arity; ++a)
+                src << (a ? ", " : "") << 'a' << a;
+            src << ")\n    ";
+            expr(src, shape.depth, arity);
+            src << ";\n";
+
+            costs.push_back(cost);
+        }
+
+        for (std::size_t i = 0; i < shape.top_levels && !arities.empty(); ++i) {
+            auto callee = next() % arities.size();
+            src << 'f' << callee << '(';
+            for (unsigned a = 0; a < arities[callee]; ++a)
+                src << (a ? ", " : "") << static_cast<double>(next() % 100) / 4;
+            src << ");\n";
+        }
+        return src.str();
+    }
+
+private:
+    // std::uniform_*_distributionは処理系ごとに結果が違うので，生の乱数から作る
+    std::uint64_t next() { return rng(); }
+    double uniform() { return static_cast<double>(next() % 1000000) / 1000000; }
+
+    void expr(std::ostringstream& src, unsigned depth, unsigned arity)
+    {
+        if (depth == 0 || uniform() < 0.25) {
+            leaf(src, depth, arity);
+            return;
+        }
+
+        if (uniform() < 0.1) {
+            src << "(if ";
+            expr(src, depth - 1, arity);
+            src << " < ";
+            expr(src, depth - 1, arity);
+            src << " then ";
+            expr(src, depth - 1, arity);
+            src << " else ";
+            expr(src, depth - 1, arity);
+            src << ')';
+            return;
+        }
+
+        static const char ops[] = {'+', '-', '*', '<'};
+        src << '(';
+        expr(src, depth - 1, arity);
+        src << ' ' << ops[next() % 4] << ' ';
+        expr(src, depth - 1, arity);
+        src << ')';
+    }
+
+    void leaf(std::ostringstream& src, unsigned depth, unsigned arity)
+    {
+        if (calls_left > 0 && uniform() < shape.call_density) {
+            if (uniform() < shape.extern_ratio) {
+                --calls_left;
+                src << externs[next() % externs.size()] << '(';
+                expr(src, depth ? depth - 1 : 0, arity);
+                src << ')';
+                return;
+            }
+            if (auto callee = pickCallee()) {
+                --calls_left;
+                cost += costs[*callee];
+                src << 'f' << *callee << '(';
+                for (unsigned a = 0; a < arities[*callee]; ++a) {
+                    src << (a ? ", " : "");
+                    expr(src, depth ? depth - 1 : 0, arity);
+                }
+                src << ')';
+                return;
+            }
+        }
+
+        if (next() % 2)
+            src << 'a' << next() % arity;
+        else
+            src << static_cast<double>(next() % 64) / 8;
+    }
+
+    // 呼んでも予算を超えないdefを選ぶ．なければ呼ばない
+    std::optional<std::size_t> pickCallee()
+    {
+        auto defined = costs.size();
+        if (defined == 0)
+            return std::nullopt;
+        for (int retry = 0; retry < 4; ++retry) {
+            auto callee = next() % defined;
+            if (cost + costs[callee] <= shape.call_budget)
+                return callee;
+        }
+        return std::nullopt;
+    }
+
+    CorpusShape shape;
+    std::mt19937_64 rng;
+    std::vector<std::string> externs = {"sin", "cos", "sqrt", "fabs", "exp", "log"};
+    std::vector<unsigned> arities;
+    std::vector<std::uint64_t> costs;  // defを1回呼んだときの推移的な呼び出し回数
+    unsigned calls_left = 0;
+    std::uint64_t cost = 0;
+};
+
+inline std::string generateCorpus(const CorpusShape& shape)
+{
+    return CorpusGenerator{shape}.generate();
+}
+
+// コマンドラインの --name value をshapeに反映する．nameが知らないものならfalse
+inline bool setShapeOption(CorpusShape& shape, std::string_view name, const char* value)
+{
+    if (name == "--defs")
+        shape.defs = std::stoul(value);
+    else if (name == "--depth")
+        shape.depth = std::stoul(value);
+    else if (name == "--fanout")
+        shape.fanout = std::stoul(value);
+    else if (name == "--density")
+        shape.call_density = std::stod(value);
+    else if (name == "--externs")
+        shape.extern_ratio = std::stod(value);
+    else if (name == "--arity")
+        shape.max_arity = std::stoul(value);
+    else if (name == "--top-levels")
+        shape.top_levels = std::stoul(value);
+    else if (name == "--budget")
+        shape.call_budget = std::stoull(value);
+    else if (name == "--seed")
+        shape.seed = std::stoul(value);
+    else
+        return false;
+    return true;
+}
+
+inline const char* shapeOptionsHelp()
+{
+    return "  --defs N        number of defs\n"
+           "  --depth N       max expression depth\n"
+           "  --fanout N      max calls in one def body\n"
+           "  --density P     probability that a leaf is a call\n"
+           "  --externs P     fraction of calls that go to externs\n"
+           "  --arity N       max number of parameters\n"
+           "  --top-levels N  number of top-level expressions\n"
+           "  --budget N      max transitive calls per call\n"
+           "  --seed N        random seed\n";
+}
+
+}  // namespace kaleidoscope::bench
@@ -0,0 +1,126 @@
+// N変数の目的関数の勾配を，@gradで作ったd_<name>と前進差分(N+1回の呼び出し)で求め，1回あたりの時間を比べる
+// 目的関数は拡張Rosenbrock関数にsinの項を足したものと，項ごとにifでどちらかを選ぶもの．差は前進差分の打ち切り誤差の大きさになる
+// ifの随伴は枝ごとに条件を付けるので，条件と偏微分の共通部分がCSEされるかが効く
+// usage: bench_gradient [N...]
+
+#include <kaleidoscope/interpreter.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace kaleidoscope;
+
+namespace
+{
+using Objective = double (*)(double*, std::int64_t);
+using Gradient = double (*)(double*, std::int64_t, double*, std::int64_t);
+
+// f(x0, ..., xN-1)と，ホストから同じ形で呼べるようにバッファから引数を並べるdef
+// branchesなら，各項はxiとxi+1の大小でRosenbrockの項かsinの項のどちらかになる
+std::string makeSource(std::size_t n, bool branches)
+{
+    std::ostringstream src;
+    src << "extern sin(x);\n@grad def f(";
+    for (std::size_t i = 0; i < n; ++i)
+        src << (i ? ", " : "") << 'x' << i;
+    src << ") 0";
+    for (std::size_t i = 0; i + 1 < n; ++i) {
+        auto x = "x" + std::to_string(i), y = "x" + std::to_string(i + 1);
+        std::ostringstream rosen, wave;
+        rosen << "100 * (" << y << " - " << x << " * " << x << ") * (" << y << " - " << x << " * " << x << ")"
+              << " + (1 - " << x << ") * (1 - " << x << ")";
+        wave << "sin(" << x << " * " << y << ")";
+        if (branches)
+            src << "\n    + (if " << x << " < " << y << " then " << rosen.str() << " else " << wave.str() << ")";
+        else
+            src << "\n    + " << rosen.str() << " + " << wave.str();
+    }
+    src << ";\n";
+
+    std::ostringstream args;
+    for (std::size_t i = 0; i < n; ++i)
+        args << "xs[" << i << "], ";
+    auto list = args.str();
+    src << "def objective(xs[]) f(" << list.substr(0, list.size() - 2) << ");\n";
+    src << "def gradient(xs[], grad[]) d_f(" << list << "grad);\n";
+    return src.str();
+}
+
+// 0.2秒以上かかるまで繰り返し，1回あたりの時間(ns)を返す
+template <class F>
+double nsPerCall(F&& f)
+{
+    using clock = std::chrono::steady_clock;
+    for (std::size_t reps = 1;; reps *= 2) {
+        auto start = clock::now();
+        for (std::size_t r = 0; r < reps; ++r)
+            f();
+        auto elapsed = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        if (elapsed > 2e8)
+            return elapsed / reps;
+    }
+}
+
+template <class Fn>
+Fn function(Interpreter& jit, const std::string& name)
+{
+    auto entry = jit.lookup(name);
+    return entry ? reinterpret_cast<Fn>(static_cast<intptr_t>(entry->address)) : nullptr;
+}
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    std::vector<std::size_t> sizes = {2, 8, 32, 128};
+    if (argc > 1) {
+        sizes.clear();
+        for (int i = 1; i < argc; ++i)
+            sizes.push_back(std::stoul(argv[i]));
+    }
+
+    std::cout << "objective\tN\treverse(ns)\tfinite-diff(ns)\tspeedup\tmax-diff" << std::endl;
+    for (auto branches : {false, true}) {
+        for (auto n : sizes) {
+            std::istringstream no_input;
+            Interpreter jit{no_input, "bench-gradient"};
+            jit.eval(makeSource(n, branches));
+            auto objective = function<Objective>(jit, "objective");
+            auto gradient = function<Gradient>(jit, "gradient");
+            auto label = branches ? "if" : "smooth";
+            if (!objective || !gradient) {
+                std::cerr << label << ", N = " << n << ": failed to compile" << std::endl;
+                return 1;
+            }
+
+            std::vector<double> xs(n), ad(n), fd(n), work(n);
+            for (std::size_t i = 0; i < n; ++i)
+                xs[i] = std::cos(0.7 * i) * 1.5;
+
+            auto reverse = nsPerCall([&] { gradient(xs.data(), n, ad.data(), n); });
+
+            // 前進差分: f(x)を1回と，変数ごとにずらしてN回
+            auto finite = nsPerCall([&] {
+                work = xs;
+                auto f0 = objective(work.data(), n);
+                for (std::size_t i = 0; i < n; ++i) {
+                    auto h = std::sqrt(std::numeric_limits<double>::epsilon()) * std::max(1.0, std::abs(xs[i]));
+                    work[i] = xs[i] + h;
+                    fd[i] = (objective(work.data(), n) - f0) / h;
+                    work[i] = xs[i];
+                }
+            });
+
+            double diff = 0;
+            for (std::size_t i = 0; i < n; ++i)
+                diff = std::max(diff, std::abs(ad[i] - fd[i]) / std::max(1.0, std::abs(ad[i])));
+            std::cout << label << '\t' << n << '\t' << reverse << '\t' << finite << '\t' << finite / reverse << '\t' << diff << std::endl;
+        }
+    }
+}
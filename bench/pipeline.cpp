@@ -0,0 +1,183 @@
+// 字句解析からJITした関数の実行まで，各段階のマイクロベンチマーク
+// 結果をJSONで残すには --benchmark_out=<file> --benchmark_out_format=json を付ける
+
+#include "generator.hpp"
+
+#include <kaleidoscope/parser.hpp>
+
+#include <benchmark/benchmark.h>
+#include <llvm/Support/TargetSelect.h>
+
+#include <sstream>
+
+using namespace kaleidoscope;
+
+namespace
+{
+bench::CorpusShape shapeOf(const benchmark::State& state)
+{
+    bench::CorpusShape shape;
+    shape.defs = state.range(0);
+    shape.top_levels = 0;
+    return shape;
+}
+
+// 関数定義を1つずつコンパイルし，JITに追加するまでを行う
+struct Compiler
+{
+    Compiler() : env{"bench"} {}
+
+    void compile(const std::string& src, bool add_to_jit)
+    {
+        std::istringstream input{src};
+        Parser parser{Tokenizer{input}};
+        parser.setExternHandler([&](std::unique_ptr<PrototypeAST> ext) {
+            if (ext->codegen(env))
+                env.proto_func[ext->getName()] = std::move(ext);
+        });
+        parser.setDefHandler([&](std::unique_ptr<FunctionAST> def) {
+            if (!def->codegen(env))
+                return;
+            ++defs;
+            if (add_to_jit) {
+                env.addModule(std::move(env.module));
+                benchmark::DoNotOptimize(llvm::cantFail(env.JIT->findSymbol(def->getProto().getName()).getAddress()));
+            }
+            env.initModAndPassManager("bench");
+        });
+        while (parser.parse())
+            ;
+    }
+
+    CodeGenEnv env;
+    std::size_t defs = 0;
+};
+
+void BM_Tokenize(benchmark::State& state)
+{
+    auto src = bench::generateCorpus(shapeOf(state));
+    std::size_t tokens = 0;
+    for (auto _ : state) {
+        std::istringstream input{src};
+        Tokenizer tok{input};
+        while (!token::is_eof(tok.getNextToken()))
+            ++tokens;
+    }
+    state.SetBytesProcessed(state.iterations() * src.size());
+    state.counters["tokens/s"] = benchmark::Counter(tokens, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Tokenize)->Arg(100)->Arg(1000);
+
+void BM_Parse(benchmark::State& state)
+{
+    auto src = bench::generateCorpus(shapeOf(state));
+    for (auto _ : state) {
+        std::istringstream input{src};
+        Parser parser{Tokenizer{input}};
+        parser.setDefHandler([](std::unique_ptr<FunctionAST> def) { benchmark::DoNotOptimize(def.get()); });
+        while (parser.parse())
+            ;
+    }
+    state.SetBytesProcessed(state.iterations() * src.size());
+    state.counters["defs/s"] = benchmark::Counter(state.iterations() * state.range(0), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Parse)->Arg(100)->Arg(1000);
+
+// codegenと関数単位の最適化．JITには渡さない
+void BM_CodegenPerDef(benchmark::State& state)
+{
+    auto src = bench::generateCorpus(shapeOf(state));
+    std::size_t defs = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto compiler = std::make_unique<Compiler>();
+        state.ResumeTiming();
+
+        compiler->compile(src, false);
+        defs += compiler->defs;
+
+        state.PauseTiming();
+        compiler.reset();
+        state.ResumeTiming();
+    }
+    state.counters["defs/s"] = benchmark::Counter(defs, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_CodegenPerDef)->Arg(100)->Unit(benchmark::kMillisecond);
+
+// codegenから機械語になって呼べるようになるまで
+void BM_JITCompile(benchmark::State& state)
+{
+    auto src = bench::generateCorpus(shapeOf(state));
+    std::size_t defs = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto compiler = std::make_unique<Compiler>();
+        state.ResumeTiming();
+
+        compiler->compile(src, true);
+        defs += compiler->defs;
+
+        state.PauseTiming();
+        compiler.reset();
+        state.ResumeTiming();
+    }
+    state.counters["defs/s"] = benchmark::Counter(defs, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_JITCompile)->Arg(100)->Unit(benchmark::kMillisecond);
+
+// JITに載っているmoduleの数に対するシンボル検索の時間
+void BM_SymbolLookup(benchmark::State& state)
+{
+    Compiler compiler;
+    compiler.compile(bench::generateCorpus(shapeOf(state)), true);
+
+    std::vector<std::string> names;
+    for (std::size_t i = 0; i < compiler.defs; ++i)
+        names.push_back("f" + std::to_string(i));
+
+    std::size_t i = 0;
+    for (auto _ : state) {
+        auto sym = compiler.env.JIT->findSymbol(names[i++ % names.size()]);
+        benchmark::DoNotOptimize(llvm::cantFail(sym.getAddress()));
+    }
+}
+BENCHMARK(BM_SymbolLookup)->Arg(10)->Arg(100)->Arg(1000);
+
+// JITした関数の実行
+void BM_Execute(benchmark::State& state)
+{
+    Compiler compiler;
+    compiler.compile(R"(
+        def fib(x) if x < 3 then 1 else fib(x - 1) + fib(x - 2);
+        def poly(x, y) (x * x + 3 * x * y - y) * (x - y) + 1;
+    )", true);
+
+    auto fib = reinterpret_cast<double (*)(double)>(
+        static_cast<intptr_t>(llvm::cantFail(compiler.env.JIT->findSymbol("fib").getAddress())));
+    auto poly = reinterpret_cast<double (*)(double, double)>(
+        static_cast<intptr_t>(llvm::cantFail(compiler.env.JIT->findSymbol("poly").getAddress())));
+
+    if (state.range(0) == 0) {
+        for (auto _ : state)
+            benchmark::DoNotOptimize(fib(20));
+    } else {
+        double x = 1;
+        for (auto _ : state)
+            benchmark::DoNotOptimize(x = poly(x, 0.5) * 1e-3);
+    }
+}
+BENCHMARK(BM_Execute)->ArgName("poly")->Arg(0)->Arg(1);
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+}
@@ -0,0 +1,123 @@
+// defの数Nを倍々にしながらInterpreterで合成プログラムを実行し，時間と最大RSSを測る
+// 隣り合うNの間の傾き log(t2/t1)/log(N2/N1) が1を大きく超えるところが超線形な部分
+// usage: bench_scaling [--min N] [--max N] [--hot-swap] [shape options]
+
+#include "generator.hpp"
+
+#include <kaleidoscope/interpreter.hpp>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <sstream>
+
+using namespace kaleidoscope;
+
+namespace
+{
+struct Sample
+{
+    std::size_t defs;
+    double seconds;
+    long max_rss_kb;
+};
+
+// 測定ごとに子プロセスで実行し，RSSの最大値が前の測定の影響を受けないようにする
+bool measure(const bench::CorpusShape& shape, const Interpreter::Config& config, Sample& sample)
+{
+    auto src = bench::generateCorpus(shape);
+
+    auto start = std::chrono::steady_clock::now();
+    auto pid = fork();
+    if (pid < 0)
+        return false;
+
+    if (pid == 0) {
+        // 評価結果の出力は捨てる
+        if (auto null = open("/dev/null", O_WRONLY); null >= 0)
+            dup2(null, STDOUT_FILENO);
+
+        std::istringstream input{src};
+        Interpreter interpreter{input, "scaling", config};
+        while (interpreter.run())
+            ;
+        _exit(0);
+    }
+
+    int status = 0;
+    rusage usage{};
+    if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return false;
+
+    sample.defs = shape.defs;
+    sample.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    sample.max_rss_kb = usage.ru_maxrss;  // Linuxではキロバイト
+    return true;
+}
+
+void usage(const char* prog)
+{
+    std::cerr << "usage: " << prog << " [options]\n"
+              << "  --min N         smallest number of defs (default 250)\n"
+              << "  --max N         largest number of defs (default 8000)\n"
+              << "  --hot-swap      call defs through stubs\n"
+              << bench::shapeOptionsHelp();
+}
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    std::size_t min_defs = 250, max_defs = 8000;
+    bench::CorpusShape shape;
+    shape.top_levels = 20;
+    Interpreter::Config config;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        try {
+            if (arg == "--hot-swap") {
+                config.hot_swap = true;
+            } else if (i + 1 < argc && arg == "--min") {
+                min_defs = std::stoul(argv[++i]);
+            } else if (i + 1 < argc && arg == "--max") {
+                max_defs = std::stoul(argv[++i]);
+            } else if (i + 1 < argc && bench::setShapeOption(shape, arg, argv[i + 1])) {
+                ++i;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } catch (const std::exception&) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::printf("%10s %12s %12s %12s %8s\n", "defs", "time [ms]", "us/def", "maxrss [MB]", "slope");
+
+    Sample prev{};
+    for (auto n = std::max<std::size_t>(min_defs, 1); n <= max_defs; n *= 2) {
+        shape.defs = n;
+        Sample sample;
+        if (!measure(shape, config, sample)) {
+            std::cerr << "run with " << n << " defs failed" << std::endl;
+            return 1;
+        }
+
+        std::printf("%10zu %12.1f %12.1f %12.1f", sample.defs, sample.seconds * 1e3, sample.seconds * 1e6 / sample.defs,
+            sample.max_rss_kb / 1024.0);
+        if (prev.defs)
+            std::printf(" %8.2f", std::log(sample.seconds / prev.seconds) / std::log(double(sample.defs) / prev.defs));
+        std::printf("\n");
+        std::fflush(stdout);
+        prev = sample;
+    }
+}
@@ -16,6 +16,7 @@
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
@@ -23,15 +24,20 @@
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/Attributes.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Mangler.h"
+#include "llvm/Object/ObjectFile.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+#include "kaleidoscope/SlabMemoryMapper.h"
 #include <algorithm>
 #include <map>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace llvm {
@@ -42,24 +48,70 @@ public:
     using ObjLayerT = LegacyRTDyldObjectLinkingLayer;
     using CompileLayerT = LegacyIRCompileLayer<ObjLayerT, SimpleCompiler>;
 
-    KaleidoscopeJIT()
+    // Host functions made visible to JIT'd code without a dlsym lookup.
+    // Attrs are applied to every declaration of the function.
+    struct HostSymbol {
+        JITTargetAddress Address;
+        std::vector<Attribute::AttrKind> Attrs;
+    };
+
+    explicit KaleidoscopeJIT(bool ProcessSymbols = true)
         : Resolver(createLegacyLookupResolver(
         ES,
         [this](const std::string &Name) { return findMangledSymbol(Name); },
         [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); })),
-          TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
+          // Target the host CPU so the loop vectorizer can use its full SIMD width.
+          TM(EngineBuilder().setMCPU(sys::getHostCPUName()).selectTarget()), DL(TM->createDataLayout()),
           ObjectLayer(AcknowledgeORCv1Deprecation, ES,
                       [this](VModuleKey) {
                         return ObjLayerT::Resources{
-                            std::make_shared<SectionMemoryManager>(), Resolver};
+                            std::make_shared<SectionMemoryManager>(&MemMapper),
+                            Resolver};
+                      },
+                      [this](VModuleKey K, const object::ObjectFile &Obj,
+                             const RuntimeDyld::LoadedObjectInfo &Info) {
+                        for (const auto &Sec : Obj.sections())
+                          if (Sec.isText()) {
+                            EmittedCodeSize += Sec.getSize();
+                            CodeSizes[K] += Sec.getSize();
+                          }
+                        for (auto *L : EventListeners)
+                          L->notifyObjectLoaded(K, Obj, Info);
+                      },
+                      ObjLayerT::NotifyFinalizedFtor(),
+                      [this](VModuleKey K, const object::ObjectFile &) {
+                        for (auto *L : EventListeners)
+                          L->notifyFreeingObject(K);
                       }),
           CompileLayer(AcknowledgeORCv1Deprecation, ObjectLayer,
-                       SimpleCompiler(*TM)) {
-        llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+                       SimpleCompiler(*TM)),
+          ProcessSymbols(ProcessSymbols) {
+        if (ProcessSymbols)
+            llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
     }
 
     TargetMachine &getTargetMachine() { return *TM; }
 
+    const DataLayout &getDataLayout() const { return DL; }
+
+    SlabMemoryMapper &getMemoryMapper() { return MemMapper; }
+
+    // Total size of the text sections of every object loaded so far.
+    size_t getEmittedCodeSize() const { return EmittedCodeSize; }
+
+    // Size of the text sections loaded for module K, 0 until it is emitted.
+    size_t getEmittedCodeSize(VModuleKey K) const {
+        auto I = CodeSizes.find(K);
+        return I != CodeSizes.end() ? I->second : 0;
+    }
+
+    // Notify L of every object loaded from now on, e.g. for perf or GDB.
+    // L is not owned and must outlive the JIT.
+    void addEventListener(JITEventListener *L) {
+        if (L)
+            EventListeners.push_back(L);
+    }
+
     VModuleKey addModule(std::unique_ptr<Module> M) {
         auto K = ES.allocateVModule();
         cantFail(CompileLayer.addModule(K, std::move(M)));
@@ -70,12 +122,29 @@ public:
     void removeModule(VModuleKey K) {
         ModuleKeys.erase(find(ModuleKeys, K));
         cantFail(CompileLayer.removeModule(K));
+        CodeSizes.erase(K);
     }
 
     JITSymbol findSymbol(const std::string Name) {
         return findMangledSymbol(mangle(Name));
     }
 
+    void addHostSymbol(const std::string &Name, JITTargetAddress Address,
+                       std::vector<Attribute::AttrKind> Attrs = {}) {
+        HostSymbols[mangle(Name)] = HostSymbol{Address, std::move(Attrs)};
+    }
+
+    template <class R, class... Args>
+    void addHostSymbol(const std::string &Name, R (*Fn)(Args...),
+                       std::vector<Attribute::AttrKind> Attrs = {}) {
+        addHostSymbol(Name, pointerToJITTargetAddress(Fn), std::move(Attrs));
+    }
+
+    const HostSymbol *findHostSymbol(const std::string &Name) {
+        auto I = HostSymbols.find(mangle(Name));
+        return I != HostSymbols.end() ? &I->second : nullptr;
+    }
+
 private:
     std::string mangle(const std::string &Name) {
         std::string MangledName;
@@ -100,6 +169,11 @@ private:
         const bool ExportedSymbolsOnly = true;
 #endif
 
+        // Registered host functions take precedence: they are resolved by a
+        // single hash lookup instead of a scan over every module plus dlsym.
+        if (auto I = HostSymbols.find(Name); I != HostSymbols.end())
+            return JITSymbol(I->second.Address, JITSymbolFlags::Exported);
+
         // Search modules in reverse order: from last added to first added.
         // This is the opposite of the usual search order for dlsym, but makes more
         // sense in a REPL where we want to bind to the newest available definition.
@@ -107,6 +181,9 @@ private:
             if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
                 return Sym;
 
+        if (!ProcessSymbols)
+            return nullptr;
+
         // If we can't find the symbol in the JIT, try looking in the host process.
         if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
             return JITSymbol(SymAddr, JITSymbolFlags::Exported);
@@ -128,9 +205,15 @@ private:
     std::shared_ptr<SymbolResolver> Resolver;
     std::unique_ptr<TargetMachine> TM;
     const DataLayout DL;
+    SlabMemoryMapper MemMapper; // must outlive the memory managers in ObjectLayer
     ObjLayerT ObjectLayer;
     CompileLayerT CompileLayer;
     std::vector<VModuleKey> ModuleKeys;
+    std::unordered_map<std::string, HostSymbol> HostSymbols;
+    bool ProcessSymbols;
+    size_t EmittedCodeSize = 0;
+    std::unordered_map<VModuleKey, size_t> CodeSizes;
+    std::vector<JITEventListener *> EventListeners;
 };
 
 } // end namespace orc
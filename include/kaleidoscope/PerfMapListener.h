@@ -0,0 +1,96 @@
+//===- PerfMapListener.h - perf map file for JIT'd code ---------*- C++ -*-===//
+//
+// Appends "START SIZE NAME" lines to /tmp/perf-<pid>.map for every function
+// in each object the JIT loads, so that `perf report` can symbolize samples
+// that land in JIT'd code. Unlike jitdump this needs no `perf inject` step.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_PERFMAPLISTENER_H
+#define KALEIDOSCOPE_PERFMAPLISTENER_H
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+
+namespace llvm {
+namespace orc {
+
+class PerfMapListener final : public JITEventListener {
+public:
+    // perf reads a single map file per process, so every JIT shares one
+    // listener.
+    static PerfMapListener &get() {
+        static PerfMapListener Instance;
+        return Instance;
+    }
+
+    void notifyObjectLoaded(ObjectKey, const object::ObjectFile &Obj,
+                            const RuntimeDyld::LoadedObjectInfo &L) override {
+        // The debug object has its sections moved to their load addresses.
+        auto DebugObj = L.getObjectForDebug(Obj);
+        if (!DebugObj.getBinary())
+            return;
+
+        std::lock_guard<std::mutex> Lock(M);
+        if (!Out)
+            return;
+
+        for (const auto &P : object::computeSymbolSizes(*DebugObj.getBinary())) {
+            const object::SymbolRef &Sym = P.first;
+            auto Type = Sym.getType();
+            if (!Type) {
+                consumeError(Type.takeError());
+                continue;
+            }
+            if (*Type != object::SymbolRef::ST_Function || P.second == 0)
+                continue;
+
+            auto Name = Sym.getName();
+            if (!Name) {
+                consumeError(Name.takeError());
+                continue;
+            }
+            auto Addr = Sym.getAddress();
+            if (!Addr) {
+                consumeError(Addr.takeError());
+                continue;
+            }
+
+            *Out << format("%llx %llx ", static_cast<unsigned long long>(*Addr),
+                           static_cast<unsigned long long>(P.second))
+                 << *Name << '\n';
+        }
+        Out->flush();
+    }
+
+    // perf keeps the last mapping for an address range, so removed code needs
+    // no entry.
+    void notifyFreeingObject(ObjectKey) override {}
+
+private:
+    PerfMapListener() {
+        std::string Path =
+            "/tmp/perf-" + std::to_string(::getpid()) + ".map";
+        std::error_code EC;
+        Out = std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Append);
+        if (EC) {
+            errs() << "cannot open " << Path << ": " << EC.message() << '\n';
+            Out.reset();
+        }
+    }
+
+    std::mutex M;
+    std::unique_ptr<raw_fd_ostream> Out;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_PERFMAPLISTENER_H
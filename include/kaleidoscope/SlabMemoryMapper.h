@@ -0,0 +1,148 @@
+//===- SlabMemoryMapper.h - Pooled memory for JIT'd sections ----*- C++ -*-===//
+//
+// Hands out page-aligned blocks carved from large slabs and keeps released
+// blocks on a free list, so that adding and removing modules does not map and
+// unmap memory every time.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_SLABMEMORYMAPPER_H
+#define KALEIDOSCOPE_SLABMEMORYMAPPER_H
+
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+class SlabMemoryMapper final : public SectionMemoryManager::MemoryMapper {
+public:
+    explicit SlabMemoryMapper(size_t SlabSize = 1 << 20)
+        : PageSize(sys::Process::getPageSizeEstimate()),
+          SlabSize(alignTo(SlabSize, PageSize)) {}
+
+    SlabMemoryMapper(const SlabMemoryMapper &) = delete;
+    SlabMemoryMapper &operator=(const SlabMemoryMapper &) = delete;
+
+    ~SlabMemoryMapper() override {
+        for (auto &Slab : Slabs)
+            sys::Memory::releaseMappedMemory(Slab);
+    }
+
+    sys::MemoryBlock
+    allocateMappedMemory(SectionMemoryManager::AllocationPurpose Purpose,
+                         size_t NumBytes, const sys::MemoryBlock *const NearBlock,
+                         unsigned Flags, std::error_code &EC) override {
+        // Protection is per page, so every block covers whole pages and no two
+        // blocks share a page.
+        size_t Size = alignTo(NumBytes, PageSize);
+        std::lock_guard<std::mutex> Lock(M);
+
+        char *Addr = takeFree(Size);
+        if (!Addr) {
+            auto Slab = sys::Memory::allocateMappedMemory(
+                std::max(Size, SlabSize), nullptr,
+                sys::Memory::MF_READ | sys::Memory::MF_WRITE, EC);
+            if (EC)
+                return sys::MemoryBlock();
+            Slabs.push_back(Slab);
+            Reserved += Slab.allocatedSize();
+            Addr = static_cast<char *>(Slab.base());
+            if (Slab.allocatedSize() > Size)
+                Free[Addr + Size] = Slab.allocatedSize() - Size;
+        }
+
+        InUse += Size;
+        sys::MemoryBlock Block(Addr, Size);
+        EC = sys::Memory::protectMappedMemory(Block, Flags);
+        return Block;
+    }
+
+    std::error_code protectMappedMemory(const sys::MemoryBlock &Block,
+                                        unsigned Flags) override {
+        return sys::Memory::protectMappedMemory(Block, Flags);
+    }
+
+    std::error_code releaseMappedMemory(sys::MemoryBlock &Block) override {
+        auto Addr = static_cast<char *>(Block.base());
+        size_t Size = Block.allocatedSize();
+        if (!Addr)
+            return std::error_code();
+
+        // Leave freed pages writable and never executable.
+        auto EC = sys::Memory::protectMappedMemory(
+            Block, sys::Memory::MF_READ | sys::Memory::MF_WRITE);
+
+        std::lock_guard<std::mutex> Lock(M);
+        InUse -= Size;
+        addFree(Addr, Size);
+        Block = sys::MemoryBlock();
+        return EC;
+    }
+
+    // Bytes currently handed out to memory managers.
+    size_t bytesInUse() const {
+        std::lock_guard<std::mutex> Lock(M);
+        return InUse;
+    }
+
+    // Bytes mapped for slabs, including free blocks.
+    size_t bytesReserved() const {
+        std::lock_guard<std::mutex> Lock(M);
+        return Reserved;
+    }
+
+private:
+    // Best fit from the free list; the rest of the block stays free.
+    char *takeFree(size_t Size) {
+        auto Best = Free.end();
+        for (auto I = Free.begin(); I != Free.end(); ++I)
+            if (I->second >= Size && (Best == Free.end() || I->second < Best->second))
+                Best = I;
+        if (Best == Free.end())
+            return nullptr;
+
+        char *Addr = Best->first;
+        size_t Rest = Best->second - Size;
+        Free.erase(Best);
+        if (Rest)
+            Free[Addr + Size] = Rest;
+        return Addr;
+    }
+
+    // Inserts a block and merges it with its free neighbours.
+    void addFree(char *Addr, size_t Size) {
+        auto Next = Free.lower_bound(Addr);
+        if (Next != Free.end() && Addr + Size == Next->first) {
+            Size += Next->second;
+            Next = Free.erase(Next);
+        }
+        if (Next != Free.begin()) {
+            auto Prev = std::prev(Next);
+            if (Prev->first + Prev->second == Addr) {
+                Prev->second += Size;
+                return;
+            }
+        }
+        Free[Addr] = Size;
+    }
+
+    const size_t PageSize;
+    const size_t SlabSize;
+
+    mutable std::mutex M;
+    std::vector<sys::MemoryBlock> Slabs;
+    std::map<char *, size_t> Free;
+    size_t InUse = 0;
+    size_t Reserved = 0;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_SLABMEMORYMAPPER_H
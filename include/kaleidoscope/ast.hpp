@@ -1,36 +1,128 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <memory>
+#include <unordered_set>
 
 #include <llvm/IR/Value.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/DIBuilder.h>
 
-#include <llvm/IR/LegacyPassManager.h>
-#include <llvm/Transforms/InstCombine/InstCombine.h>
-#include <llvm/Transforms/Scalar.h>
 
 #include <kaleidoscope/KaleidoscopeJIT.h>
+#include <kaleidoscope/engine.hpp>
+#include <kaleidoscope/runtime.hpp>
+#include <kaleidoscope/session.hpp>
+#include <kaleidoscope/stats.hpp>
 
 namespace kaleidoscope
 {
 
+struct Adjoints;
 struct CodeGenEnv;
+struct ExprAST;
+
+// ハッシュコンシングで部分木を共有することがあるのでshared_ptr
+using ExprPtr = std::shared_ptr<ExprAST>;
+
+inline std::size_t hashCombine(std::size_t seed, std::size_t v)
+{
+    return seed ^ (v + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+// 値の型．注釈がなければf64
+// 式の型は子から決まる(codegenで推論する)．二項演算やifの枝は i64 < f32 < f64 の広い方に揃え，
+// 数値リテラルは相手の型で表せればその型になる．forの変数とlen(xs)はi64
+enum class ValueType : std::uint8_t
+{
+    f64,
+    f32,
+    i64,
+};
+
+inline std::optional<ValueType> parseValueType(std::string_view name)
+{
+    if (name == "f64")
+        return ValueType::f64;
+    if (name == "f32")
+        return ValueType::f32;
+    if (name == "i64")
+        return ValueType::i64;
+    return std::nullopt;
+}
 
 struct ExprAST
 {
     virtual ~ExprAST() = default;
     virtual llvm::Value* codegen(CodeGenEnv&) = 0;  // llvm::ValueはSSAでのレジスタを表す
+
+    // 式の中で呼び出している関数の名前を集める
+    virtual void collectCallees(std::unordered_set<std::string>&) const = 0;
+
+    // 定数畳み込みなどで簡単にした式を返す．変わらなければnullptr
+    virtual ExprPtr simplify() { return nullptr; }
+
+    // 逆モードの自動微分(autodiff.cpp)
+    // childrenは子の式を並べる．backpropはこのノードの随伴adjoint(出力をこのノードで微分したもの)を子に配る
+    // 微分できない式ならfalse
+    virtual void children(std::vector<ExprPtr>&) const {}
+    virtual bool backprop(Adjoints&, const ExprPtr&) const { return false; }
+
+    // 構造が同じ式は同じハッシュ値を持ち，equalsが真になる
+    std::size_t hash() const
+    {
+        if (!hashed) {
+            hash_value = computeHash();
+            hashed = true;
+        }
+        return hash_value;
+    }
+    virtual bool equals(const ExprAST&) const = 0;
+
+protected:
+    virtual std::size_t computeHash() const = 0;
+    void invalidateHash() { hashed = false; }
+
+    // ハッシュコンシングされた部分木はポインタの比較だけで済む
+    static bool same(const ExprPtr& a, const ExprPtr& b) { return a == b || a->equals(*b); }
+
+private:
+    mutable std::size_t hash_value = 0;
+    mutable bool hashed = false;
 };
 
 struct NumberExpAST : ExprAST
 {
     explicit NumberExpAST(double val) : val{val} {}
 
+    [[nodiscard]] double getValue() const { return val; }
+
     llvm::Value* codegen(CodeGenEnv&) override;
+    void collectCallees(std::unordered_set<std::string>&) const override {}
+    bool backprop(Adjoints&, const ExprPtr&) const override { return true; }
+
+    bool equals(const ExprAST& other) const override
+    {
+        auto e = dynamic_cast<const NumberExpAST*>(&other);
+        return e && std::memcmp(&val, &e->val, sizeof(double)) == 0;  // -0.0と0.0は区別する
+    }
 
 private:
+    std::size_t computeHash() const override
+    {
+        std::uint64_t bits;
+        std::memcpy(&bits, &val, sizeof(bits));
+        return hashCombine(0, std::hash<std::uint64_t>{}(bits));
+    }
+
     double val;
 };
 
@@ -38,106 +130,600 @@ struct VariableExprAST : ExprAST
 {
     explicit VariableExprAST(std::string name) : name{std::move(name)} {}
 
+    [[nodiscard]] const std::string& getName() const { return name; }
+
     llvm::Value* codegen(CodeGenEnv&) override;
+    void collectCallees(std::unordered_set<std::string>&) const override {}
+    bool backprop(Adjoints&, const ExprPtr&) const override { return true; }  // 変数の随伴がそのまま偏微分になる
+
+    bool equals(const ExprAST& other) const override
+    {
+        auto e = dynamic_cast<const VariableExprAST*>(&other);
+        return e && name == e->name;
+    }
 
 private:
+    std::size_t computeHash() const override { return hashCombine(1, std::hash<std::string>{}(name)); }
+
     std::string name;
 };
 
 struct BinaryExprAST : ExprAST
 {
-    BinaryExprAST(std::string op, std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs)
+    BinaryExprAST(std::string op, ExprPtr lhs, ExprPtr rhs)
         : op{std::move(op)}, lhs{std::move(lhs)}, rhs{std::move(rhs)} {}
 
     llvm::Value* codegen(CodeGenEnv&) override;
+    void collectCallees(std::unordered_set<std::string>& callees) const override
+    {
+        lhs->collectCallees(callees);
+        rhs->collectCallees(callees);
+    }
+    ExprPtr simplify() override;
+    void children(std::vector<ExprPtr>& out) const override { out.insert(out.end(), {lhs, rhs}); }
+    bool backprop(Adjoints&, const ExprPtr& adjoint) const override;
+
+    bool equals(const ExprAST& other) const override
+    {
+        auto e = dynamic_cast<const BinaryExprAST*>(&other);
+        return e && op == e->op && same(lhs, e->lhs) && same(rhs, e->rhs);
+    }
 
 private:
+    std::size_t computeHash() const override
+    {
+        return hashCombine(hashCombine(hashCombine(2, std::hash<std::string>{}(op)), lhs->hash()), rhs->hash());
+    }
+
     std::string op;
-    std::unique_ptr<ExprAST> lhs, rhs;
+    ExprPtr lhs, rhs;
 };
 
 struct CallExprAST : ExprAST
 {
-    CallExprAST(std::string callee, std::vector<std::unique_ptr<ExprAST>> args)
+    CallExprAST(std::string callee, std::vector<ExprPtr> args)
         : callee{std::move(callee)}, args{std::move(args)} {}
 
     llvm::Value* codegen(CodeGenEnv&) override;
+    void collectCallees(std::unordered_set<std::string>& callees) const override
+    {
+        callees.insert(callee);
+        for (auto& arg : args)
+            arg->collectCallees(callees);
+    }
+    ExprPtr simplify() override;
+    void children(std::vector<ExprPtr>& out) const override { out.insert(out.end(), args.begin(), args.end()); }
+    bool backprop(Adjoints&, const ExprPtr& adjoint) const override;
+
+    bool equals(const ExprAST& other) const override
+    {
+        auto e = dynamic_cast<const CallExprAST*>(&other);
+        if (!e || callee != e->callee || args.size() != e->args.size())
+            return false;
+        for (size_t i = 0; i < args.size(); ++i)
+            if (!same(args[i], e->args[i]))
+                return false;
+        return true;
+    }
 
 private:
+    std::size_t computeHash() const override
+    {
+        auto h = hashCombine(3, std::hash<std::string>{}(callee));
+        for (auto& arg : args)
+            h = hashCombine(h, arg->hash());
+        return h;
+    }
+
     std::string callee;
-    std::vector<std::unique_ptr<ExprAST>> args;
+    std::vector<ExprPtr> args;
+};
+
+// if cond then a else b: condが0.0でなければa
+struct IfExprAST : ExprAST
+{
+    IfExprAST(ExprPtr cond, ExprPtr then, ExprPtr els)
+        : cond{std::move(cond)}, then{std::move(then)}, els{std::move(els)} {}
+
+    llvm::Value* codegen(CodeGenEnv&) override;
+    void collectCallees(std::unordered_set<std::string>& callees) const override
+    {
+        cond->collectCallees(callees);
+        then->collectCallees(callees);
+        els->collectCallees(callees);
+    }
+    ExprPtr simplify() override;
+    void children(std::vector<ExprPtr>& out) const override { out.insert(out.end(), {cond, then, els}); }
+    bool backprop(Adjoints&, const ExprPtr& adjoint) const override;
+
+    bool equals(const ExprAST& other) const override
+    {
+        auto e = dynamic_cast<const IfExprAST*>(&other);
+        return e && same(cond, e->cond) && same(then, e->then) && same(els, e->els);
+    }
+
+private:
+    std::size_t computeHash() const override
+    {
+        return hashCombine(hashCombine(hashCombine(4, cond->hash()), then->hash()), els->hash());
+    }
+
+    ExprPtr cond, then, els;
+};
+
+// xs[index]: バッファの要素を読む．indexは0に向かって整数に丸める．範囲外は未定義
+struct IndexExprAST : ExprAST
+{
+    IndexExprAST(std::string name, ExprPtr index) : name{std::move(name)}, index{std::move(index)} {}
+
+    llvm::Value* codegen(CodeGenEnv&) override;
+    void collectCallees(std::unordered_set<std::string>& callees) const override { index->collectCallees(callees); }
+    ExprPtr simplify() override;
+
+    bool equals(const ExprAST& other) const override
+    {
+        auto e = dynamic_cast<const IndexExprAST*>(&other);
+        return e && name == e->name && same(index, e->index);
+    }
+
+private:
+    std::size_t computeHash() const override
+    {
+        return hashCombine(hashCombine(5, std::hash<std::string>{}(name)), index->hash());
+    }
+
+    std::string name;
+    ExprPtr index;
+};
+
+// xs[index] = value: バッファの要素に書き，valueを返す
+struct StoreExprAST : ExprAST
+{
+    StoreExprAST(std::string name, ExprPtr index, ExprPtr value)
+        : name{std::move(name)}, index{std::move(index)}, value{std::move(value)} {}
+
+    llvm::Value* codegen(CodeGenEnv&) override;
+    void collectCallees(std::unordered_set<std::string>& callees) const override
+    {
+        index->collectCallees(callees);
+        value->collectCallees(callees);
+    }
+    ExprPtr simplify() override;
+
+    bool equals(const ExprAST& other) const override
+    {
+        auto e = dynamic_cast<const StoreExprAST*>(&other);
+        return e && name == e->name && same(index, e->index) && same(value, e->value);
+    }
+
+private:
+    std::size_t computeHash() const override
+    {
+        return hashCombine(hashCombine(hashCombine(6, std::hash<std::string>{}(name)), index->hash()), value->hash());
+    }
+
+    std::string name;
+    ExprPtr index, value;
+};
+
+// for var = start, end, step in body: varをstartからstepずつ増やし，endより小さい間bodyを評価する．値は0.0
+// varはi64で，start, end, stepは最初に一度だけ評価してi64に丸める．stepが正でなければ一度も回らない
+struct ForExprAST : ExprAST
+{
+    ForExprAST(std::string var, ExprPtr start, ExprPtr end, ExprPtr step, ExprPtr body)
+        : var{std::move(var)}, start{std::move(start)}, end{std::move(end)}, step{std::move(step)}, body{std::move(body)} {}
+
+    llvm::Value* codegen(CodeGenEnv&) override;
+    void collectCallees(std::unordered_set<std::string>& callees) const override
+    {
+        start->collectCallees(callees);
+        end->collectCallees(callees);
+        step->collectCallees(callees);
+        body->collectCallees(callees);
+    }
+    ExprPtr simplify() override;
+
+    bool equals(const ExprAST& other) const override
+    {
+        auto e = dynamic_cast<const ForExprAST*>(&other);
+        return e && var == e->var && same(start, e->start) && same(end, e->end) && same(step, e->step) &&
+               same(body, e->body);
+    }
+
+private:
+    std::size_t computeHash() const override
+    {
+        auto h = hashCombine(7, std::hash<std::string>{}(var));
+        for (auto* e : {&start, &end, &step, &body})
+            h = hashCombine(h, (*e)->hash());
+        return h;
+    }
+
+    std::string var;
+    ExprPtr start, end, step, body;
+};
+
+// parfor var = start, end in body: forと同じだが，範囲をチャンクに分けてスレッドプールで並列に回す．値は0.0
+// reduce(op, var = start, end in body): 各回のbodyの値をop(+, *, min, max)でまとめる．範囲が空なら単位元
+// bodyは別の関数に切り出され，外の変数はその時点の値が渡される．回の順序は決まっていない
+struct ParallelExprAST : ExprAST
+{
+    ParallelExprAST(std::string op, std::string var, ExprPtr start, ExprPtr end, ExprPtr body)
+        : op{std::move(op)}, var{std::move(var)}, start{std::move(start)}, end{std::move(end)}, body{std::move(body)} {}
+
+    llvm::Value* codegen(CodeGenEnv&) override;
+    void collectCallees(std::unordered_set<std::string>& callees) const override
+    {
+        start->collectCallees(callees);
+        end->collectCallees(callees);
+        body->collectCallees(callees);
+    }
+    ExprPtr simplify() override;
+
+    bool equals(const ExprAST& other) const override
+    {
+        auto e = dynamic_cast<const ParallelExprAST*>(&other);
+        return e && op == e->op && var == e->var && same(start, e->start) && same(end, e->end) && same(body, e->body);
+    }
+
+private:
+    std::size_t computeHash() const override
+    {
+        auto h = hashCombine(hashCombine(8, std::hash<std::string>{}(op)), std::hash<std::string>{}(var));
+        for (auto* e : {&start, &end, &body})
+            h = hashCombine(h, (*e)->hash());
+        return h;
+    }
+
+    std::string op;  // parforなら空
+    std::string var;
+    ExprPtr start, end, body;
+};
+
+// 式を順に評価し，最後の値を返す．ソースには書けず，自動微分で作るdefの本体に使う
+struct SeqExprAST : ExprAST
+{
+    explicit SeqExprAST(std::vector<ExprPtr> exprs) : exprs{std::move(exprs)} {}
+
+    llvm::Value* codegen(CodeGenEnv&) override;
+    void collectCallees(std::unordered_set<std::string>& callees) const override
+    {
+        for (auto& e : exprs)
+            e->collectCallees(callees);
+    }
+    ExprPtr simplify() override;
+
+    bool equals(const ExprAST& other) const override
+    {
+        auto e = dynamic_cast<const SeqExprAST*>(&other);
+        if (!e || exprs.size() != e->exprs.size())
+            return false;
+        for (size_t i = 0; i < exprs.size(); ++i)
+            if (!same(exprs[i], e->exprs[i]))
+                return false;
+        return true;
+    }
+
+private:
+    std::size_t computeHash() const override
+    {
+        auto h = hashCombine(9, exprs.size());
+        for (auto& e : exprs)
+            h = hashCombine(h, e->hash());
+        return h;
+    }
+
+    std::vector<ExprPtr> exprs;
+};
+
+// 構造が同じ部分木を1つのノードで共有するノードの生成器(hash-consing)
+// 子は生成済みのノードなので，同じ部分木はポインタの比較で見つかる
+struct ExprFactory
+{
+    template <class T, class... Args>
+    ExprPtr make(Args&&... args)
+    {
+        ExprPtr node = std::make_shared<T>(std::forward<Args>(args)...);
+        ++created;
+        if (!enabled)
+            return node;
+        return *nodes.insert(std::move(node)).first;
+    }
+
+    // 登録済みのノードを忘れる．ノード自体は使っている側が持ち続ける
+    void clear() { nodes.clear(); }
+
+    bool enabled = false;
+    std::size_t created = 0;  // 作ったノードの数．共有されて捨てられたものも含む
+
+private:
+    struct Hash
+    {
+        std::size_t operator()(const ExprPtr& e) const { return e->hash(); }
+    };
+    struct Equal
+    {
+        bool operator()(const ExprPtr& a, const ExprPtr& b) const { return a == b || a->equals(*b); }
+    };
+    std::unordered_set<ExprPtr, Hash, Equal> nodes;
 };
 
 //  関数の宣言
+// xs[]と書いた引数はバッファで，要素の配列の先頭(noalias)と要素数(int64_t)の2つの引数になる
+// noaliasなので，呼び出しで同じバッファを2つのバッファの引数に渡すことはできない
+// 引数と戻り値は x: f32 のように型を書ける．バッファの型は要素の型
 struct PrototypeAST
 {
-    PrototypeAST(std::string name, std::vector<std::string> args)
-        : name{std::move(name)}, args{std::move(args)} {}
+    PrototypeAST(std::string name, std::vector<std::string> args, bool is_extern = false, std::vector<bool> buffers = {},
+                 std::vector<ValueType> types = {}, ValueType ret = ValueType::f64)
+        : name{std::move(name)}, args{std::move(args)}, buffers{std::move(buffers)}, types{std::move(types)}, ret{ret},
+          is_extern{is_extern}
+    {
+        this->buffers.resize(this->args.size());
+        this->types.resize(this->args.size(), ValueType::f64);
+    }
 
     [[nodiscard]] std::string& getName() { return name; }
+    [[nodiscard]] size_t arity() const { return args.size(); }
+    [[nodiscard]] const std::vector<std::string>& getArgs() const { return args; }
+    [[nodiscard]] const std::vector<bool>& getBuffers() const { return buffers; }
+    [[nodiscard]] bool isBuffer(size_t i) const { return buffers.at(i); }
+    [[nodiscard]] bool hasBuffers() const { return std::find(buffers.begin(), buffers.end(), true) != buffers.end(); }
+    [[nodiscard]] const std::vector<ValueType>& getTypes() const { return types; }
+    [[nodiscard]] ValueType getType(size_t i) const { return types.at(i); }
+    [[nodiscard]] ValueType getReturnType() const { return ret; }
+
+    // 引数と戻り値が全てdoubleか．ホストからdouble(*)(double...)として呼べる
+    [[nodiscard]] bool isDoubles() const
+    {
+        return !hasBuffers() && ret == ValueType::f64 &&
+               std::all_of(types.begin(), types.end(), [](ValueType t) { return t == ValueType::f64; });
+    }
+
+    // 呼び出し方が同じか．名前は比べない
+    [[nodiscard]] bool sameSignature(const PrototypeAST& other) const
+    {
+        return buffers == other.buffers && types == other.types && ret == other.ret;
+    }
+    [[nodiscard]] bool isExtern() const { return is_extern; }
+    [[nodiscard]] bool isPure() const { return pure; }
+    [[nodiscard]] bool isMemo() const { return memo; }
+    [[nodiscard]] bool isCaching() const { return caching; }
+    [[nodiscard]] bool isGrad() const { return grad; }
+    [[nodiscard]] unsigned getLine() const { return line; }
+
+    void setPure(bool p) { pure = p; }
+    void setMemo(bool m) { memo = m; }
+    void setCaching(bool c) { caching = c; }
+    void setGrad(bool g) { grad = g; }
+    void setLine(unsigned l) { line = l; }
 
     llvm::Function* codegen(CodeGenEnv&);
+    llvm::Function* codegen(CodeGenEnv&, const std::string& symbol);  // 関数名をsymbolにする
+
+    std::size_t hash() const
+    {
+        auto h = hashCombine(hashCombine(std::hash<std::string>{}(name), memo), grad);
+        for (size_t i = 0; i < args.size(); ++i)
+            h = hashCombine(hashCombine(hashCombine(h, std::hash<std::string>{}(args[i])), buffers[i]),
+                            static_cast<std::size_t>(types[i]));
+        return hashCombine(h, static_cast<std::size_t>(ret));
+    }
 
 private:
     std::string name;
     std::vector<std::string> args;
+    std::vector<bool> buffers;  // 引数ごとにバッファか
+    std::vector<ValueType> types;  // 引数ごとの型
+    ValueType ret;
+    bool is_extern;     // externで宣言されたか
+    bool pure = false;  // 副作用がなく，結果が引数だけで決まるか
+    bool memo = false;  // 結果をキャッシュするか(@memo)
+    bool caching = false;  // 自分か呼び出し先がメモ化のキャッシュを書き換えるか．純粋でもreadnoneにはできない
+    bool grad = false;  // 微分したd_<name>も定義するか(@grad)
+    unsigned line = 0;  // 関数名のある行．0なら不明
 };
 
 struct FunctionAST
 {
-    FunctionAST(std::unique_ptr<PrototypeAST> proto, std::unique_ptr<ExprAST> body)
+    FunctionAST(std::unique_ptr<PrototypeAST> proto, ExprPtr body)
         : proto{std::move(proto)}, body{std::move(body)} {}
 
+    [[nodiscard]] PrototypeAST& getProto() { return *proto; }
+
     llvm::Function* codegen(CodeGenEnv&);
 
+    // 逆モードの自動微分で d_<name>(args..., grad[]) を作る(autodiff.cpp)
+    // gradのi番目にi番目の引数での偏微分を書き，このdefと同じ値を返す．本体を一度たどるだけで全ての偏微分が出る
+    // 導関数に使うlibmの関数のうち，まだ宣言されていないもののexternをexternsに足す．微分できなければnullptr
+    std::unique_ptr<FunctionAST> gradient(CodeGenEnv&, std::vector<std::unique_ptr<PrototypeAST>>& externs) const;
+
+    void collectCallees(std::unordered_set<std::string>& callees) const { body->collectCallees(callees); }
+    std::size_t hash() const { return hashCombine(proto->hash(), body->hash()); }
+
 private:
+    bool isPure(CodeGenEnv&, const std::string& name) const;
+    bool isMemoizable(CodeGenEnv&, const std::string& name) const;
+    bool isCaching(CodeGenEnv&, const std::string& name) const;  // メモ化したdefを推移的に呼ぶか
+
     std::unique_ptr<PrototypeAST> proto;
-    std::unique_ptr<ExprAST> body;
+    ExprPtr body;
 };
 
 struct CodeGenEnv
 {
+    // 自分だけのEngineを作る．シンボル名はソースの名前のまま
+    explicit CodeGenEnv(const std::string& mod_name, bool process_symbols = true,
+                        std::size_t threads = std::thread::hardware_concurrency())
+        : CodeGenEnv(mod_name, std::make_shared<Engine>(process_symbols, threads), "")
+    {
+    }
 
-    explicit CodeGenEnv(const std::string& mod_name)
-        : builder(context), JIT{std::make_unique<llvm::orc::KaleidoscopeJIT>()}
+    // engineを他のCodeGenEnvと共有する．defのシンボル名にはsymbol_prefixを付けて区別する
+    CodeGenEnv(const std::string& mod_name, std::shared_ptr<Engine> engine, std::string symbol_prefix)
+        : engine{std::move(engine)},
+          context{std::make_unique<llvm::LLVMContext>()},
+          builder{std::make_unique<llvm::IRBuilder<>>(*context)},
+          JIT{&this->engine->JIT},
+          session{&this->engine->session},
+          symbol_prefix{std::move(symbol_prefix)}
     {
         initModAndPassManager(mod_name);
     }
 
+    // JITに追加したmoduleを全て取り除く．engineのmutexを取るので，持ったまま壊さないこと
+    ~CodeGenEnv();
+
+    CodeGenEnv(const CodeGenEnv&) = delete;
+    CodeGenEnv& operator=(const CodeGenEnv&) = delete;
+
+    // 次のdefやトップレベルの式を入れるmoduleを用意する．パスはsessionのものを使い回す
     void initModAndPassManager(const std::string& mod_name)
     {
-        module = std::make_unique<llvm::Module>(mod_name, context);
-        FPM = std::make_unique<llvm::legacy::FunctionPassManager>(module.get());
+        if (context_recycle_units && ++context_units > context_recycle_units)
+            recycleContext();
+        module = std::make_unique<llvm::Module>(mod_name, *context);
+        module->setDataLayout(JIT->getDataLayout());
+        if (debug_info)
+            initDebugInfo();
+    }
 
-        module->setDataLayout(JIT->getTargetMachine().createDataLayout());
+    // contextを作り直し，定数や型などのたまったものを捨てる．インライン展開用のIRだけは移す
+    // 作りかけのmoduleも捨てるので，codegenの途中では呼ばないこと
+    void recycleContext();
 
-        FPM->add(llvm::createInstructionCombiningPass());
-        FPM->add(llvm::createReassociatePass());
-        FPM->add(llvm::createNewGVNPass());
-        FPM->add(llvm::createCFGSimplificationPass());
-        FPM->doInitialization();
-    }
+    // moduleにDWARFのコンパイル単位を作る．finalizeDebugInfoはmoduleをJITに渡す前に呼ぶ
+    void initDebugInfo();
+    void finalizeDebugInfo();
+
+    // defやトップレベルの式をJITに登録するときの名前．externはソースの名前のまま
+    std::string symbolFor(const std::string& name) const { return symbol_prefix + name; }
+
+    // moduleをJITに追加し，このCodeGenEnvが壊れるときに取り除けるように覚えておく
+    llvm::orc::VModuleKey addModule(std::unique_ptr<llvm::Module> m);
+    void removeModule(llvm::orc::VModuleKey key);
 
     llvm::Function* getFunction(const std::string& name)
     {
-        if (auto* f = module->getFunction(name))
+        auto fi = proto_func.find(name);
+        auto symbol = fi != proto_func.end() && fi->second->isExtern() ? name : symbolFor(name);
+        if (auto* f = module->getFunction(symbol))
             return f;
 
-        if (auto fi = proto_func.find(name); fi != proto_func.end())
+        if (fi != proto_func.end())
             return fi->second->codegen(*this);
 
         return nullptr;
     }
 
-    llvm::LLVMContext context;  // llvmのいろいろ
-    llvm::IRBuilder<> builder;
-    std::unordered_map<std::string, llvm::Value*> named_value;
+    // nameの関数に副作用がないか．defは定義時の解析結果，externはホスト関数の属性による
+    bool isPure(const std::string& name);
+
+    // externされたsin, sqrtなどに対応するtypeのintrinsicの宣言を返す．対応しなければnullptr
+    llvm::Function* getIntrinsic(const std::string& name, llvm::Type* type);
+
+    // defの新しい版implをmodule keyで追加した後に呼び，nameのスタブがimplを指すようにする
+    void updateStub(const std::string& name, const std::string& impl, llvm::orc::VModuleKey key);
+
+    // 実行中のコードがないときに呼ぶ．差し替え済みの古い版を捨て，
+    // code_cache_limitを超えていれば最近呼ばれていないdefのコードを追い出す
+    void evictCode();
+
+    // 小さい関数の最適化済みIRを取っておき，後のmoduleから呼ばれたときにインライン展開する
+    void rememberForInlining(llvm::Function& func);
+    void inlineCalls(llvm::Function& caller);
+
+    std::shared_ptr<Engine> engine;
+    // llvmのいろいろ．moduleをJITに渡した後も定数や型は残り続けるので，ときどき作り直す
+    std::unique_ptr<llvm::LLVMContext> context;
+    std::unique_ptr<llvm::IRBuilder<>> builder;
+    unsigned context_recycle_units = 0;  // この数のmoduleを作るごとにcontextを作り直す．0なら作り直さない
+    unsigned context_units = 0;  // 今のcontextで作ったmoduleの数
+    std::unordered_map<std::string, llvm::Value*> named_value;  // バッファxsの要素数は"xs.len"に入れる
+
+    // 関数内で生成済みの式の値．構造が同じ式を2回codegenしない(CSE)
+    struct ExprHash
+    {
+        std::size_t operator()(const ExprAST* e) const { return e->hash(); }
+    };
+    struct ExprEqual
+    {
+        bool operator()(const ExprAST* a, const ExprAST* b) const { return a == b || a->equals(*b); }
+    };
+    std::unordered_map<const ExprAST*, llvm::Value*, ExprHash, ExprEqual> cse_values;
+    std::size_t stores = 0;  // codegenしたバッファへの書き込みの数．増えていればバッファから読んだ値は古い
+    std::unordered_set<llvm::Value*> loaded;  // バッファから読んだ値と，それを使って計算した値
+
+    // operandsのどれかがバッファから読んだ値なら，それから計算したvalueも同じ扱いにする
+    void derive(llvm::Value* value, std::initializer_list<llvm::Value*> operands)
+    {
+        if (std::any_of(operands.begin(), operands.end(), [&](llvm::Value* v) { return loaded.count(v) > 0; }))
+            loaded.insert(value);
+    }
+
+    // バッファに書いたかもしれない命令の後に呼び，それより前に読んだ値を使い回さないようにする
+    // 引数と定数だけから計算した値は，書き込みの後でもそのまま使える
+    void clobberMemory()
+    {
+        ++stores;
+        forgetLoads();
+    }
+    void forgetLoads()
+    {
+        for (auto e = cse_values.begin(); e != cse_values.end();)
+            e = loaded.count(e->second) ? cse_values.erase(e) : std::next(e);
+    }
+
     std::unordered_map<std::string, std::unique_ptr<PrototypeAST>> proto_func;
 
-    std::unique_ptr<llvm::orc::KaleidoscopeJIT> JIT;
+    std::vector<llvm::Function*> outlined;  // codegen中の関数から切り出したparforやreduceの本体
+    // parforやreduceをengineのスレッドプールで回すか．falseならプールのアドレスをIRに埋め込まず，呼び出し元だけで回す
+    bool parallel = true;
+
+    unsigned inline_threshold = 0;  // インライン展開の対象にする関数の命令数の上限．0なら無効
+    std::unordered_map<std::string, std::unique_ptr<llvm::Module>> inline_candidates;
+    std::unordered_set<std::string> inlined;  // 直前にcodegenした関数へインライン展開した関数
+
+    // defをスタブ経由で呼び，再定義したら呼び出し側を再コンパイルせずに差し替える
+    struct Stub
+    {
+        std::atomic<std::uint64_t> target{0};  // 現在の版のアドレス．追い出されていれば0
+        std::atomic<bool> touched{false};      // 前回のevictCodeから呼ばれたか
+        std::unique_ptr<PrototypeAST> proto;  // 差し替えても引数と戻り値の型は変えられない
+        std::string name;
+        CodeGenEnv* env = nullptr;
+        llvm::orc::VModuleKey key = 0;  // 現在の版のmodule
+        bool resident = false;
+    };
+    bool hot_swap = false;
+    std::unordered_map<std::string, std::unique_ptr<Stub>> stubs;
+    std::unordered_map<std::string, unsigned> versions;
+    void buildStub(Stub& stub);
+
+    // JITしたコードの総量の上限(byte)．0なら無制限．hot_swapのときだけ有効
+    size_t code_cache_limit = 0;
+    std::vector<Stub*> clock;  // 追い出す候補を巡回する順
+    size_t clock_hand = 0;
+    std::vector<llvm::orc::VModuleKey> retired;  // 差し替えられた古い版
+    // 追い出されたdefが呼ばれたときに，nameをコンパイルし直してスタブを更新する
+    std::function<void(const std::string&)> materializer;
+
+    bool memoize = false;  // @memoがなくても，純粋な1引数の再帰関数の結果をキャッシュするか
+    std::vector<std::unique_ptr<MemoTable>> memo_tables;
+
+    llvm::orc::KaleidoscopeJIT* JIT;  // engineのもの
+    CompileSession* session;
+    std::string symbol_prefix;
+    std::unordered_set<llvm::orc::VModuleKey> module_keys;  // JITに追加したままのmodule
+    Stats* stats = nullptr;  // nullptrでなければ最適化の時間とIRの命令数を数える
+
+    // defごとに行情報を付け，GDBなどでソースの行と対応付けられるようにする
+    bool debug_info = false;
+    std::string source_file = "-";
+    std::unique_ptr<llvm::DIBuilder> dbuilder;
+    llvm::DICompileUnit* compile_unit = nullptr;
 
     std::unique_ptr<llvm::Module> module;
-    std::unique_ptr<llvm::legacy::FunctionPassManager> FPM;
 };
 
 }  // namespace kaleidoscope
\ No newline at end of file
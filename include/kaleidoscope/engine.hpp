@@ -0,0 +1,61 @@
+#pragma once
+
+#include <kaleidoscope/KaleidoscopeJIT.h>
+#include <kaleidoscope/session.hpp>
+#include <kaleidoscope/thread_pool.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace kaleidoscope
+{
+
+// JITを作る前にネイティブのターゲットを初期化する
+struct NativeTarget
+{
+    NativeTarget();
+};
+
+// 複数のCodeGenEnvで共有するJITの実行環境
+// TargetMachine，オブジェクトの置き場所，最適化パイプライン，スレッドプールを1つずつ持つ
+// セッションごとに持つのはシンボルの表とLLVMContext，作りかけのmoduleだけになる
+//
+// JITと最適化パイプラインはスレッドセーフではないので，codegenからmoduleの追加・削除までの間はmutexを取る
+// JITしたコードの実行中は取らなくてよい
+struct Engine : private NativeTarget
+{
+    explicit Engine(bool process_symbols = true, std::size_t threads = std::thread::hardware_concurrency());
+
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+
+    // 新しいセッションのシンボルに付ける接頭辞．.を含むので，ソースに書ける名前とは衝突しない
+    std::string newSymbolPrefix() { return "s" + std::to_string(++sessions) + "."; }
+
+    // 最初に使うときにスレッドを作る
+    ThreadPool& pool()
+    {
+        std::call_once(pool_once, [&] { thread_pool = std::make_unique<ThreadPool>(threads); });
+        return *thread_pool;
+    }
+
+    llvm::orc::KaleidoscopeJIT JIT;
+    CompileSession session;
+    std::mutex mutex;
+
+    bool listeners_attached = false;  // プロファイラなどへの通知は最初のセッションの設定で1度だけ登録する
+
+private:
+    void registerHostSymbols();
+
+    std::atomic<std::size_t> sessions{0};
+    std::size_t threads;
+    std::once_flag pool_once;
+    std::unique_ptr<ThreadPool> thread_pool;
+};
+
+}  // namespace kaleidoscope
@@ -4,6 +4,13 @@
 
 #include <llvm/Support/TargetSelect.h>
 
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
 namespace kaleidoscope
 {
 
@@ -22,28 +29,143 @@ struct Interpreter : InterpreterBase
 {
     struct Config
     {
-        bool print_ir;
+        bool print_ir = false;
+        bool process_symbols = true;  // 未登録のexternをプロセス全体から探すか
+        unsigned inline_threshold = 32;  // この命令数以下のdefは呼び出し側にインライン展開する．0で無効
+        bool memoize = false;  // @memoがなくても，純粋な1引数の再帰defの結果をキャッシュする
+        bool hash_cons = false;  // 構文解析時に構造が同じ部分木を共有する
+        bool hot_swap = false;  // defをスタブ経由で呼び，再定義で差し替えられるようにする
+        size_t code_cache_limit = 0;  // JITしたコードの総量の上限(byte)．0で無制限．hot_swapが必要
+        bool collect_stats = false;  // 段階ごとの時間と，トークン数などの統計を取る
+        bool perf_map = false;  // /tmp/perf-<pid>.mapにJITした関数のアドレスを書く
+        bool jitdump = false;  // perf inject用のjitdumpを書く．LLVMがperf対応でビルドされている必要がある
+        bool vtune = false;  // VTuneにJITした関数を知らせる．LLVMがIntel JIT Events対応でビルドされている必要がある
+        bool gdb = false;  // JITしたオブジェクトをGDBに登録する
+        // perf_mapからgdbまでは，Engineを共有する場合は最初のInterpreterの設定だけが使われる
+        bool debug_info = false;  // defにDWARFの行情報を付ける．インライン展開はしなくなる
+        std::string source_file = "-";  // 行情報に書くファイル名
+        unsigned context_recycle_units = 1024;  // この数のmoduleを作るごとにLLVMContextを作り直す．0で無効
+        std::size_t workers = std::thread::hardware_concurrency();  // Engineのスレッドプールの大きさ
     };
 
     template <class T>
-    explicit Interpreter(T&& input, const std::string& mod_name,
-        Config config = Config{.print_ir = false})
+    explicit Interpreter(T&& input, const std::string& mod_name)
+        : Interpreter(std::forward<T>(input), mod_name, Config{})
+    {
+    }
+
+    template <class T>
+    explicit Interpreter(T&& input, const std::string& mod_name, Config config)
         : InterpreterBase(),
           parser{Parser{Tokenizer{std::forward<T>(input)}}},
-          env{mod_name},
+          env{mod_name, config.process_symbols, config.workers},
           config{config}
     {
         initialize();
     }
 
+    // engineを他のInterpreterと共有する．defの名前空間とコンパイル済みのコードはInterpreterごとに別で，
+    // 壊すと自分のmoduleだけがJITから取り除かれる．config.process_symbolsとworkersはengineの設定が使われる
+    template <class T>
+    explicit Interpreter(T&& input, const std::string& mod_name, std::shared_ptr<Engine> engine, Config config = {})
+        : InterpreterBase(),
+          parser{Parser{Tokenizer{std::forward<T>(input)}}},
+          env{mod_name, engine, engine->newSymbolPrefix()},
+          config{config}
+    {
+        initialize();
+    }
+
+    // submitしたコンパイルが全て終わるのを待つ
+    ~Interpreter();
+
     bool run();
 
+    // ファイルを読み直し，前回から変わったdefとそれに依存するdefだけをコンパイルし直す
+    // トップレベルの式は全て評価し直す．コンパイルし直したdefの数を返す
+    size_t reload(const std::string& filename);
+
+    // precompileLibraryで作ったライブラリを読み込み，そのexternとdefを使えるようにする
+    // lex/parse/codegenはせず，bitcodeをそのままJITに渡す．読めなければfalse
+    bool load(const std::string& path);
+
+    // collect_statsのときに集めた統計
+    const Stats& getStats();
+
+    // sourceを今までの定義に続けて評価し，トップレベルの式の値を返す
+    // errorsを渡すと，構文エラーやコンパイルに失敗した定義と式ごとに理由を1つ足す．失敗しても残りは評価する
+    std::vector<double> eval(const std::string& source, std::vector<std::string>* errors = nullptr);
+
+    // JITした関数のアドレスと引数の数．nameが定義されていなければnullopt
+    // doublesが偽なら，double(*)(double...)ではない．バッファにはポインタとint64_tの2つを渡す
+    // @gradで作ったd_<name>のgradは引数の数以上の長さが必要で，短ければ何も書かずに値だけを返す
+    struct Entry
+    {
+        llvm::JITTargetAddress address;
+        size_t arity;
+        bool doubles = true;
+    };
+    std::optional<Entry> lookup(const std::string& name);
+
+    // sourceのexternとdefを，engineのスレッドプールで書かれた順にコンパイルする．構文解析だけは呼び出し元で済ませる
+    // defごとに(@gradならd_<name>も)，コンパイルが終わるとlookupの結果になるfutureを返す．失敗すればnullopt
+    // 前にsubmitしたソースのコンパイルが終わってから始めるので，前のソースのdefを呼んでよい
+    // evalやrunとは順序が決まらないので，submitしたdefを使うソースをevalする前にはfutureを待つこと
+    // トップレベルの式は評価しない
+    // hot_swapのときは使えない(警告を出して何もせず空を返す)．ホストから直接呼んでいるコードは数えられないので，
+    // 再定義した古い版や追い出したdefのコードを，前のfutureで得たアドレスから実行中でも捨ててしまう
+    struct Pending
+    {
+        std::string name;
+        std::shared_future<std::optional<Entry>> entry;
+    };
+    std::vector<Pending> submit(const std::string& source);
+
+    // トップレベルの式の値を受け取る．設定しなければ標準出力に書く
+    void setResultHandler(std::function<void(double)> handler) { result_handler = std::move(handler); }
+
+    Engine& getEngine() { return *env.engine; }
+
 private:
     void initialize();
+    void attachListeners();
+    void bindHandlers(Parser& p);
+
+    // codegenに成功したか．@gradならd_<name>の分も別に返す
+    struct Compiled
+    {
+        bool def = false;
+        bool gradient = false;
+    };
+    Compiled handleDef(std::unique_ptr<FunctionAST> def);
+    bool handleExtern(std::unique_ptr<PrototypeAST> ext);  // codegenに失敗すればfalse
+    bool handleTopLevel(std::unique_ptr<FunctionAST> top);
+
+    // 定義済みのdefの依存関係
+    struct DefInfo
+    {
+        std::size_t hash = 0;  // 引数と本体のハッシュ
+        std::unordered_set<std::string> callees;
+        std::unordered_set<std::string> inlined;  // 本体にインライン展開した呼び出し先
+        std::unique_ptr<FunctionAST> def;
+        size_t order = 0;  // 最初に定義された順番
+        std::string gradient_of;  // @gradで作ったd_<name>ならname
+    };
+
+    // 前回のASTからnameをコンパイルし直す．ハッシュは元のソースのものを残す．engineのmutexを持たずに呼ぶ
+    bool recompile(const std::string& name);
+
+    // changedと，それに推移的に依存するdefの名前．engineのmutexを持って呼ぶ
+    std::unordered_set<std::string> dependents(const std::unordered_set<std::string>& changed) const;
 
     Parser parser;
     CodeGenEnv env;
     Config config;
+    std::unordered_map<std::string, DefInfo> defs;
+    Stats stats;
+    std::function<void(double)> result_handler;
+    unsigned running = 0;  // 実行中のトップレベルの式の数．0のときだけコードを捨てられる
+    std::shared_future<void> submitted;  // 最後にsubmitしたソースのコンパイルが終わったか
 };
 
-}  // namespace kaleidoscope
\ No newline at end of file
+}  // namespace kaleidoscope
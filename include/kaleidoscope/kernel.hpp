@@ -0,0 +1,624 @@
+#pragma once
+
+// コンパイル時にKaleidoscopeのソースを解析し，C++の式として埋め込む
+//
+//   constexpr auto poly = kaleidoscope::ct::kernel<"def poly(x, y) x * x + 3 * y;">;
+//   double r = poly(1.0, 2.0);
+//
+// ソースの最後のdefが入口になる．各ノードはそれぞれ別の型(Expr)になり，
+// 呼び出しは普通の関数呼び出しなので，C++コンパイラがインライン展開やベクトル化をする
+// JITと同じ結果になることはtest/kernel.cppで確かめる
+//
+// 字句解析と構文解析はTokenizerとParserImplを真似ているが，std::string_viewと容量固定の配列だけを使う
+// externで呼べるのは，JITがホスト関数として登録しているlibmの関数だけ．バッファとループ，型の注釈は扱わない
+// 間違ったソースは定数式にならず，コンパイルエラーになる
+
+#include "precedence.hpp"
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+namespace kaleidoscope::ct
+{
+
+// 定数式の途中で呼ばれるとコンパイルエラーになる
+[[noreturn]] inline void fail(const char* reason)
+{
+    throw std::invalid_argument(reason);
+}
+
+// 要素数の上限が決まったvector
+template <class T, std::size_t N>
+struct StaticVector
+{
+    constexpr std::size_t push_back(const T& v)
+    {
+        if (count == N)
+            fail("kernel is too large");
+        items[count] = v;
+        return count++;
+    }
+
+    constexpr std::size_t size() const { return count; }
+    constexpr const T& operator[](std::size_t i) const { return items[i]; }
+    constexpr T& operator[](std::size_t i) { return items[i]; }
+
+    std::array<T, N> items{};
+    std::size_t count = 0;
+};
+
+enum class TokenKind : std::uint8_t
+{
+    eof,
+    keyword,
+    punctuator,
+    identifier,
+    number,
+    unknown,
+};
+
+struct Token
+{
+    TokenKind kind = TokenKind::unknown;
+    std::string_view str;
+    double num = 0;
+
+    constexpr bool is(TokenKind k, std::string_view s) const { return kind == k && str == s; }
+    constexpr bool isPunc(std::string_view s) const { return is(TokenKind::punctuator, s); }
+    constexpr bool isKeyword(std::string_view s) const { return is(TokenKind::keyword, s); }
+};
+
+inline constexpr std::string_view keywords[] = {"def", "extern", "if", "then", "else", "for", "in", "parfor", "reduce"};
+inline constexpr std::string_view punctuators = "+-*/<>=()[]:;,@";
+
+constexpr bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r'; }
+constexpr bool isDigit(char c) { return '0' <= c && c <= '9'; }
+constexpr bool isAlpha(char c) { return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z'); }
+
+// 10^nを正確に表せる範囲で返す
+constexpr double pow10(std::size_t n)
+{
+    double p = 1;
+    for (std::size_t i = 0; i < n; ++i)
+        p *= 10;
+    return p;
+}
+
+struct Tokenizer
+{
+    constexpr explicit Tokenizer(std::string_view src) : src{src} {}
+
+    constexpr const Token& curToken() const { return curTok; }
+    constexpr const Token& getNextToken() { return curTok = getToken(); }
+
+private:
+    constexpr char peek() const { return pos < src.size() ? src[pos] : '\0'; }
+
+    constexpr Token getToken()
+    {
+        while (pos < src.size() && isSpace(src[pos]))
+            ++pos;
+
+        // comment
+        if (peek() == '#') {
+            while (pos < src.size() && src[pos] != '\n' && src[pos] != '\r')
+                ++pos;
+            if (pos < src.size()) {
+                ++pos;
+                return getToken();
+            }
+        }
+
+        auto start = pos;
+
+        // identifier/keyword: [a-Z][a-Z0-9_]*
+        if (isAlpha(peek())) {
+            while (isAlpha(peek()) || isDigit(peek()) || peek() == '_')
+                ++pos;
+            auto id = src.substr(start, pos - start);
+            for (auto kw : keywords)
+                if (id == kw)
+                    return {TokenKind::keyword, id};
+            return {TokenKind::identifier, id};
+        }
+
+        // num: [0-9][0-9.]*  std::stodと同じく，2つ目の.以降は無視する
+        if (isDigit(peek())) {
+            while (isDigit(peek()) || peek() == '.')
+                ++pos;
+            return {TokenKind::number, src.substr(start, pos - start), toNumber(src.substr(start, pos - start))};
+        }
+
+        if (pos == src.size())
+            return {TokenKind::eof, {}};
+
+        ++pos;
+        if (punctuators.find(src[start]) != std::string_view::npos)
+            return {TokenKind::punctuator, src.substr(start, 1)};
+        return {TokenKind::unknown, src.substr(start, 1)};
+    }
+
+    // 仮数が2^53未満で小数部が22桁以下なら，1回の割り算なので正しく丸められる
+    static constexpr double toNumber(std::string_view s)
+    {
+        std::uint64_t mantissa = 0;
+        std::size_t digits = 0, frac = 0;
+        std::size_t extra = 0;  // 仮数に入りきらなかった整数部の桁
+        bool point = false;
+        for (auto c : s) {
+            if (c == '.') {
+                if (point)
+                    break;
+                point = true;
+                continue;
+            }
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (c - '0');
+                ++digits;
+                if (point)
+                    ++frac;
+            } else if (!point) {
+                ++extra;
+            }
+        }
+        auto value = static_cast<double>(mantissa) / pow10(frac);
+        return value * pow10(extra);
+    }
+
+    std::string_view src;
+    std::size_t pos = 0;
+    Token curTok;
+};
+
+// JITがホスト関数として登録しているlibmの関数
+struct Builtin
+{
+    std::string_view name;
+    std::size_t arity;
+};
+
+inline constexpr Builtin builtins[] = {
+    {"sin", 1}, {"cos", 1}, {"tan", 1}, {"atan", 1}, {"atan2", 2}, {"sqrt", 1}, {"exp", 1},
+    {"log", 1}, {"pow", 2}, {"fabs", 1}, {"floor", 1}, {"ceil", 1}, {"fma", 3},
+};
+
+inline constexpr std::size_t max_arity = 8;
+
+enum class Kind : std::uint8_t
+{
+    number,
+    variable,
+    binary,
+    call,     // 同じソースのdefの呼び出し
+    builtin,  // externしたlibmの関数の呼び出し
+    branch,   // if cond then a else b
+};
+
+struct Node
+{
+    Kind kind = Kind::number;
+    char op = 0;
+    std::uint16_t index = 0;  // variableなら引数の位置，callならdef，builtinならbuiltinsの位置
+    std::uint16_t arity = 0;
+    std::array<std::uint16_t, max_arity> args{};  // 子のノード
+    double value = 0;
+};
+
+struct Def
+{
+    std::size_t arity = 0;
+    std::size_t body = 0;
+};
+
+// 解析済みのソース．名前は全て位置に置き換えてある
+struct Program
+{
+    StaticVector<Node, 1024> nodes;
+    StaticVector<Def, 64> defs;
+};
+
+// ParserImplと同じ文法と優先順位で解析する
+class Parser
+{
+public:
+    constexpr explicit Parser(std::string_view src) : tokenizer{src} {}
+
+    constexpr Program parse()
+    {
+        for (;;) {
+            const auto& token = tokenizer.getNextToken();
+            if (token.kind == TokenKind::eof)
+                break;
+            if (token.isPunc(";"))
+                continue;
+            if (token.isKeyword("def")) {
+                parseDefinition();
+            } else if (token.isPunc("@")) {
+                // @memoと@gradはdefの値を変えないので無視する
+                const Token* attr = &token;
+                while (attr->isPunc("@")) {
+                    const auto& name = tokenizer.getNextToken();
+                    if (!name.is(TokenKind::identifier, "memo") && !name.is(TokenKind::identifier, "grad"))
+                        fail("unknown attribute");
+                    attr = &tokenizer.getNextToken();
+                }
+                if (!attr->isKeyword("def"))
+                    fail("expected 'def' after attribute");
+                parseDefinition();
+            } else if (token.isKeyword("extern")) {
+                parseExtern();
+            } else {
+                fail("top-level expressions are not allowed in a kernel");
+            }
+        }
+        if (program.defs.size() == 0)
+            fail("kernel has no def");
+        return program;
+    }
+
+private:
+    struct Name
+    {
+        std::string_view name;
+        std::size_t index;
+    };
+
+    constexpr const Token& cur() const { return tokenizer.curToken(); }
+    constexpr const Token& next() { return tokenizer.getNextToken(); }
+
+    constexpr std::uint16_t add(const Node& node) { return static_cast<std::uint16_t>(program.nodes.push_back(node)); }
+
+    constexpr std::uint16_t parseIdentifierExpr()
+    {
+        auto name = cur().str;
+        if (next().isPunc("["))
+            fail("buffers are not supported in a kernel");
+        if (!cur().isPunc("(")) {
+            for (std::size_t i = 0; i < params.size(); ++i)
+                if (params[i] == name)
+                    return add({Kind::variable, 0, static_cast<std::uint16_t>(i)});
+            fail("unknown variable name");
+        }
+
+        Node node{Kind::call};
+        if (!next().isPunc(")")) {  // consume '(' and check ')'
+            while (true) {
+                if (node.arity == max_arity)
+                    fail("too many arguments");
+                node.args[node.arity++] = parseExpression();
+                if (cur().isPunc(")"))
+                    break;
+                if (!cur().isPunc(","))
+                    fail("expected ')' or ',' in argument list");
+                next();  // consume ','
+            }
+        }
+        next();  // consume ')'
+
+        // JITと同じく，externされたlibmの関数を先に探す
+        std::size_t arity = 0;
+        if (auto e = find(externs, name); e != npos) {
+            node.kind = Kind::builtin;
+            node.index = static_cast<std::uint16_t>(externs[e].index);
+            arity = builtins[node.index].arity;
+        } else if (auto d = find(def_names, name); d != npos) {
+            node.index = static_cast<std::uint16_t>(def_names[d].index);
+            arity = program.defs[node.index].arity;
+        } else {
+            fail("unknown function referenced");
+        }
+        if (arity != node.arity)
+            fail("argument mismatch");
+        return add(node);
+    }
+
+    constexpr std::uint16_t parseIfExpr()
+    {
+        next();  // consume 'if'
+        Node node{Kind::branch};
+        node.arity = 3;
+        node.args[0] = parseExpression();
+        if (!cur().isKeyword("then"))
+            fail("expected 'then' in if-expr");
+        next();
+        node.args[1] = parseExpression();
+        if (!cur().isKeyword("else"))
+            fail("expected 'else' in if-expr");
+        next();
+        node.args[2] = parseExpression();
+        return add(node);
+    }
+
+    constexpr std::uint16_t parsePrimary()
+    {
+        switch (cur().kind) {
+        case TokenKind::identifier:
+            return parseIdentifierExpr();
+        case TokenKind::number: {
+            auto value = cur().num;
+            next();
+            return add({Kind::number, 0, 0, 0, {}, value});
+        }
+        default:
+            break;
+        }
+        if (cur().isKeyword("if"))
+            return parseIfExpr();
+        if (cur().isKeyword("for") || cur().isKeyword("parfor") || cur().isKeyword("reduce"))
+            fail("loops are not supported in a kernel");
+        if (cur().isPunc("(")) {
+            next();  // consume '('
+            auto expr = parseExpression();
+            if (!cur().isPunc(")"))
+                fail("expected ')' in paren-expr");
+            next();  // consume ')'
+            return expr;
+        }
+        fail("unknown token when expecting an expression");
+    }
+
+    constexpr int prio() const
+    {
+        return cur().kind == TokenKind::punctuator ? binOpPrecedence(cur().str) : -1;
+    }
+
+    constexpr std::uint16_t parseBinOpRHS(int expr_prio, std::uint16_t lhs)
+    {
+        while (true) {
+            int tok_prio = prio();
+            if (tok_prio < expr_prio)
+                return lhs;
+
+            auto op = cur().str[0];
+            if (op == '/')
+                fail("unknown binary operator");  // JITのcodegenも割り算を持たない
+            next();  // consume binop
+
+            auto rhs = parsePrimary();
+            if (tok_prio < prio())
+                rhs = parseBinOpRHS(tok_prio + 1, rhs);
+
+            Node node{Kind::binary, op};
+            node.arity = 2;
+            node.args[0] = lhs;
+            node.args[1] = rhs;
+            lhs = add(node);
+        }
+    }
+
+    constexpr std::uint16_t parseExpression() { return parseBinOpRHS(0, parsePrimary()); }
+
+    // prototype ::= identifier '(' (identifier (',' identifier)*)? ')'
+    constexpr std::string_view parsePrototype()
+    {
+        if (cur().kind != TokenKind::identifier)
+            fail("expected function name in prototype");
+        auto name = cur().str;
+        if (!next().isPunc("("))
+            fail("expected '(' in prototype");
+
+        params = {};
+        while (true) {
+            if (next().kind != TokenKind::identifier)
+                fail("expected identifier in prototype");
+            params.push_back(cur().str);
+            if (next().isPunc("["))
+                fail("buffers are not supported in a kernel");
+            if (cur().isPunc(":"))
+                fail("type annotations are not supported in a kernel");
+            if (cur().isPunc(","))
+                continue;
+            if (cur().isPunc(")")) {
+                if (next().isPunc(":"))  // consume ')'
+                    fail("type annotations are not supported in a kernel");
+                break;
+            }
+            fail("expected ')' or ',' in prototype");
+        }
+        return name;
+    }
+
+    constexpr void parseExtern()
+    {
+        next();  // consume 'extern'
+        auto name = parsePrototype();
+        for (std::size_t i = 0; i < std::size(builtins); ++i)
+            if (builtins[i].name == name) {
+                if (builtins[i].arity != params.size())
+                    fail("extern has a different number of arguments from the host function");
+                externs.push_back({name, i});
+                return;
+            }
+        fail("only libm functions registered as host symbols can be extern in a kernel");
+    }
+
+    constexpr void parseDefinition()
+    {
+        next();  // consume 'def'
+        auto name = parsePrototype();
+        for (auto& b : builtins)
+            if (b.name == name)
+                fail("cannot redefine host function");
+        if (find(def_names, name) != npos)
+            fail("function cannot be redefined");
+
+        // 自分自身を呼べるように，本体の前に登録する
+        auto index = program.defs.push_back({params.size()});
+        def_names.push_back({name, index});
+        program.defs[index].body = parseExpression();
+    }
+
+    static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+    template <std::size_t N>
+    static constexpr std::size_t find(const StaticVector<Name, N>& names, std::string_view name)
+    {
+        for (std::size_t i = 0; i < names.size(); ++i)
+            if (names[i].name == name)
+                return i;
+        return npos;
+    }
+
+    Tokenizer tokenizer;
+    Program program;
+    StaticVector<Name, 64> def_names;
+    StaticVector<Name, std::size(builtins)> externs;
+    StaticVector<std::string_view, max_arity> params;  // 解析中のdefの引数
+};
+
+// ノードIを根とする式．argsは囲んでいるdefの引数
+template <const Program& P, std::size_t I, Kind K = P.nodes[I].kind>
+struct Expr;
+
+template <const Program& P, std::size_t D>
+struct Function
+{
+    static constexpr std::size_t arity = P.defs[D].arity;
+
+    static constexpr double call(const std::array<double, arity>& args) { return Expr<P, P.defs[D].body>::eval(args); }
+};
+
+template <const Program& P, std::size_t I, std::size_t N, std::size_t... J>
+constexpr std::array<double, sizeof...(J)> evalArgs(const std::array<double, N>& args, std::index_sequence<J...>)
+{
+    return {Expr<P, P.nodes[I].args[J]>::eval(args)...};
+}
+
+template <const Program& P, std::size_t I>
+struct Expr<P, I, Kind::number>
+{
+    template <std::size_t N>
+    static constexpr double eval(const std::array<double, N>&) { return P.nodes[I].value; }
+};
+
+template <const Program& P, std::size_t I>
+struct Expr<P, I, Kind::variable>
+{
+    template <std::size_t N>
+    static constexpr double eval(const std::array<double, N>& args) { return args[P.nodes[I].index]; }
+};
+
+template <const Program& P, std::size_t I>
+struct Expr<P, I, Kind::binary>
+{
+    template <std::size_t N>
+    static constexpr double eval(const std::array<double, N>& args)
+    {
+        constexpr auto& node = P.nodes[I];
+        double l = Expr<P, node.args[0]>::eval(args);
+        double r = Expr<P, node.args[1]>::eval(args);
+        if constexpr (node.op == '+')
+            return l + r;
+        else if constexpr (node.op == '-')
+            return l - r;
+        else if constexpr (node.op == '*')
+            return l * r;
+        else if constexpr (node.op == '<')
+            return !(l >= r) ? 1.0 : 0.0;  // JITと同じくunordered: NaNとの比較は真
+        else
+            return !(l <= r) ? 1.0 : 0.0;
+    }
+};
+
+template <const Program& P, std::size_t I>
+struct Expr<P, I, Kind::call>
+{
+    template <std::size_t N>
+    static constexpr double eval(const std::array<double, N>& args)
+    {
+        constexpr auto& node = P.nodes[I];
+        return Function<P, node.index>::call(evalArgs<P, I>(args, std::make_index_sequence<P.nodes[I].arity>{}));
+    }
+};
+
+template <const Program& P, std::size_t I>
+struct Expr<P, I, Kind::builtin>
+{
+    template <std::size_t N>
+    static constexpr double eval(const std::array<double, N>& args)
+    {
+        constexpr auto& node = P.nodes[I];
+        auto a = evalArgs<P, I>(args, std::make_index_sequence<P.nodes[I].arity>{});
+        constexpr auto name = builtins[node.index].name;
+        if constexpr (name == "sin")
+            return std::sin(a[0]);
+        else if constexpr (name == "cos")
+            return std::cos(a[0]);
+        else if constexpr (name == "tan")
+            return std::tan(a[0]);
+        else if constexpr (name == "atan")
+            return std::atan(a[0]);
+        else if constexpr (name == "atan2")
+            return std::atan2(a[0], a[1]);
+        else if constexpr (name == "sqrt")
+            return std::sqrt(a[0]);
+        else if constexpr (name == "exp")
+            return std::exp(a[0]);
+        else if constexpr (name == "log")
+            return std::log(a[0]);
+        else if constexpr (name == "pow")
+            return std::pow(a[0], a[1]);
+        else if constexpr (name == "fabs")
+            return std::fabs(a[0]);
+        else if constexpr (name == "floor")
+            return std::floor(a[0]);
+        else if constexpr (name == "ceil")
+            return std::ceil(a[0]);
+        else
+            return std::fma(a[0], a[1], a[2]);
+    }
+};
+
+template <const Program& P, std::size_t I>
+struct Expr<P, I, Kind::branch>
+{
+    template <std::size_t N>
+    static constexpr double eval(const std::array<double, N>& args)
+    {
+        constexpr auto& node = P.nodes[I];
+        double cond = Expr<P, node.args[0]>::eval(args);
+        // JITと同じくordered: NaNは偽
+        return cond < 0.0 || cond > 0.0 ? Expr<P, node.args[1]>::eval(args) : Expr<P, node.args[2]>::eval(args);
+    }
+};
+
+// テンプレート引数に文字列リテラルを渡すための型
+template <std::size_t N>
+struct FixedString
+{
+    constexpr FixedString(const char (&s)[N])
+    {
+        for (std::size_t i = 0; i < N; ++i)
+            data[i] = s[i];
+    }
+    constexpr std::string_view view() const { return {data, N - 1}; }
+
+    char data[N]{};
+};
+
+template <FixedString Source>
+inline constexpr Program program = Parser{Source.view()}.parse();
+
+template <FixedString Source>
+struct Kernel
+{
+    using Entry = Function<program<Source>, program<Source>.defs.size() - 1>;
+    static constexpr std::size_t arity = Entry::arity;
+
+    template <class... Args>
+        requires(sizeof...(Args) == arity)
+    constexpr double operator()(Args... args) const
+    {
+        return Entry::call({static_cast<double>(args)...});
+    }
+};
+
+template <FixedString Source>
+inline constexpr Kernel<Source> kernel{};
+
+}  // namespace kaleidoscope::ct
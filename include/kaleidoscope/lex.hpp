@@ -9,6 +9,8 @@
 
 #include <boost/hana/functional/overload.hpp>
 
+#include "stats.hpp"
+
 namespace kaleidoscope
 {
 namespace token
@@ -24,7 +26,7 @@ struct keyword
     std::string str;
 
     static inline std::vector<std::string> list = {
-        "def", "extern", "if", "else"};
+        "def", "extern", "if", "then", "else", "for", "in", "parfor", "reduce"};
 };
 
 struct punctuator
@@ -32,7 +34,7 @@ struct punctuator
     std::string str;
 
     static inline std::vector<std::string> list = {
-        "+", "-", "*", "/", "<", ">", "=", "(", ")", ";", ","};
+        "+", "-", "*", "/", "<", ">", "=", "(", ")", "[", "]", ":", ";", ",", "@"};
 };
 
 struct number
@@ -82,7 +84,8 @@ struct Tokenizer
 
     Tokenizer(const Tokenizer&) = delete;
 
-    Tokenizer(Tokenizer&& other) noexcept : iss{other.iss}, curTok{std::move(other.curTok)}
+    Tokenizer(Tokenizer&& other) noexcept
+        : stats{other.stats}, iss{other.iss}, curTok{std::move(other.curTok)}, line{other.line}
     {
         other.iss = nullptr;
         other.curTok = token::unknown{};
@@ -97,13 +100,25 @@ struct Tokenizer
     }
 
     const Token& curToken() const { return curTok; }
-    const Token& getNextToken() { return curTok = getToken(); }
+    unsigned curLine() const { return line; }  // curTokenのある行．1から数える
+    const Token& getNextToken()
+    {
+        if (!stats)
+            return curTok = getToken();
+
+        PhaseTimer timer{stats, Phase::lex};
+        ++stats->tokens;
+        return curTok = getToken();
+    }
+
+    Stats* stats = nullptr;  // nullptrでなければトークン数と字句解析の時間を数える
 
 private:
     Token getToken();
 
     std::istream* iss;
     Token curTok;
+    unsigned line = 1;
 };
 
 namespace token
@@ -118,6 +133,41 @@ inline bool is_extern(const Token& token)
     return std::holds_alternative<keyword>(token) && (std::get<keyword>(token).str == "extern");
 }
 
+inline bool is_if(const Token& token)
+{
+    return std::holds_alternative<keyword>(token) && (std::get<keyword>(token).str == "if");
+}
+
+inline bool is_then(const Token& token)
+{
+    return std::holds_alternative<keyword>(token) && (std::get<keyword>(token).str == "then");
+}
+
+inline bool is_else(const Token& token)
+{
+    return std::holds_alternative<keyword>(token) && (std::get<keyword>(token).str == "else");
+}
+
+inline bool is_for(const Token& token)
+{
+    return std::holds_alternative<keyword>(token) && (std::get<keyword>(token).str == "for");
+}
+
+inline bool is_in(const Token& token)
+{
+    return std::holds_alternative<keyword>(token) && (std::get<keyword>(token).str == "in");
+}
+
+inline bool is_parfor(const Token& token)
+{
+    return std::holds_alternative<keyword>(token) && (std::get<keyword>(token).str == "parfor");
+}
+
+inline bool is_reduce(const Token& token)
+{
+    return std::holds_alternative<keyword>(token) && (std::get<keyword>(token).str == "reduce");
+}
+
 inline bool is_eof(const Token& token)
 {
     return std::holds_alternative<eof>(token);
@@ -148,6 +198,26 @@ inline bool is_r_paren(const Token& token)
     return std::holds_alternative<punctuator>(token) && (std::get<punctuator>(token).str == ")");
 }
 
+inline bool is_l_bracket(const Token& token)
+{
+    return std::holds_alternative<punctuator>(token) && (std::get<punctuator>(token).str == "[");
+}
+
+inline bool is_r_bracket(const Token& token)
+{
+    return std::holds_alternative<punctuator>(token) && (std::get<punctuator>(token).str == "]");
+}
+
+inline bool is_assign(const Token& token)
+{
+    return std::holds_alternative<punctuator>(token) && (std::get<punctuator>(token).str == "=");
+}
+
+inline bool is_colon(const Token& token)
+{
+    return std::holds_alternative<punctuator>(token) && (std::get<punctuator>(token).str == ":");
+}
+
 inline bool is_comma(const Token& token)
 {
     return std::holds_alternative<punctuator>(token) && (std::get<punctuator>(token).str == ",");
@@ -158,6 +228,11 @@ inline bool is_semicolon(const Token& token)
     return std::holds_alternative<punctuator>(token) && (std::get<punctuator>(token).str == ";");
 }
 
+inline bool is_at(const Token& token)
+{
+    return std::holds_alternative<punctuator>(token) && (std::get<punctuator>(token).str == "@");
+}
+
 inline std::string get_identifier(const Token& token)
 {
     if (is_identifier(token))
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "ast.hpp"
+
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace kaleidoscope
+{
+
+// 事前コンパイルしたライブラリ(.kbc)
+//
+// 全てリトルエンディアンで，mmapしたまま読める:
+//   0   "KBC\0"
+//   4   u32 版(3)
+//   8   u32 プロトタイプの数
+//   12  u32 予約(0)
+//   16  u64 bitcodeの先頭からの位置(16の倍数)
+//   24  u64 bitcodeのバイト数
+//   32  プロトタイプの表．1つにつき u32 フラグ, u32 行, u32 引数の数, 名前, (u32 引数のフラグ, 引数名)...
+//       文字列は u32 長さ + バイト列
+//   bitcodeの位置から，最適化済みの全てのdefを入れた1つのmoduleのbitcode
+//
+// フラグはbit0がextern，bit1が純粋，bit8-15が戻り値の型．引数のフラグはbit0がバッファ，bit8-15が型
+// 型はValueTypeの値．defの関数名はソースの名前のまま
+struct Library
+{
+    std::unique_ptr<llvm::MemoryBuffer> file;
+    std::vector<std::unique_ptr<PrototypeAST>> protos;  // externとdef
+    llvm::MemoryBufferRef bitcode;  // fileの一部
+};
+
+// sourceのexternとdefをコンパイルし，outputに書く．トップレベルの式は無視する
+bool precompileLibrary(const std::string& source, const std::string& output);
+
+// pathを開いて表を読む．壊れていればエラーを表示してnullopt
+std::optional<Library> readLibrary(const std::string& path);
+
+}  // namespace kaleidoscope
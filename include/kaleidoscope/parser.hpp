@@ -19,6 +19,12 @@ struct Parser
 
     bool parse();
 
+    // 構造が同じ部分木を1つのノードで共有する
+    void setHashConsing(bool enabled);
+
+    // 字句解析と構文解析の時間，トークン数，ASTのノード数をstatsに数える
+    void setStats(Stats* stats);
+
     void setDefHandler(std::function<void(std::unique_ptr<FunctionAST>)> handler)
     {
         def_handler = std::move(handler);
@@ -34,11 +40,25 @@ struct Parser
         toplevel_handler = std::move(handler);
     }
 
+    // 構文エラーで定義や式を読み飛ばしたときに呼ぶ．詳しい理由は標準エラー出力に書く
+    void setErrorHandler(std::function<void(const std::string&)> handler)
+    {
+        error_handler = std::move(handler);
+    }
+
 private:
+    void error(const std::string& reason)
+    {
+        if (error_handler)
+            error_handler(reason);
+    }
+
     // Tokenizer tokenizer;
     std::shared_ptr<ParserImpl> impl;
+    Stats* stats = nullptr;
     std::function<void(std::unique_ptr<FunctionAST>)> def_handler;
     std::function<void(std::unique_ptr<PrototypeAST>)> extern_handler;
     std::function<void(std::unique_ptr<FunctionAST>)> toplevel_handler;
+    std::function<void(const std::string&)> error_handler;
 };
 }  // namespace kaleidoscope
\ No newline at end of file
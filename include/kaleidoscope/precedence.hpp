@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string_view>
+
+namespace kaleidoscope
+{
+
+struct BinOpPrecedence
+{
+    std::string_view op;
+    int prio;
+};
+
+// 二項演算子の優先順位．大きいほど強く結びつく
+// 実行時のParserとコンパイル時のkernelで同じ表を使う
+inline constexpr BinOpPrecedence binop_precedence[] = {
+    {"<", 10},
+    {">", 10},
+    {"+", 20},
+    {"-", 20},
+    {"*", 40},
+    {"/", 40},
+};
+
+// 二項演算子でなければ-1
+constexpr int binOpPrecedence(std::string_view op)
+{
+    for (auto& p : binop_precedence)
+        if (p.op == op)
+            return p.prio;
+    return -1;
+}
+
+}  // namespace kaleidoscope
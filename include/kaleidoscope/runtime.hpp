@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace kaleidoscope
+{
+
+class ThreadPool;
+
+// JITしたコードから呼ばれるホスト側のランタイム
+
+// parforやreduceの範囲を分けるチャンクの数の上限．reduceはチャンクごとの途中結果をこの数だけ並べて持つ
+constexpr std::int64_t max_parallel_chunks = 64;
+
+// メモ化した関数ごとのキャッシュ．キーは引数のdouble列のバイト表現
+// サーバーでは複数のスレッドから同じ関数が呼ばれるので，mutexで守る
+struct MemoTable
+{
+    std::mutex mutex;
+    std::unordered_map<std::string, double> entries;
+};
+
+}  // namespace kaleidoscope
+
+extern "C" {
+// キャッシュにあればその値へのポインタ，なければnullptrを返す
+const double* kaleidoscope_memo_find(kaleidoscope::MemoTable* table, const double* args, std::uint64_t n);
+void kaleidoscope_memo_store(kaleidoscope::MemoTable* table, const double* args, std::uint64_t n, double value);
+
+// [begin, end)を連続したチャンクに分け，poolのスレッドと呼び出し元でbody(ctx, チャンクの先頭, 末尾, チャンクの番号)を呼ぶ
+// 全てのチャンクが終わるまで戻らない．空のチャンクは作らず，使ったチャンクの数を返す
+// poolがnullptrのときやpoolのスレッドから呼ばれたときは，呼び出し元だけで1つのチャンクとして回す
+// (poolのスレッドで空きを待つと詰まりうる)
+std::int64_t kaleidoscope_parallel_for(kaleidoscope::ThreadPool* pool,
+    void (*body)(void* ctx, std::int64_t begin, std::int64_t end, std::int64_t chunk), void* ctx, std::int64_t begin,
+    std::int64_t end);
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "interpreter.hpp"
+#include "thread_pool.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace kaleidoscope
+{
+
+// 1つのInterpreterをUnixドメインソケット越しに使わせるサーバー
+//
+// 要求と応答は行単位のテキスト:
+//   EVAL <bytes>\n<bytes分のソース>     -> OK <n>\n 続けてトップレベルの式の値をn行
+//   CALL <name> <rows>\n<rows行の引数>  -> OK <rows>\n 続けて各行の結果をrows行
+//   QUIT\n                              -> 接続を閉じる
+// 失敗したら ERR <理由>\n を返す．1つの接続の要求は届いた順に1つずつ処理する
+// EVALはソースの中に構文エラーやコンパイルできない定義，式が1つでもあればERRになる．それ以外の定義は残る
+// 相手が書き込み側だけを閉じた(shutdown(SHUT_WR))場合は，届いていた要求に全部答えてから閉じる
+//
+// 受け付けと読み書きはepollのイベントループが行い，要求の処理はInterpreterのEngineのスレッドプールに任せる
+// CALLは並列に実行する．EVALは定義を変えるので，実行中のCALLが終わるのを待ってから1つずつ行う
+// 呼ばれたときに再コンパイルされるとEVALと競合するので，code_cache_limitは使えない
+class Server
+{
+public:
+    Server(Interpreter& interpreter, std::string socket_path);
+    ~Server();
+
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    // stop()が呼ばれるまで要求を処理する．ソケットを用意できなければfalse
+    bool run();
+
+    // 別のスレッドやシグナルハンドラから呼んでよい
+    void stop();
+
+private:
+    struct Connection
+    {
+        int fd;
+        std::string in;   // まだ処理していない受信データ
+        std::string out;  // まだ送っていない応答
+        bool busy = false;  // ワーカーが要求を処理中
+        bool closing = false;  // 応答を送り終えたら閉じる
+        bool peer_closed = false;  // 相手が書き込みを閉じた．届いた要求に全部答えたら閉じる
+    };
+
+    bool listen();
+    void accept();
+    void receive(std::uint64_t id, bool hangup);
+    void send(std::uint64_t id);
+    void dispatch(std::uint64_t id);
+    void collect();
+    void close(std::uint64_t id);
+    void watch(std::uint64_t id);
+
+    std::string evaluate(const std::string& source);
+    std::string call(const std::string& name, const std::string& rows, std::size_t count);
+
+    Interpreter& interpreter;
+    std::string socket_path;
+
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    int wake_fd = -1;  // ワーカーやstop()がイベントループを起こすためのeventfd
+    std::atomic<bool> stopping{false};
+
+    std::uint64_t next_id = 1;  // fdは使い回されるので，接続は番号で区別する
+    std::unordered_map<std::uint64_t, Connection> connections;
+
+    // ワーカーが処理し終えた応答
+    std::mutex done_mutex;
+    std::vector<std::pair<std::uint64_t, std::string>> done;
+    std::size_t in_flight = 0;  // プールに投げてまだ終わっていない要求．fdを閉じる前に0になるのを待つ
+    std::condition_variable idle;
+
+    std::shared_mutex exec_mutex;  // CALLは共有，EVALは排他で取る
+
+    ThreadPool& pool;  // 他のセッションと共有しているので，壊すのではなくin_flightで待つ
+};
+
+}  // namespace kaleidoscope
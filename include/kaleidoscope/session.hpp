@@ -0,0 +1,34 @@
+#pragma once
+
+#include <llvm/Analysis/CGSCCPassManager.h>
+#include <llvm/Analysis/LoopAnalysisManager.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Target/TargetMachine.h>
+
+namespace kaleidoscope
+{
+
+// moduleをまたいで使い回す最適化パイプライン
+// パスの構築と解析の登録は最初に一度だけ行い，defやトップレベルの式ごとには作り直さない
+struct CompileSession
+{
+    explicit CompileSession(llvm::TargetMachine& TM);
+
+    CompileSession(const CompileSession&) = delete;
+    CompileSession& operator=(const CompileSession&) = delete;
+
+    // funcを最適化する．funcについてキャッシュした解析結果は捨てる
+    void optimize(llvm::Function& func);
+
+private:
+    llvm::PassBuilder PB;
+    llvm::LoopAnalysisManager LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager CGAM;
+    llvm::ModuleAnalysisManager MAM;
+    llvm::FunctionPassManager FPM;
+};
+
+}  // namespace kaleidoscope
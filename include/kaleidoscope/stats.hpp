@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace kaleidoscope
+{
+
+// 処理の段階．時間は入れ子になった段階の分を除いて数える
+enum class Phase
+{
+    lex,
+    parse,
+    codegen,
+    optimize,
+    jit,     // CompileLayerへのmoduleの追加
+    lookup,  // シンボルの検索．機械語への変換はここで遅延して行われる
+    execute,
+    none,
+};
+
+constexpr std::size_t phase_count = static_cast<std::size_t>(Phase::none);
+
+const char* phaseName(Phase phase);
+
+struct Stats
+{
+    using clock = std::chrono::steady_clock;
+
+    std::array<clock::duration, phase_count> time{};
+    std::array<std::size_t, phase_count> calls{};
+
+    std::size_t tokens = 0;
+    std::size_t ast_nodes = 0;
+    std::size_t defs = 0;
+    std::size_t top_levels = 0;
+    std::size_t ir_before = 0;  // 最適化前のIRの命令数
+    std::size_t ir_after = 0;   // 最適化後のIRの命令数
+    std::size_t code_bytes = 0;  // このセッションがJITに残している機械語のバイト数
+    std::size_t contexts = 0;  // LLVMContextを作り直した回数
+
+    // defごとのcodegenからJITへの追加までの時間
+    std::vector<std::pair<std::string, clock::duration>> functions;
+
+    void printPhases(std::ostream& os) const;
+    void print(std::ostream& os, std::size_t top_n = 10) const;
+    void printJSON(std::ostream& os, std::size_t top_n = 10) const;
+
+private:
+    friend struct PhaseTimer;
+
+    // 今計測している段階と，その段階に最後に時間を加えた時刻
+    Phase current = Phase::none;
+    clock::time_point since{};
+
+    void switchTo(Phase next)
+    {
+        auto now = clock::now();
+        if (current != Phase::none)
+            time[static_cast<std::size_t>(current)] += now - since;
+        current = next;
+        since = now;
+    }
+};
+
+// スコープの間をphaseとして計測する．statsがnullptrなら何もしない
+struct PhaseTimer
+{
+    PhaseTimer(Stats* stats, Phase phase) : stats{stats}
+    {
+        if (!stats)
+            return;
+        outer = stats->current;
+        ++stats->calls[static_cast<std::size_t>(phase)];
+        stats->switchTo(phase);
+    }
+
+    ~PhaseTimer()
+    {
+        if (stats)
+            stats->switchTo(outer);
+    }
+
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+private:
+    Stats* stats;
+    Phase outer = Phase::none;
+};
+
+}  // namespace kaleidoscope
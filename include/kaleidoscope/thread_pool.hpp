@@ -0,0 +1,81 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace kaleidoscope
+{
+
+// 固定数のスレッドで，投げられた仕事を投げられた順に実行する
+class ThreadPool
+{
+public:
+    explicit ThreadPool(std::size_t threads = std::thread::hardware_concurrency())
+    {
+        if (threads == 0)
+            threads = 1;
+        for (std::size_t i = 0; i < threads; ++i)
+            workers.emplace_back([this] { work(); });
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // 残っている仕事を全て終えてからスレッドを止める
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard lock{mutex};
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    void submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard lock{mutex};
+            tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+    std::size_t size() const { return workers.size(); }
+
+    // 今のスレッドがどれかのThreadPoolのスレッドか
+    static bool onWorkerThread() { return on_worker; }
+
+private:
+    void work()
+    {
+        on_worker = true;
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock lock{mutex};
+                cv.wait(lock, [&] { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+    static inline thread_local bool on_worker = false;
+};
+
+}  // namespace kaleidoscope
@@ -1,10 +1,147 @@
+#include <csignal>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <vector>
 
-#include <kaleidoscope/lex.hpp>
-#include <kaleidoscope/parser.hpp>
+#include <kaleidoscope/interpreter.hpp>
+#include <kaleidoscope/library.hpp>
+#include <kaleidoscope/server.hpp>
 
-int main() {
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/Path.h>
 
+using namespace kaleidoscope;
+
+namespace
+{
+void usage(const char* prog)
+{
+    std::cerr << "usage: " << prog << " [options] [file]\n"
+              << "       " << prog << " --precompile lib.ks [-o lib.kbc]\n"
+              << "  --load LIB     load a precompiled library before running\n"
+              << "  --time-phases  print wall time per phase to stderr\n"
+              << "  --stats        print phase times, counts and the slowest defs to stderr\n"
+              << "  --stats-json   same as --stats, as JSON\n"
+              << "  --perf-map     write /tmp/perf-<pid>.map for perf\n"
+              << "  --jitdump      write jitdump records for perf inject\n"
+              << "  --vtune        report JIT'd functions to VTune\n"
+              << "  --gdb          register JIT'd objects with GDB\n"
+              << "  -g             emit DWARF line info for defs\n"
+              << "  --serve PATH   load file, then serve requests on the Unix socket PATH\n"
+              << "  --workers N    number of worker threads for --serve\n";
+}
+
+Server* running_server = nullptr;
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    enum class Report { none, phases, text, json } report = Report::none;
+    const char* filename = nullptr;
+    const char* serve = nullptr;
+    const char* precompile = nullptr;
+    const char* output = nullptr;
+    std::vector<const char*> libraries;
+    Interpreter::Config config;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--perf-map") {
+            config.perf_map = true;
+        } else if (arg == "--jitdump") {
+            config.jitdump = true;
+        } else if (arg == "--vtune") {
+            config.vtune = true;
+        } else if (arg == "--gdb") {
+            config.gdb = true;
+        } else if (arg == "-g") {
+            config.debug_info = true;
+        } else if (arg == "--precompile" && i + 1 < argc) {
+            precompile = argv[++i];
+        } else if (arg == "-o" && i + 1 < argc) {
+            output = argv[++i];
+        } else if (arg == "--load" && i + 1 < argc) {
+            libraries.push_back(argv[++i]);
+        } else if (arg == "--serve" && i + 1 < argc) {
+            serve = argv[++i];
+        } else if (arg == "--workers" && i + 1 < argc) {
+            config.workers = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--time-phases") {
+            report = Report::phases;
+        } else if (arg == "--stats") {
+            report = Report::text;
+        } else if (arg == "--stats-json") {
+            report = Report::json;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    if (precompile) {
+        llvm::SmallString<128> out{output ? output : precompile};
+        if (!output)
+            llvm::sys::path::replace_extension(out, "kbc");
+        return precompileLibrary(precompile, out.str().str()) ? 0 : 1;
+    }
+
+    config.collect_stats = report != Report::none;
+    if (filename)
+        config.source_file = filename;
+
+    std::istringstream no_input;
+    auto interpreter = filename ? std::make_unique<Interpreter>(filename, "my-cool-jit", config)
+                       : serve  ? std::make_unique<Interpreter>(no_input, "my-cool-jit", config)
+                                : std::make_unique<Interpreter>(std::cin, "my-cool-jit", config);
+
+    for (auto lib : libraries)
+        if (!interpreter->load(lib))
+            return 1;
+
+    if (filename || serve) {
+        while (interpreter->run())
+            ;
+    } else {
+        std::cout << "ready> ";
+        while (interpreter->run())
+            std::cout << std::flush << "\nready> ";
+    }
+
+    if (serve) {
+        // ファイルの定義を読み込んだ状態で要求を待つ
+        Server server{*interpreter, serve};
+        running_server = &server;
+        std::signal(SIGINT, [](int) { running_server->stop(); });
+        std::signal(SIGTERM, [](int) { running_server->stop(); });
+        std::signal(SIGPIPE, SIG_IGN);
+        auto served = server.run();
+        // serverはこのブロックで壊れるので，ハンドラを戻してから参照を消す
+        std::signal(SIGINT, SIG_DFL);
+        std::signal(SIGTERM, SIG_DFL);
+        std::signal(SIGPIPE, SIG_DFL);
+        running_server = nullptr;
+        if (!served)
+            return 1;
+    }
+
+    switch (report) {
+    case Report::none:
+        break;
+    case Report::phases:
+        interpreter->getStats().printPhases(std::cerr);
+        break;
+    case Report::text:
+        interpreter->getStats().print(std::cerr);
+        break;
+    case Report::json:
+        interpreter->getStats().printJSON(std::cerr);
+        break;
+    }
     return 0;
 }
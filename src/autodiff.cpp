@@ -0,0 +1,226 @@
+#include <kaleidoscope/ast.hpp>
+
+#include <functional>
+#include <iostream>
+
+namespace kaleidoscope
+{
+
+// 逆モードの自動微分
+// 本体の式をDAGとして見て，根(defの値)から葉(引数)へ随伴を配る．各ノードの随伴は，全ての親から集め終わってから子に配る
+// 随伴もASTとして組み立て，元の本体と部分木を共有する．codegenのCSEで本体と同じ計算は一度になる
+
+template <class... Msg>
+std::unique_ptr<FunctionAST> logErrorG(Msg&&... msg)
+{
+    ((std::cerr << "LogGradient: ") << ... << msg) << std::endl;
+    return nullptr;
+}
+
+struct Adjoints
+{
+    using Map = std::unordered_map<const ExprAST*, ExprPtr, CodeGenEnv::ExprHash, CodeGenEnv::ExprEqual>;
+
+    ExprFactory factory;
+    Map adjoints;  // 構造が同じ式は同じ値なので，随伴もまとめる
+    // 本体にifがあれば，随伴が0の枝では局所的な微分を計算しない
+    // 選ばれなかった枝の log(x) などの微分が無限大になり，0倍してNaNになるのを防ぐ
+    bool guarded = false;
+    std::unordered_set<std::string> libm;  // 導関数に使ったlibmの関数
+    std::string error;
+
+    Adjoints() { factory.enabled = true; }
+
+    ExprPtr number(double v) { return factory.make<NumberExpAST>(v); }
+    ExprPtr binary(const char* op, ExprPtr l, ExprPtr r) { return factory.make<BinaryExprAST>(op, std::move(l), std::move(r)); }
+    ExprPtr call(const char* callee, std::vector<ExprPtr> args)
+    {
+        libm.insert(callee);
+        return factory.make<CallExprAST>(callee, std::move(args));
+    }
+    ExprPtr select(ExprPtr cond, ExprPtr then, ExprPtr els)
+    {
+        return factory.make<IfExprAST>(std::move(cond), std::move(then), std::move(els));
+    }
+    ExprPtr negate(ExprPtr e) { return binary("-", number(0.0), std::move(e)); }
+
+    // 定数には配らない．定数の微分を作るのに必要な関数も宣言しなくて済む
+    static bool wants(const ExprPtr& child) { return !dynamic_cast<const NumberExpAST*>(child.get()); }
+
+    // 随伴adjointに局所的な微分factorを掛ける
+    ExprPtr scale(const ExprPtr& adjoint, ExprPtr factor)
+    {
+        auto one = [](const ExprPtr& e) {
+            auto num = dynamic_cast<const NumberExpAST*>(e.get());
+            return num && num->getValue() == 1.0;
+        };
+        if (one(adjoint))
+            return factor;
+        if (one(factor))
+            return adjoint;
+        auto product = binary("*", adjoint, std::move(factor));
+        if (!guarded || !wants(adjoint))
+            return product;
+        // 0ならそのまま返す．NaNも条件が偽になるので，そのまま伝わる
+        return select(adjoint, std::move(product), adjoint);
+    }
+
+    void accumulate(const ExprPtr& child, ExprPtr contribution)
+    {
+        if (!wants(child))
+            return;
+        auto& adjoint = adjoints[child.get()];
+        adjoint = adjoint ? binary("+", adjoint, std::move(contribution)) : std::move(contribution);
+    }
+
+    ExprPtr adjointOf(const ExprPtr& e) const
+    {
+        auto a = adjoints.find(e.get());
+        return a != adjoints.end() ? a->second : nullptr;
+    }
+};
+
+namespace
+{
+// 子より親が先に来る順に並べる(帰りがけ順の逆)
+void postorder(const ExprPtr& e, std::unordered_set<const ExprAST*, CodeGenEnv::ExprHash, CodeGenEnv::ExprEqual>& visited,
+               std::vector<ExprPtr>& order)
+{
+    if (!visited.insert(e.get()).second)
+        return;
+    std::vector<ExprPtr> children;
+    e->children(children);
+    for (auto& child : children)
+        postorder(child, visited, order);
+    order.push_back(e);
+}
+
+// libmの関数の，i番目の引数での偏微分．argsは呼び出しの引数
+using Derivative = std::function<ExprPtr(Adjoints&, const std::vector<ExprPtr>& args, size_t i)>;
+
+const std::unordered_map<std::string, std::pair<size_t, Derivative>> derivatives = {
+    {"sin", {1, [](Adjoints& a, auto& x, size_t) { return a.call("cos", {x[0]}); }}},
+    {"cos", {1, [](Adjoints& a, auto& x, size_t) { return a.negate(a.call("sin", {x[0]})); }}},
+    {"exp", {1, [](Adjoints& a, auto& x, size_t) { return a.call("exp", {x[0]}); }}},
+    // 割り算がないので，逆数はpowで作る
+    {"log", {1, [](Adjoints& a, auto& x, size_t) { return a.call("pow", {x[0], a.number(-1.0)}); }}},
+    {"sqrt", {1, [](Adjoints& a, auto& x, size_t) {
+         return a.binary("*", a.call("pow", {x[0], a.number(-0.5)}), a.number(0.5));
+     }}},
+    {"fabs", {1, [](Adjoints& a, auto& x, size_t) {
+         return a.select(a.binary("<", x[0], a.number(0.0)), a.number(-1.0), a.number(1.0));
+     }}},
+    {"floor", {1, [](Adjoints&, auto&, size_t) { return ExprPtr{}; }}},  // ほとんど至る所で0
+    {"ceil", {1, [](Adjoints&, auto&, size_t) { return ExprPtr{}; }}},
+    {"pow", {2, [](Adjoints& a, auto& x, size_t i) {
+         if (i == 0)
+             return a.binary("*", a.call("pow", {x[0], a.binary("-", x[1], a.number(1.0))}), x[1]);
+         return a.binary("*", a.call("pow", {x[0], x[1]}), a.call("log", {x[0]}));
+     }}},
+    {"fma", {3, [](Adjoints& a, auto& x, size_t i) { return i == 0 ? x[1] : i == 1 ? x[0] : a.number(1.0); }}},
+};
+}  // namespace
+
+bool BinaryExprAST::backprop(Adjoints& a, const ExprPtr& adjoint) const
+{
+    if (op == "+") {
+        a.accumulate(lhs, adjoint);
+        a.accumulate(rhs, adjoint);
+    } else if (op == "-") {
+        a.accumulate(lhs, adjoint);
+        if (a.wants(rhs))
+            a.accumulate(rhs, a.negate(adjoint));
+    } else if (op == "*") {
+        if (a.wants(lhs))
+            a.accumulate(lhs, a.scale(adjoint, rhs));
+        if (a.wants(rhs))
+            a.accumulate(rhs, a.scale(adjoint, lhs));
+    } else if (op != "<" && op != ">") {  // 比較の値は0か1なので，微分は0
+        a.error = "unknown binary operator: " + op;
+        return false;
+    }
+    return true;
+}
+
+bool CallExprAST::backprop(Adjoints& a, const ExprPtr& adjoint) const
+{
+    auto d = derivatives.find(callee);
+    if (d == derivatives.end() || d->second.first != args.size()) {
+        a.error = "cannot differentiate a call to " + callee;
+        return false;
+    }
+    for (size_t i = 0; i < args.size(); ++i)
+        if (a.wants(args[i]))
+            if (auto factor = d->second.second(a, args, i))
+                a.accumulate(args[i], a.scale(adjoint, std::move(factor)));
+    return true;
+}
+
+bool IfExprAST::backprop(Adjoints& a, const ExprPtr& adjoint) const
+{
+    // 選ばれた枝にだけ配る．条件は微分しない
+    if (a.wants(then))
+        a.accumulate(then, a.select(cond, adjoint, a.number(0.0)));
+    if (a.wants(els))
+        a.accumulate(els, a.select(cond, a.number(0.0), adjoint));
+    return true;
+}
+
+std::unique_ptr<FunctionAST> FunctionAST::gradient(
+    CodeGenEnv& env, std::vector<std::unique_ptr<PrototypeAST>>& externs) const
+{
+    auto& name = proto->getName();
+    if (!proto->isDoubles())
+        return logErrorG("only functions of doubles can be differentiated: ", name);
+
+    Adjoints a;
+    std::unordered_set<const ExprAST*, CodeGenEnv::ExprHash, CodeGenEnv::ExprEqual> visited;
+    std::vector<ExprPtr> order;
+    postorder(body, visited, order);
+    a.guarded = std::any_of(order.begin(), order.end(), [](auto& e) { return dynamic_cast<const IfExprAST*>(e.get()); });
+
+    a.adjoints[body.get()] = a.number(1.0);
+    for (auto e = order.rbegin(); e != order.rend(); ++e) {
+        // 随伴がなければ，出力はこの式によらない(比較の中など)
+        if (auto adjoint = a.adjointOf(*e); adjoint && !(*e)->backprop(a, adjoint))
+            return logErrorG(a.error.empty() ? "cannot differentiate loops or buffers" : a.error, " in ", name);
+    }
+
+    // 導関数に使うlibmの関数は，intrinsicになるようにexternで宣言されている必要がある
+    for (auto& callee : a.libm) {
+        auto fi = env.proto_func.find(callee);
+        if (fi == env.proto_func.end()) {
+            std::vector<std::string> params{"x", "y", "z"};
+            params.resize(derivatives.at(callee).first);
+            externs.push_back(std::make_unique<PrototypeAST>(callee, std::move(params), true));
+        } else if (!fi->second->isExtern()) {
+            return logErrorG(callee, " is defined by a def and cannot be used in the derivative of ", name);
+        }
+    }
+
+    // d_<name>(args..., grad[]): 引数と重ならない名前のバッファに偏微分を書いてから値を返す
+    // gradが引数の数より短ければ何も書かず，値だけを返す．偏微分は全て同じ枝で計算し，共通部分をCSEさせる
+    auto args = proto->getArgs();
+    std::string grad = "grad";
+    while (std::find(args.begin(), args.end(), grad) != args.end())
+        grad += "_";
+
+    std::vector<ExprPtr> seq;
+    for (size_t i = 0; i < args.size(); ++i) {
+        auto partial = a.adjointOf(a.factory.make<VariableExprAST>(args[i]));
+        seq.push_back(a.factory.make<StoreExprAST>(grad, a.number(i), partial ? partial : a.number(0.0)));
+    }
+    seq.push_back(body);
+    auto len = a.factory.make<CallExprAST>("len", std::vector<ExprPtr>{a.factory.make<VariableExprAST>(grad)});
+    auto short_buffer = a.binary("<", len, a.number(args.size()));
+    auto d_body = a.select(short_buffer, body, std::make_shared<SeqExprAST>(std::move(seq)));
+
+    std::vector<bool> buffers(args.size());
+    buffers.push_back(true);
+    args.push_back(grad);
+    auto d = std::make_unique<PrototypeAST>("d_" + name, std::move(args), false, std::move(buffers));
+    d->setLine(proto->getLine());
+    return std::make_unique<FunctionAST>(std::move(d), std::move(d_body));
+}
+
+}  // namespace kaleidoscope
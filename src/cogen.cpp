@@ -1,12 +1,24 @@
 #include <kaleidoscope/ast.hpp>
 
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/BinaryFormat/Dwarf.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/DebugInfoMetadata.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <iostream>
+#include <unordered_map>
 
 namespace kaleidoscope
 {
@@ -26,9 +38,562 @@ llvm::Function* logErrorF(Msg&&... msg)
     return nullptr;
 }
 
+namespace
+{
+struct Builtin
+{
+    llvm::Intrinsic::ID id;
+    size_t arity;
+};
+
+// externで宣言された関数のうち，LLVMのintrinsicに対応するもの
+// intrinsicにしておくと定数畳み込みやベクトル化(ベクトル数学ライブラリへの置換)の対象になる
+const std::unordered_map<std::string, Builtin> builtins = {
+    {"sin", {llvm::Intrinsic::sin, 1}},
+    {"cos", {llvm::Intrinsic::cos, 1}},
+    {"sqrt", {llvm::Intrinsic::sqrt, 1}},
+    {"fabs", {llvm::Intrinsic::fabs, 1}},
+    {"exp", {llvm::Intrinsic::exp, 1}},
+    {"log", {llvm::Intrinsic::log, 1}},
+    {"pow", {llvm::Intrinsic::pow, 2}},
+    {"floor", {llvm::Intrinsic::floor, 1}},
+    {"ceil", {llvm::Intrinsic::ceil, 1}},
+    {"fma", {llvm::Intrinsic::fma, 3}},
+};
+
+llvm::Constant* hostPointer(CodeGenEnv& env, const void* ptr)
+{
+    auto addr = llvm::ConstantInt::get(llvm::Type::getInt64Ty(*env.context), reinterpret_cast<std::uintptr_t>(ptr));
+    return llvm::ConstantExpr::getIntToPtr(addr, llvm::Type::getInt8PtrTy(*env.context));
+}
+
+llvm::Type* llvmType(llvm::LLVMContext& context, ValueType type)
+{
+    switch (type) {
+    case ValueType::f32:
+        return llvm::Type::getFloatTy(context);
+    case ValueType::i64:
+        return llvm::Type::getInt64Ty(context);
+    default:
+        return llvm::Type::getDoubleTy(context);
+    }
+}
+
+// バッファの引数は要素へのポインタとint64_tの2つになる
+llvm::FunctionType* signatureType(llvm::LLVMContext& context, const PrototypeAST& proto)
+{
+    std::vector<llvm::Type*> params;
+    for (size_t i = 0; i < proto.arity(); ++i) {
+        auto type = llvmType(context, proto.getType(i));
+        if (proto.isBuffer(i)) {
+            params.push_back(type->getPointerTo());
+            params.push_back(llvm::Type::getInt64Ty(context));
+        } else {
+            params.push_back(type);
+        }
+    }
+    return llvm::FunctionType::get(llvmType(context, proto.getReturnType()), params, false);
+}
+
+// 型の広さ．i64 < f32 < f64
+int rank(llvm::Type* type)
+{
+    return type->isDoubleTy() ? 2 : type->isFloatTy() ? 1 : 0;
+}
+
+// vをtoの型にする．浮動小数点から整数へは0に向かって丸める
+llvm::Value* convert(CodeGenEnv& env, llvm::Value* v, llvm::Type* to)
+{
+    auto from = v->getType();
+    if (from == to)
+        return v;
+    if (from->isIntegerTy())
+        return env.builder->CreateSIToFP(v, to, "conv");
+    if (to->isIntegerTy())
+        return env.builder->CreateFPToSI(v, to, "conv");
+    return env.builder->CreateFPCast(v, to, "conv");
+}
+
+// eが数値リテラルで，typeの値として使えるか．i64には整数だけ，f32には丸めて使う
+bool fits(const ExprAST& e, llvm::Type* type)
+{
+    auto num = dynamic_cast<const NumberExpAST*>(&e);
+    if (!num)
+        return false;
+    if (!type->isIntegerTy())
+        return true;
+    auto v = num->getValue();
+    return std::trunc(v) == v && std::abs(v) < 0x1p63;
+}
+
+// 2つの式を揃える型．リテラルは相手に合わせ，それ以外は広い方にする
+// f32どうしの計算にリテラルが混ざってもf64に広がらない
+llvm::Type* commonType(const ExprAST& lhs, llvm::Value* l, const ExprAST& rhs, llvm::Value* r)
+{
+    if (fits(lhs, r->getType()))
+        return r->getType();
+    if (fits(rhs, l->getType()))
+        return l->getType();
+    return rank(l->getType()) >= rank(r->getType()) ? l->getType() : r->getType();
+}
+
+// libmの関数を計算する浮動小数点型．リテラル以外の引数の広い方で，全て整数ならf64
+llvm::Type* floatType(CodeGenEnv& env, const std::vector<ExprPtr>& args, const std::vector<llvm::Value*>& values)
+{
+    llvm::Type* type = nullptr;
+    for (size_t i = 0; i < args.size(); ++i)
+        if (values[i] && !dynamic_cast<const NumberExpAST*>(args[i].get()) &&
+            (!type || rank(values[i]->getType()) > rank(type)))
+            type = values[i]->getType();
+    if (!type || type->isIntegerTy())
+        return llvm::Type::getDoubleTy(*env.context);
+    return type;
+}
+
+// nameがバッファの引数なら，その先頭のポインタ．forの変数で隠されていればnullptr
+llvm::Value* bufferNamed(CodeGenEnv& env, const std::string& name)
+{
+    auto v = env.named_value.find(name);
+    if (v == env.named_value.end() || !v->second || !v->second->getType()->isPointerTy())
+        return nullptr;
+    return v->second;
+}
+
+// インデックスやループの範囲はi64で数える
+llvm::Value* toIndex(CodeGenEnv& env, llvm::Value* v)
+{
+    return convert(env, v, llvm::Type::getInt64Ty(*env.context));
+}
+
+// xs[index]のアドレス．要素の型はポインタの型から分かる
+llvm::Value* elementPointer(CodeGenEnv& env, const std::string& name, ExprAST& index)
+{
+    auto buffer = bufferNamed(env, name);
+    if (!buffer)
+        return logErrorV("not a buffer: ", name);
+
+    auto i = index.codegen(env);
+    if (!i)
+        return nullptr;
+    auto element_ty = buffer->getType()->getPointerElementType();
+    return env.builder->CreateInBoundsGEP(element_ty, buffer, toIndex(env, i), "elemptr");
+}
+
+// reduceの単位元．min, maxは型の最大値と最小値(浮動小数点は無限大)
+llvm::Constant* reduceIdentity(const std::string& op, llvm::Type* type)
+{
+    bool fp = !type->isIntegerTy();
+    if (op == "+")
+        return fp ? llvm::ConstantFP::get(type, 0.0) : llvm::ConstantInt::get(type, 0);
+    if (op == "*")
+        return fp ? llvm::ConstantFP::get(type, 1.0) : llvm::ConstantInt::get(type, 1);
+    if (fp)
+        return llvm::ConstantFP::getInfinity(type, op == "max");
+    return llvm::ConstantInt::get(type, op == "min" ? llvm::APInt::getSignedMaxValue(64) : llvm::APInt::getSignedMinValue(64));
+}
+
+// reduceの途中結果accに値vを合わせる．回の順序は決まっていないので，浮動小数点の和と積は結合則を仮定してよい
+llvm::Value* reduceStep(CodeGenEnv& env, const std::string& op, llvm::Value* acc, llvm::Value* v)
+{
+    auto type = acc->getType();
+    if (type->isIntegerTy()) {
+        if (op == "+")
+            return env.builder->CreateAdd(acc, v, "redtmp");
+        if (op == "*")
+            return env.builder->CreateMul(acc, v, "redtmp");
+        auto cmp = op == "min" ? env.builder->CreateICmpSLT(v, acc) : env.builder->CreateICmpSGT(v, acc);
+        return env.builder->CreateSelect(cmp, v, acc, "redtmp");
+    }
+
+    // minnum, maxnumはNaNを無視する
+    if (op == "min" || op == "max") {
+        auto id = op == "min" ? llvm::Intrinsic::minnum : llvm::Intrinsic::maxnum;
+        return env.builder->CreateCall(llvm::Intrinsic::getDeclaration(env.module.get(), id, {type}), {acc, v}, "redtmp");
+    }
+    auto ret = op == "+" ? env.builder->CreateFAdd(acc, v, "redtmp") : env.builder->CreateFMul(acc, v, "redtmp");
+    llvm::FastMathFlags fmf;
+    fmf.setAllowReassoc();
+    llvm::cast<llvm::Instruction>(ret)->setFastMathFlags(fmf);
+    return ret;
+}
+}  // namespace
+
+bool CodeGenEnv::isPure(const std::string& name)
+{
+    auto fi = proto_func.find(name);
+    if (fi == proto_func.end())
+        return false;
+
+    if (!fi->second->isExtern())
+        return fi->second->isPure() && !hot_swap;
+
+    auto host = JIT->findHostSymbol(name);
+    return host && std::find(host->Attrs.begin(), host->Attrs.end(), llvm::Attribute::ReadNone) != host->Attrs.end();
+}
+
+llvm::Function* CodeGenEnv::getIntrinsic(const std::string& name, llvm::Type* type)
+{
+    auto fi = proto_func.find(name);
+    if (fi == proto_func.end() || !fi->second->isExtern())
+        return nullptr;
+
+    auto bi = builtins.find(name);
+    if (bi == builtins.end() || bi->second.arity != fi->second->arity() || !fi->second->isDoubles())
+        return nullptr;
+
+    return llvm::Intrinsic::getDeclaration(module.get(), bi->second.id, {type});
+}
+
+CodeGenEnv::~CodeGenEnv()
+{
+    std::lock_guard lock{engine->mutex};  // JITは他のセッションと共有している
+    for (auto key : module_keys)
+        JIT->removeModule(key);
+}
+
+llvm::orc::VModuleKey CodeGenEnv::addModule(std::unique_ptr<llvm::Module> m)
+{
+    auto key = JIT->addModule(std::move(m));
+    module_keys.insert(key);
+    return key;
+}
+
+void CodeGenEnv::removeModule(llvm::orc::VModuleKey key)
+{
+    JIT->removeModule(key);
+    module_keys.erase(key);
+}
+
+void CodeGenEnv::updateStub(const std::string& name, const std::string& impl, llvm::orc::VModuleKey key)
+{
+    // 再帰するdefはnameを呼ぶので，スタブを先にJITに入れてからimplを解決する
+    // スタブのslotはimplのアドレスを入れるまで空のまま
+    auto& stub = stubs[name];
+    if (!stub) {
+        stub = std::make_unique<Stub>();
+        stub->env = this;
+        stub->name = name;
+        stub->proto = std::make_unique<PrototypeAST>(*proto_func.at(name));
+        clock.push_back(stub.get());
+        buildStub(*stub);
+    } else if (stub->resident) {
+        retired.push_back(stub->key);  // 古い版は誰も実行していないときに捨てる
+    }
+    auto addr = llvm::cantFail(JIT->findSymbol(impl).getAddress());
+
+    // 新しい版を指すだけ．呼び出し側はスタブにリンクされているので再コンパイルはいらない
+    stub->key = key;
+    stub->resident = true;
+    stub->touched.store(true, std::memory_order_relaxed);
+    stub->target.store(addr, std::memory_order_release);
+}
+
+void CodeGenEnv::buildStub(Stub& stub)
+{
+    // name(args) = (*slot)(args) だけのスタブを専用のmoduleに作る
+    // コードを追い出せる場合は，呼ばれた印を付け，slotが空ならコンパイルし直してから呼ぶ
+    auto stub_module = std::make_unique<llvm::Module>("stub." + stub.name, *context);
+    stub_module->setDataLayout(JIT->getDataLayout());
+
+    auto i64 = llvm::Type::getInt64Ty(*context);
+    auto func_type = signatureType(*context, *stub.proto);
+    auto func_ptr_type = func_type->getPointerTo();
+    auto func = llvm::Function::Create(func_type, llvm::Function::ExternalLinkage, symbolFor(stub.name), stub_module.get());
+    auto entry = llvm::BasicBlock::Create(*context, "entry", func);
+    builder->SetInsertPoint(entry);
+
+    auto slot = llvm::ConstantExpr::getIntToPtr(
+        llvm::ConstantInt::get(i64, reinterpret_cast<std::uintptr_t>(&stub.target)), func_ptr_type->getPointerTo());
+    llvm::Value* target = builder->CreateAlignedLoad(func_ptr_type, slot, llvm::MaybeAlign(8), "target");
+    llvm::cast<llvm::LoadInst>(target)->setAtomic(llvm::AtomicOrdering::Acquire);
+
+    if (code_cache_limit) {
+        auto touched = llvm::ConstantExpr::getIntToPtr(
+            llvm::ConstantInt::get(i64, reinterpret_cast<std::uintptr_t>(&stub.touched)),
+            llvm::Type::getInt8PtrTy(*context));
+        auto mark = builder->CreateAlignedStore(llvm::ConstantInt::get(llvm::Type::getInt8Ty(*context), 1), touched, llvm::MaybeAlign(1));
+        mark->setAtomic(llvm::AtomicOrdering::Monotonic);
+
+        auto materialize_bb = llvm::BasicBlock::Create(*context, "materialize", func);
+        auto call_bb = llvm::BasicBlock::Create(*context, "call", func);
+        builder->CreateCondBr(builder->CreateIsNull(target, "evicted"), materialize_bb, call_bb);
+
+        builder->SetInsertPoint(materialize_bb);
+        auto materialize = stub_module->getOrInsertFunction("kaleidoscope_materialize",
+            llvm::FunctionType::get(i64, {llvm::Type::getInt8PtrTy(*context)}, false));
+        auto addr = builder->CreateCall(materialize, {hostPointer(*this, &stub)}, "addr");
+        auto compiled = builder->CreateIntToPtr(addr, func_ptr_type, "compiled");
+        builder->CreateBr(call_bb);
+
+        builder->SetInsertPoint(call_bb);
+        auto phi = builder->CreatePHI(func_ptr_type, 2, "target");
+        phi->addIncoming(target, entry);
+        phi->addIncoming(compiled, materialize_bb);
+        target = phi;
+    }
+
+    std::vector<llvm::Value*> args;
+    for (auto& arg : func->args())
+        args.push_back(&arg);
+    auto call = builder->CreateCall(func_type, target, args);
+    call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+    builder->CreateRet(call);
+    llvm::verifyFunction(*func);
+
+    addModule(std::move(stub_module));
+}
+
+void CodeGenEnv::evictCode()
+{
+    // ここは実行中のコードがないときにしか呼ばれないので，古い版を捨ててよい
+    for (auto key : retired)
+        removeModule(key);
+    retired.clear();
+
+    if (code_cache_limit == 0 || clock.empty())
+        return;
+
+    // CLOCK法: 前に見てから呼ばれていないdefのコードを捨てる．スタブは残るので，次に呼ばれたら作り直す
+    auto& mapper = JIT->getMemoryMapper();
+    for (size_t scanned = 0; mapper.bytesInUse() > code_cache_limit && scanned < 2 * clock.size(); ++scanned) {
+        auto stub = clock[clock_hand];
+        clock_hand = (clock_hand + 1) % clock.size();
+
+        if (!stub->resident || stub->touched.exchange(false, std::memory_order_relaxed))
+            continue;
+
+        stub->target.store(0, std::memory_order_release);
+        stub->resident = false;
+        removeModule(stub->key);
+    }
+}
+
+void CodeGenEnv::recycleContext()
+{
+    // JITに渡したmoduleは機械語になっているので，古いcontextを参照しているのはここで持っているIRだけ
+    std::vector<std::pair<std::string, llvm::SmallVector<char, 0>>> saved;
+    for (auto& [name, candidate] : inline_candidates) {
+        auto& [_, bitcode] = saved.emplace_back(name, llvm::SmallVector<char, 0>{});
+        llvm::raw_svector_ostream os{bitcode};
+        llvm::WriteBitcodeToFile(*candidate, os);
+    }
+
+    named_value.clear();
+    cse_values.clear();
+    loaded.clear();
+    inline_candidates.clear();
+    dbuilder.reset();
+    compile_unit = nullptr;
+    module.reset();
+    builder.reset();
+    context = std::make_unique<llvm::LLVMContext>();
+    builder = std::make_unique<llvm::IRBuilder<>>(*context);
+    context_units = 0;
+
+    for (auto& [name, bitcode] : saved) {
+        llvm::MemoryBufferRef buffer{llvm::StringRef{bitcode.data(), bitcode.size()}, name};
+        inline_candidates.emplace(name, llvm::cantFail(llvm::parseBitcodeFile(buffer, *context)));
+    }
+    if (stats)
+        ++stats->contexts;
+}
+
+void CodeGenEnv::initDebugInfo()
+{
+    module->addModuleFlag(llvm::Module::Warning, "Debug Info Version", llvm::DEBUG_METADATA_VERSION);
+    module->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 4);
+
+    dbuilder = std::make_unique<llvm::DIBuilder>(*module);
+    auto file = dbuilder->createFile(llvm::sys::path::filename(source_file), llvm::sys::path::parent_path(source_file));
+    compile_unit = dbuilder->createCompileUnit(llvm::dwarf::DW_LANG_C, file, "kaleidoscope", true, "", 0);
+}
+
+void CodeGenEnv::finalizeDebugInfo()
+{
+    if (dbuilder)
+        dbuilder->finalize();
+}
+
+void CodeGenEnv::rememberForInlining(llvm::Function& func)
+{
+    if (hot_swap)  // 呼び出し側はスタブを呼ぶので，本体をインライン展開することはない
+        return;
+    if (debug_info)  // 別のmoduleのデバッグ情報を持ち込まない
+        return;
+    // parforやreduceの本体はmodule内だけの関数なので，別のmoduleからは宣言として参照できない
+    if (std::any_of(module->begin(), module->end(), [](auto& f) { return f.hasLocalLinkage(); })) {
+        inline_candidates.erase(func.getName().str());
+        return;
+    }
+
+    auto name = func.getName().str();
+    if (inline_threshold == 0 || func.getInstructionCount() > inline_threshold) {
+        inline_candidates.erase(name);  // 再定義で大きくなった場合は古いIRを捨てる
+        return;
+    }
+    inline_candidates.insert_or_assign(name, llvm::CloneModule(*module));
+}
+
+void CodeGenEnv::inlineCalls(llvm::Function& caller)
+{
+    std::vector<llvm::CallInst*> calls;
+    for (auto& bb : caller)
+        for (auto& inst : bb)
+            if (auto call = llvm::dyn_cast<llvm::CallInst>(&inst))
+                if (auto callee = call->getCalledFunction();
+                    callee && callee != &caller && inline_candidates.count(callee->getName().str()))
+                    calls.push_back(call);
+
+    // 呼び出し先の本体を一時的にこのmoduleへコピーしてインライン展開し，終わったら宣言に戻す
+    std::vector<llvm::Function*> materialized;
+    for (auto call : calls) {
+        auto callee = call->getCalledFunction();
+        if (callee->isDeclaration()) {
+            auto& src_module = *inline_candidates.at(callee->getName().str());
+            auto src = src_module.getFunction(callee->getName());
+
+            // 本体から呼ぶ関数は，readnoneなどの属性も元の宣言から写す
+            llvm::ValueToValueMapTy vmap;
+            for (auto& f : src_module) {
+                if (&f == src) {
+                    vmap[&f] = callee;
+                } else if (module->getFunction(f.getName())) {
+                    vmap[&f] = module->getOrInsertFunction(f.getName(), f.getFunctionType()).getCallee();
+                } else {
+                    auto decl = llvm::Function::Create(
+                        f.getFunctionType(), llvm::Function::ExternalLinkage, f.getName(), module.get());
+                    decl->copyAttributesFrom(&f);
+                    vmap[&f] = decl;
+                }
+            }
+            auto dst_arg = callee->arg_begin();
+            for (auto& arg : src->args())
+                vmap[&arg] = &*dst_arg++;
+
+            llvm::SmallVector<llvm::ReturnInst*, 4> returns;
+            llvm::CloneFunctionInto(callee, src, vmap, true, returns);
+            materialized.push_back(callee);
+        }
+
+        llvm::InlineFunctionInfo ifi;
+        if (llvm::InlineFunction(call, ifi))
+            inlined.insert(callee->getName().drop_front(symbol_prefix.size()).str());  // ソースの名前で覚える
+    }
+
+    for (auto callee : materialized)
+        callee->deleteBody();
+}
+
+namespace
+{
+// 引数をスタックに並べてキャッシュを引き，ヒットすればその値を返す
+// 戻り値は並べた引数の先頭で，ミスした側のブロックに挿入位置を移しておく
+llvm::Value* emitMemoLookup(CodeGenEnv& env, llvm::Function& func, MemoTable* table)
+{
+    auto double_ty = llvm::Type::getDoubleTy(*env.context);
+    auto i64 = llvm::Type::getInt64Ty(*env.context);
+    auto n = llvm::ConstantInt::get(i64, func.arg_size());
+
+    auto args = env.builder->CreateAlloca(double_ty, n, "memo.args");
+    unsigned i = 0;
+    for (auto& arg : func.args())
+        env.builder->CreateStore(&arg, env.builder->CreateConstGEP1_32(double_ty, args, i++));
+
+    auto find = env.module->getOrInsertFunction("kaleidoscope_memo_find",
+        llvm::FunctionType::get(double_ty->getPointerTo(),
+            {llvm::Type::getInt8PtrTy(*env.context), double_ty->getPointerTo(), i64}, false));
+    auto cached = env.builder->CreateCall(find, {hostPointer(env, table), args, n}, "memo.cached");
+    auto hit = env.builder->CreateICmpNE(cached, llvm::ConstantPointerNull::get(double_ty->getPointerTo()), "memo.hit");
+
+    auto hit_bb = llvm::BasicBlock::Create(*env.context, "memo.hit", &func);
+    auto miss_bb = llvm::BasicBlock::Create(*env.context, "memo.miss", &func);
+    env.builder->CreateCondBr(hit, hit_bb, miss_bb);
+
+    env.builder->SetInsertPoint(hit_bb);
+    env.builder->CreateRet(env.builder->CreateLoad(double_ty, cached, "memo.value"));
+
+    env.builder->SetInsertPoint(miss_bb);
+    return args;
+}
+
+void emitMemoStore(CodeGenEnv& env, MemoTable* table, llvm::Value* args, size_t n, llvm::Value* value)
+{
+    auto double_ty = llvm::Type::getDoubleTy(*env.context);
+    auto i64 = llvm::Type::getInt64Ty(*env.context);
+
+    auto store = env.module->getOrInsertFunction("kaleidoscope_memo_store",
+        llvm::FunctionType::get(llvm::Type::getVoidTy(*env.context),
+            {llvm::Type::getInt8PtrTy(*env.context), double_ty->getPointerTo(), i64, double_ty}, false));
+    env.builder->CreateCall(store, {hostPointer(env, table), args, llvm::ConstantInt::get(i64, n), value});
+}
+
+// funcに行情報を付け，この後builderで作る命令をprotoの行に対応付ける
+void emitSubprogram(CodeGenEnv& env, llvm::Function& func, const PrototypeAST& proto)
+{
+    auto& dbuilder = *env.dbuilder;
+    auto file = env.compile_unit->getFile();
+    llvm::DIType* double_ty = dbuilder.createBasicType("double", 64, llvm::dwarf::DW_ATE_float);
+    llvm::DIType* float_ty = dbuilder.createBasicType("float", 32, llvm::dwarf::DW_ATE_float);
+    llvm::DIType* int_ty = dbuilder.createBasicType("int64_t", 64, llvm::dwarf::DW_ATE_signed);
+    auto scalar = [&](llvm::Type* type) { return type->isDoubleTy() ? double_ty : type->isFloatTy() ? float_ty : int_ty; };
+
+    std::vector<llvm::Metadata*> types{scalar(func.getReturnType())};  // 戻り値と引数
+    for (auto& arg : func.args()) {
+        auto type = arg.getType();
+        types.push_back(type->isPointerTy() ? dbuilder.createPointerType(scalar(type->getPointerElementType()), 64)
+                                            : scalar(type));
+    }
+    auto func_ty = dbuilder.createSubroutineType(dbuilder.getOrCreateTypeArray(types));
+
+    auto line = proto.getLine();
+    auto sp = dbuilder.createFunction(file, func.getName(), llvm::StringRef(), file, line, func_ty, line,
+        llvm::DINode::FlagPrototyped, llvm::DISubprogram::SPFlagDefinition | llvm::DISubprogram::SPFlagOptimized);
+    func.setSubprogram(sp);
+
+    auto loc = llvm::DILocation::get(*env.context, line, 0, sp);
+    unsigned arg_no = 0;
+    for (auto& arg : func.args()) {
+        ++arg_no;
+        auto var = dbuilder.createParameterVariable(sp, arg.getName(), arg_no, file, line,
+            llvm::cast<llvm::DIType>(types[arg_no]), true);
+        dbuilder.insertDbgValueIntrinsic(&arg, var, dbuilder.createExpression(), loc, env.builder->GetInsertBlock());
+    }
+    env.builder->SetCurrentDebugLocation(loc);
+}
+
+// nextから先で，valueがそのまま関数の戻り値になるか
+// ifの合流点のphiを経由してretに至る場合も含む
+bool flowsToReturn(llvm::Value* value, llvm::Instruction* next)
+{
+    if (auto ret = llvm::dyn_cast<llvm::ReturnInst>(next))
+        return ret->getReturnValue() == value;
+
+    auto br = llvm::dyn_cast<llvm::BranchInst>(next);
+    if (!br || br->isConditional())
+        return false;
+
+    auto from = br->getParent();
+    auto succ = br->getSuccessor(0);
+    for (auto& phi : succ->phis())
+        if (phi.getIncomingValueForBlock(from) == value && flowsToReturn(&phi, succ->getFirstNonPHI()))
+            return true;
+    return false;
+}
+
+// 末尾位置の呼び出しにtailを付ける．自己再帰はTailCallElimでループになる
+void markTailCalls(llvm::Function& func)
+{
+    for (auto& bb : func)
+        for (auto& inst : bb)
+            if (auto call = llvm::dyn_cast<llvm::CallInst>(&inst))
+                if (flowsToReturn(call, call->getNextNode()))
+                    call->setTailCall();
+}
+}  // namespace
+
 llvm::Value* NumberExpAST::codegen(CodeGenEnv& env)
 {
-    return llvm::ConstantFP::get(env.context, llvm::APFloat(val));
+    return llvm::ConstantFP::get(*env.context, llvm::APFloat(val));
 }
 
 llvm::Value* VariableExprAST::codegen(CodeGenEnv& env)
@@ -36,70 +601,487 @@ llvm::Value* VariableExprAST::codegen(CodeGenEnv& env)
     auto v = env.named_value[name];
     if (!v)
         return logErrorV("unknown variable name: ", name);
+    if (v->getType()->isPointerTy())
+        return logErrorV("buffer cannot be used as a number: ", name);
     return v;
 }
 
 llvm::Value* BinaryExprAST::codegen(CodeGenEnv& env)
 {
+    if (auto cached = env.cse_values.find(this); cached != env.cse_values.end())
+        return cached->second;
+
     auto l = lhs->codegen(env);
     auto r = rhs->codegen(env);
     if (!l || !r)
         return nullptr;
 
+    auto type = commonType(*lhs, l, *rhs, r);
+    auto l_v = l, r_v = r;
+    l = convert(env, l, type);
+    r = convert(env, r, type);
+
+    // 整数は2の補数で回り込む
+    bool fp = !type->isIntegerTy();
+    llvm::Value* ret = nullptr;
     if (op == "+") {
-        return env.builder.CreateFAdd(l, r, "addtmp");  // addtmpは単なる名付けのヒント
+        ret = fp ? env.builder->CreateFAdd(l, r, "addtmp") : env.builder->CreateAdd(l, r, "addtmp");  // addtmpは単なる名付けのヒント
     } else if (op == "-") {
-        return env.builder.CreateFSub(l, r, "subtmp");
+        ret = fp ? env.builder->CreateFSub(l, r, "subtmp") : env.builder->CreateSub(l, r, "subtmp");
     } else if (op == "*") {
-        return env.builder.CreateFMul(l, r, "multmp");
-    } else if (op == "<") {
-        auto ret = env.builder.CreateFCmpULT(l, r, "ulttmp");  // unordered less than. unordered: quiet_nanが入りうる
-        // bool -> double
-        return env.builder.CreateUIToFP(ret, llvm::Type::getDoubleTy(env.context), "booltmp");
-    } else if (op == ">") {
-        auto ret = env.builder.CreateFCmpUGT(l, r, "ugttmp");
-        // bool -> double
-        return env.builder.CreateUIToFP(ret, llvm::Type::getDoubleTy(env.context), "booltmp");
+        ret = fp ? env.builder->CreateFMul(l, r, "multmp") : env.builder->CreateMul(l, r, "multmp");
+    } else if (op == "<" || op == ">") {
+        // unordered: quiet_nanが入りうる．NaNとの比較は真
+        auto cmp = op == "<" ? (fp ? env.builder->CreateFCmpULT(l, r, "ulttmp") : env.builder->CreateICmpSLT(l, r, "slttmp"))
+                             : (fp ? env.builder->CreateFCmpUGT(l, r, "ugttmp") : env.builder->CreateICmpSGT(l, r, "sgttmp"));
+        // bool -> 比べた値と同じ型の0か1
+        ret = fp ? env.builder->CreateUIToFP(cmp, type, "booltmp") : env.builder->CreateZExt(cmp, type, "booltmp");
     } else {
         return logErrorV("unknown binary operator: ", op);
     }
+
+    env.derive(ret, {l_v, r_v});
+    env.cse_values.emplace(this, ret);
+    return ret;
 }
 
 llvm::Value* CallExprAST::codegen(CodeGenEnv& env)
 {
-    //    auto func = env.module->getFunction(callee);
-    auto func = env.getFunction(callee);  // module内に，proto type宣言しかなくてもよい
+    if (auto cached = env.cse_values.find(this); cached != env.cse_values.end())
+        return cached->second;
 
-    if (!func)
+    // len(xs)はバッファxsの要素数(i64)
+    if (callee == "len" && args.size() == 1)
+        if (auto var = dynamic_cast<const VariableExprAST*>(args[0].get()); var && bufferNamed(env, var->getName()))
+            return env.named_value.at(var->getName() + ".len");
+
+    auto fi = env.proto_func.find(callee);
+    auto proto = fi != env.proto_func.end() ? fi->second.get() : nullptr;
+    auto func = proto ? nullptr : env.getFunction(callee);  // module内に，proto type宣言しかなくてもよい
+    if (!proto && !func)
         return logErrorV("unknown function referenced: ", callee);
 
-    if (func->arg_size() != args.size())
+    if ((proto ? proto->arity() : func->arg_size()) != args.size())
         return logErrorV("argument mismatch: ", callee);
 
+    // バッファ以外の引数を先に計算する．libmの関数は引数の型のintrinsicにする
+    std::vector<llvm::Value*> values(args.size(), nullptr);
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (proto && proto->isBuffer(i))
+            continue;
+        values[i] = args[i]->codegen(env);
+        if (!values[i])
+            return nullptr;
+    }
+    if (proto) {
+        func = env.getIntrinsic(callee, floatType(env, args, values));
+        if (!func)
+            func = env.getFunction(callee);
+        if (!func)
+            return logErrorV("unknown function referenced: ", callee);
+    }
+
+    // バッファの引数には，要素の型が同じバッファの変数をそのまま渡す．他は引数の型に変換する
+    // バッファの引数はnoaliasなので，同じバッファを2つの引数に渡すことはできない
     std::vector<llvm::Value*> arg_values;
-    for (auto& arg : args) {
-        arg_values.push_back(arg->codegen(env));
+    std::unordered_set<std::string> passed;
+    bool passes_buffers = false;
+    for (size_t i = 0; i < args.size(); ++i) {
+        auto param_ty = func->getFunctionType()->getParamType(arg_values.size());
+        if (proto && proto->isBuffer(i)) {
+            auto var = dynamic_cast<const VariableExprAST*>(args[i].get());
+            auto buffer = var ? bufferNamed(env, var->getName()) : nullptr;
+            if (!buffer)
+                return logErrorV("expected a buffer argument: ", callee);
+            if (buffer->getType() != param_ty)
+                return logErrorV("buffer element type mismatch: ", callee);
+            if (!passed.insert(var->getName()).second)
+                return logErrorV("the same buffer is passed twice: ", var->getName(), " to ", callee);
+            arg_values.push_back(buffer);
+            arg_values.push_back(env.named_value.at(var->getName() + ".len"));
+            passes_buffers = true;
+            continue;
+        }
+        arg_values.push_back(convert(env, values[i], param_ty));
+    }
+
+    auto ret = env.builder->CreateCall(func, arg_values, "calltmp");
+
+    // 副作用のない関数の呼び出しだけ使い回せる
+    // バッファを渡した呼び出しは，呼び出し先が書いたかもしれないし，値はバッファから読んだものになる
+    if (passes_buffers) {
+        env.clobberMemory();
+        env.loaded.insert(ret);
+    } else {
+        for (auto v : values)
+            env.derive(ret, {v});
+        if (func->isIntrinsic() || env.isPure(callee))
+            env.cse_values.emplace(this, ret);
+    }
+    return ret;
+}
+
+llvm::Value* IfExprAST::codegen(CodeGenEnv& env)
+{
+    // 自動微分で作る式は同じifを何度も参照するので，ifもCSEする
+    if (auto cached = env.cse_values.find(this); cached != env.cse_values.end())
+        return cached->second;
+    auto stores_before = env.stores;
+
+    auto c = cond->codegen(env);
+    if (!c)
+        return nullptr;
+    auto cond_v = c;
+
+    // -> bool
+    if (c->getType()->isIntegerTy())
+        c = env.builder->CreateICmpNE(c, llvm::ConstantInt::get(c->getType(), 0), "ifcond");
+    else
+        c = env.builder->CreateFCmpONE(c, llvm::ConstantFP::get(c->getType(), 0.0), "ifcond");
+
+    auto func = env.builder->GetInsertBlock()->getParent();
+    auto then_bb = llvm::BasicBlock::Create(*env.context, "then", func);
+    auto else_bb = llvm::BasicBlock::Create(*env.context, "else");
+    auto merge_bb = llvm::BasicBlock::Create(*env.context, "ifcont");
+    env.builder->CreateCondBr(c, then_bb, else_bb);
+
+    // 片方の枝で計算した値はもう片方や合流後では使えないので，CSEの表を枝ごとに戻す
+    // どちらかの枝がバッファに書いていれば，合流後は分岐前に読んだ値も使えない
+    auto cse_values = env.cse_values;
+    auto stores = env.stores;
+
+    env.builder->SetInsertPoint(then_bb);
+    auto then_v = then->codegen(env);
+    env.cse_values = cse_values;
+    if (!then_v)
+        return nullptr;
+    then_bb = env.builder->GetInsertBlock();  // thenの中にifがあるとブロックが変わっている
+
+    func->getBasicBlockList().push_back(else_bb);
+    env.builder->SetInsertPoint(else_bb);
+    auto else_v = els->codegen(env);
+    env.cse_values = std::move(cse_values);
+    if (env.stores != stores)
+        env.forgetLoads();
+    if (!else_v)
+        return nullptr;
+    else_bb = env.builder->GetInsertBlock();
+
+    // 両方の枝の型が分かってから，それぞれの枝の最後で揃えて合流する
+    auto type = commonType(*then, then_v, *els, else_v);
+    auto branch_values = {cond_v, then_v, else_v};
+    env.builder->SetInsertPoint(then_bb);
+    then_v = convert(env, then_v, type);
+    env.builder->CreateBr(merge_bb);
+    env.builder->SetInsertPoint(else_bb);
+    else_v = convert(env, else_v, type);
+    env.builder->CreateBr(merge_bb);
+
+    func->getBasicBlockList().push_back(merge_bb);
+    env.builder->SetInsertPoint(merge_bb);
+    auto phi = env.builder->CreatePHI(type, 2, "iftmp");
+    phi->addIncoming(then_v, then_bb);
+    phi->addIncoming(else_v, else_bb);
+    env.derive(phi, branch_values);
+    if (env.stores == stores_before)  // 枝でバッファに書いていれば，もう一度評価する
+        env.cse_values.emplace(this, phi);
+    return phi;
+}
+
+llvm::Value* IndexExprAST::codegen(CodeGenEnv& env)
+{
+    auto ptr = elementPointer(env, name, *index);
+    if (!ptr)
+        return nullptr;
+    auto element_ty = ptr->getType()->getPointerElementType();
+    auto load = env.builder->CreateAlignedLoad(element_ty, ptr, llvm::MaybeAlign(element_ty->getPrimitiveSizeInBits() / 8), name);
+    env.loaded.insert(load);
+    return load;
+}
+
+llvm::Value* StoreExprAST::codegen(CodeGenEnv& env)
+{
+    auto ptr = elementPointer(env, name, *index);
+    if (!ptr)
+        return nullptr;
+    auto v = value->codegen(env);
+    if (!v)
+        return nullptr;
+
+    auto element_ty = ptr->getType()->getPointerElementType();
+    auto stored = convert(env, v, element_ty);
+    env.derive(stored, {v});
+    v = stored;
+    env.builder->CreateAlignedStore(v, ptr, llvm::MaybeAlign(element_ty->getPrimitiveSizeInBits() / 8));
+    env.clobberMemory();
+    return v;
+}
+
+llvm::Value* ForExprAST::codegen(CodeGenEnv& env)
+{
+    auto start_v = start->codegen(env);
+    auto end_v = start_v ? end->codegen(env) : nullptr;
+    auto step_v = end_v ? step->codegen(env) : nullptr;
+    if (!step_v)
+        return nullptr;
+
+    // 変数は整数で数える．整数の誘導変数なら，LoopVectorizeが回数を求めてベクトル化できる
+    auto i64 = llvm::Type::getInt64Ty(*env.context);
+    auto first = toIndex(env, start_v);
+    auto last = toIndex(env, end_v);
+    auto inc = toIndex(env, step_v);
+
+    // 後判定のループにして，入る前に一度だけ判定する(LoopRotateした形)
+    // i + incはlastの近くで溢れるので，i < last - incで続けるかを決める．last - incは飽和させて溢れないようにする
+    auto func = env.builder->GetInsertBlock()->getParent();
+    auto preheader_bb = env.builder->GetInsertBlock();
+    auto loop_bb = llvm::BasicBlock::Create(*env.context, "loop", func);
+    auto after_bb = llvm::BasicBlock::Create(*env.context, "afterloop");
+    auto enter = env.builder->CreateAnd(env.builder->CreateICmpSLT(first, last),
+        env.builder->CreateICmpSGT(inc, llvm::ConstantInt::get(i64, 0)), "enter");
+    auto limit = env.builder->CreateCall(
+        llvm::Intrinsic::getDeclaration(env.module.get(), llvm::Intrinsic::ssub_sat, {i64}), {last, inc}, "limit");
+    env.builder->CreateCondBr(enter, loop_bb, after_bb);
+
+    env.builder->SetInsertPoint(loop_bb);
+    auto i = env.builder->CreatePHI(i64, 2, var);
+    i->addIncoming(first, preheader_bb);
+
+    // 本体では同じ名前の外の変数を隠す
+    // 外で計算した式の値は，隠された変数を使っているかもしれないので本体では使い回さない
+    auto shadowed = env.named_value.find(var);
+    auto saved = shadowed != env.named_value.end() ? shadowed->second : nullptr;
+    env.named_value[var] = i;
+    auto cse_values = std::move(env.cse_values);
+    auto stores = env.stores;
+    env.cse_values.clear();
+
+    auto body_v = body->codegen(env);
+
+    if (saved)
+        env.named_value[var] = saved;
+    else
+        env.named_value.erase(var);
+    env.cse_values = std::move(cse_values);
+    if (env.stores != stores)
+        env.forgetLoads();
+    if (!body_v)
+        return nullptr;
+
+    auto next = env.builder->CreateAdd(i, inc, "next");
+    auto loop_end_bb = env.builder->GetInsertBlock();  // 本体にifがあるとブロックが変わっている
+    env.builder->CreateCondBr(env.builder->CreateICmpSLT(i, limit, "loopcond"), loop_bb, after_bb);
+    i->addIncoming(next, loop_end_bb);
+
+    func->getBasicBlockList().push_back(after_bb);
+    env.builder->SetInsertPoint(after_bb);
+    return llvm::ConstantFP::get(*env.context, llvm::APFloat(0.0));
+}
+
+llvm::Value* SeqExprAST::codegen(CodeGenEnv& env)
+{
+    llvm::Value* v = nullptr;
+    for (auto& e : exprs)
+        if (!(v = e->codegen(env)))
+            return nullptr;
+    return v;
+}
+
+llvm::Value* ParallelExprAST::codegen(CodeGenEnv& env)
+{
+    auto start_v = start->codegen(env);
+    auto end_v = start_v ? end->codegen(env) : nullptr;
+    if (!end_v)
+        return nullptr;
+
+    auto& context = *env.context;
+    auto i8_ptr = llvm::Type::getInt8PtrTy(context);
+    auto i64 = llvm::Type::getInt64Ty(context);
+    auto first = toIndex(env, start_v);
+    auto last = toIndex(env, end_v);
+
+    // 外の変数(バッファとその要素数を含む)は今の値をctxの構造体に入れて渡す．先頭は途中結果の配列
+    std::vector<std::pair<std::string, llvm::Value*>> captures;
+    for (auto& [name, v] : env.named_value)
+        if (v)
+            captures.emplace_back(name, v);
+    std::sort(captures.begin(), captures.end(), [](auto& a, auto& b) { return a.first < b.first; });
+    std::vector<llvm::Type*> fields{i8_ptr};
+    for (auto& [_, v] : captures)
+        fields.push_back(v->getType());
+    auto ctx_ty = llvm::StructType::get(context, fields);
+
+    // 本体を void(ctx, begin, end, chunk) の関数に切り出し，[begin, end)を回す
+    // ランタイムは空のチャンクを作らないので，入る前の判定はいらない
+    auto parent = env.builder->GetInsertBlock()->getParent();
+    auto body_ty = llvm::FunctionType::get(llvm::Type::getVoidTy(context), {i8_ptr, i64, i64, i64}, false);
+    auto outlined = llvm::Function::Create(
+        body_ty, llvm::Function::InternalLinkage, parent->getName() + ".par", env.module.get());
+    env.outlined.push_back(outlined);  // 失敗してもFunctionAST::codegenが消す
+    auto arg = outlined->arg_begin();
+    auto ctx_arg = &*arg++;
+    auto begin_arg = &*arg++;
+    auto end_arg = &*arg++;
+    auto chunk_arg = &*arg;
+    ctx_arg->setName("ctx");
+    begin_arg->setName("begin");
+    end_arg->setName("end");
+    chunk_arg->setName("chunk");
+
+    // 切り出した関数には行情報を付けない
+    auto ip = env.builder->saveIP();
+    auto loc = env.builder->getCurrentDebugLocation();
+    auto named_value = std::move(env.named_value);
+    auto cse_values = std::move(env.cse_values);
+    env.builder->SetCurrentDebugLocation(llvm::DebugLoc());
+    env.named_value.clear();
+    env.cse_values.clear();
+    auto restore = [&] {
+        env.named_value = std::move(named_value);
+        env.cse_values = std::move(cse_values);
+        env.builder->restoreIP(ip);
+        env.builder->SetCurrentDebugLocation(loc);
+    };
+
+    auto entry_bb = llvm::BasicBlock::Create(context, "entry", outlined);
+    auto loop_bb = llvm::BasicBlock::Create(context, "loop", outlined);
+    auto after_bb = llvm::BasicBlock::Create(context, "afterloop");
+    env.builder->SetInsertPoint(entry_bb);
+    auto ctx = env.builder->CreateBitCast(ctx_arg, ctx_ty->getPointerTo(), "ctx");
+    auto partials_raw = env.builder->CreateLoad(i8_ptr, env.builder->CreateStructGEP(ctx_ty, ctx, 0), "partials");
+    for (unsigned k = 0; k < captures.size(); ++k) {
+        auto& name = captures[k].first;
+        env.named_value[name] = env.builder->CreateLoad(fields[k + 1], env.builder->CreateStructGEP(ctx_ty, ctx, k + 1), name);
+    }
+    env.builder->CreateBr(loop_bb);
+
+    env.builder->SetInsertPoint(loop_bb);
+    auto i = env.builder->CreatePHI(i64, 2, var);
+    i->addIncoming(begin_arg, entry_bb);
+    env.named_value[var] = i;
+
+    auto body_v = body->codegen(env);
+    if (!body_v) {
+        restore();
+        return nullptr;
+    }
+
+    // reduceの途中結果は本体の型で持つ．型が分かってからループの先頭にphiを置く
+    auto loop_end_bb = env.builder->GetInsertBlock();
+    llvm::Value* acc_next = nullptr;
+    auto type = body_v->getType();
+    if (!op.empty()) {
+        auto acc = llvm::PHINode::Create(type, 2, "acc", &loop_bb->front());
+        acc->addIncoming(reduceIdentity(op, type), entry_bb);
+        acc_next = reduceStep(env, op, acc, body_v);
+        acc->addIncoming(acc_next, loop_end_bb);
+    }
+    auto next = env.builder->CreateNSWAdd(i, llvm::ConstantInt::get(i64, 1), "next");
+    env.builder->CreateCondBr(env.builder->CreateICmpSLT(next, end_arg, "loopcond"), loop_bb, after_bb);
+    i->addIncoming(next, loop_end_bb);
+
+    outlined->getBasicBlockList().push_back(after_bb);
+    env.builder->SetInsertPoint(after_bb);
+    if (acc_next) {
+        auto partials = env.builder->CreateBitCast(partials_raw, type->getPointerTo());
+        env.builder->CreateStore(acc_next, env.builder->CreateInBoundsGEP(type, partials, chunk_arg));
     }
+    env.builder->CreateRetVoid();
+    restore();
+
+    // 呼び出し元: ctxと途中結果の配列はentryに置く
+    llvm::IRBuilder<> entry{&parent->getEntryBlock(), parent->getEntryBlock().begin()};
+    auto ctx_v = entry.CreateAlloca(ctx_ty, nullptr, "par.ctx");
+    llvm::Value* partials = llvm::ConstantPointerNull::get(i8_ptr);
+    auto partials_ty = llvm::ArrayType::get(type, max_parallel_chunks);
+    if (!op.empty())
+        partials = entry.CreateAlloca(partials_ty, nullptr, "par.partials");
 
-    return env.builder.CreateCall(func, arg_values, "calltmp");
+    env.builder->CreateStore(env.builder->CreateBitCast(partials, i8_ptr), env.builder->CreateStructGEP(ctx_ty, ctx_v, 0));
+    for (unsigned k = 0; k < captures.size(); ++k)
+        env.builder->CreateStore(captures[k].second, env.builder->CreateStructGEP(ctx_ty, ctx_v, k + 1));
+
+    auto run = env.module->getOrInsertFunction("kaleidoscope_parallel_for",
+        llvm::FunctionType::get(i64, {i8_ptr, body_ty->getPointerTo(), i8_ptr, i64, i64}, false));
+    auto pool = env.parallel ? hostPointer(env, &env.engine->pool()) : llvm::ConstantPointerNull::get(i8_ptr);
+    auto chunks = env.builder->CreateCall(
+        run, {pool, outlined, env.builder->CreateBitCast(ctx_v, i8_ptr), first, last}, "chunks");
+    env.clobberMemory();  // 本体がバッファに書いたかもしれない
+
+    if (op.empty())
+        return llvm::ConstantFP::get(context, llvm::APFloat(0.0));
+
+    // チャンクごとの途中結果を順にまとめる
+    auto identity = reduceIdentity(op, type);
+    auto func = env.builder->GetInsertBlock()->getParent();
+    auto preheader_bb = env.builder->GetInsertBlock();
+    auto combine_bb = llvm::BasicBlock::Create(context, "combine", func);
+    auto combined_bb = llvm::BasicBlock::Create(context, "combined");
+    env.builder->CreateCondBr(
+        env.builder->CreateICmpSGT(chunks, llvm::ConstantInt::get(i64, 0)), combine_bb, combined_bb);
+
+    env.builder->SetInsertPoint(combine_bb);
+    auto k = env.builder->CreatePHI(i64, 2, "chunk");
+    auto acc = env.builder->CreatePHI(type, 2, "acc");
+    k->addIncoming(llvm::ConstantInt::get(i64, 0), preheader_bb);
+    acc->addIncoming(identity, preheader_bb);
+    auto partial = env.builder->CreateLoad(
+        type, env.builder->CreateInBoundsGEP(partials_ty, partials, {llvm::ConstantInt::get(i64, 0), k}), "partial");
+    auto acc_combined = reduceStep(env, op, acc, partial);
+    auto k_next = env.builder->CreateNUWAdd(k, llvm::ConstantInt::get(i64, 1), "chunk.next");
+    k->addIncoming(k_next, combine_bb);
+    acc->addIncoming(acc_combined, combine_bb);
+    env.builder->CreateCondBr(env.builder->CreateICmpSLT(k_next, chunks), combine_bb, combined_bb);
+
+    func->getBasicBlockList().push_back(combined_bb);
+    env.builder->SetInsertPoint(combined_bb);
+    auto result = env.builder->CreatePHI(type, 2, "reduced");
+    result->addIncoming(identity, preheader_bb);
+    result->addIncoming(acc_combined, combine_bb);
+    env.loaded.insert(result);
+    return result;
 }
 
 llvm::Function* PrototypeAST::codegen(CodeGenEnv& env)
 {
-    // 型は全てdouble
-    std::vector<llvm::Type*> doubles(args.size(), llvm::Type::getDoubleTy(env.context));
+    return codegen(env, is_extern ? name : env.symbolFor(name));
+}
 
-    // create function type
-    auto func_type = llvm::FunctionType::get(llvm::Type::getDoubleTy(env.context), doubles, false);
+llvm::Function* PrototypeAST::codegen(CodeGenEnv& env, const std::string& symbol)
+{
+    // 型はバッファ以外全てdouble
+    auto func_type = signatureType(*env.context, *this);
 
     // create the IR function corresponding to the prototype
-    auto func = llvm::Function::Create(func_type, llvm::Function::ExternalLinkage, name, env.module.get());
+    auto func = llvm::Function::Create(func_type, llvm::Function::ExternalLinkage, symbol, env.module.get());
 
     // This phase isn't strictly necessary
     // keep the name consistent to make IR readable
-    size_t id = 0;
-    for (auto& farg : func->args()) {
-        farg.setName(args.at(id++));
+    auto farg = func->arg_begin();
+    for (size_t i = 0; i < args.size(); ++i) {
+        farg->setName(args[i]);
+        if (buffers[i]) {
+            // バッファは他の引数と重ならず，呼び出しの後まで持ち続けられることもない
+            // 重なりを実行時に確かめずにベクトル化できる
+            func->addParamAttr(farg->getArgNo(), llvm::Attribute::NoAlias);
+            func->addParamAttr(farg->getArgNo(), llvm::Attribute::NoCapture);
+            (++farg)->setName(args[i] + ".len");
+        }
+        ++farg;
+    }
+
+    // 登録済みのホスト関数なら，その属性を宣言に付ける
+    if (auto host = env.JIT->findHostSymbol(name))
+        for (auto attr : host->Attrs)
+            func->addFnAttr(attr);
+
+    // 純粋なdefの呼び出しはCSEや移動ができる
+    // メモ化した関数とそれを呼ぶ関数はキャッシュを書き換えるので，readnoneではなくinaccessiblememonlyにする
+    // キャッシュはホストのメモリにあり，moduleからは見えない
+    // 差し替えられる関数は，後で副作用のある定義に変わるかもしれない
+    if (pure && !env.hot_swap) {
+        func->addFnAttr(llvm::Attribute::NoUnwind);
+        func->addFnAttr(caching ? llvm::Attribute::InaccessibleMemOnly : llvm::Attribute::ReadNone);
     }
 
     return func;
@@ -107,12 +1089,37 @@ llvm::Function* PrototypeAST::codegen(CodeGenEnv& env)
 
 llvm::Function* FunctionAST::codegen(CodeGenEnv& env)
 {
-    std::unique_ptr<PrototypeAST> p = nullptr;
-    proto.swap(p);
-    auto name = p->getName();
-    auto& proto = env.proto_func.insert_or_assign(name, std::move(p)).first->second;
+    auto name = proto->getName();
+
+    if (env.JIT->findHostSymbol(name))
+        return logErrorF("cannot redefine host function: ", name);
+
+    // 差し替えはスタブ経由なので，引数の数とバッファの位置，型は変えられない
+    auto stub = env.stubs.find(name);
+    if (stub != env.stubs.end() && !stub->second->proto->sameSignature(*proto))
+        return logErrorF("function cannot be redefined with different parameters: ", name);
+
+    // 定義を後からもう一度codegenできるように，プロトタイプは複製して登録する
+    auto& proto = env.proto_func.insert_or_assign(name, std::make_unique<PrototypeAST>(*this->proto)).first->second;
 
-    auto func = env.getFunction(name);
+    if (auto simplified = body->simplify())
+        body = std::move(simplified);
+
+    // 宣言を作る前に，属性を決めるための解析をしておく
+    proto->setPure(isPure(env, name));
+    if (proto->isMemo() && !proto->isPure())
+        std::cerr << "warning: " << name << " is not pure and cannot be memoized" << std::endl;
+    else if (proto->isMemo() && !proto->isDoubles())
+        std::cerr << "warning: " << name << " has non-double parameters and cannot be memoized" << std::endl;
+    proto->setMemo(isMemoizable(env, name));
+    proto->setCaching(proto->isPure() && isCaching(env, name));
+
+    // 差し替えられるdefの本体は版ごとに別名で作り，nameはスタブが持つ
+    llvm::Function* func = nullptr;
+    if (env.hot_swap && name != "__anon_expr")
+        func = proto->codegen(env, env.symbolFor(name) + "." + std::to_string(++env.versions[name]));
+    else
+        func = env.getFunction(name);
 
     if (!func)
         func = proto->codegen(env);
@@ -125,22 +1132,110 @@ llvm::Function* FunctionAST::codegen(CodeGenEnv& env)
 
     // 1入力1出力で、内部に分岐を含まないコードブロック
     // フローチャートにおいて、1つのノードで表される
-    auto bb = llvm::BasicBlock::Create(env.context, "entry", func);
-    env.builder.SetInsertPoint(bb);
+    auto bb = llvm::BasicBlock::Create(*env.context, "entry", func);
+    env.builder->SetInsertPoint(bb);
 
     // 変数のマッピングを更新
     env.named_value.clear();
+    env.cse_values.clear();
+    env.loaded.clear();
+    env.inlined.clear();
+    env.outlined.clear();
     for (auto& arg : func->args())
         env.named_value[arg.getName()] = &arg;
 
+    if (env.dbuilder)
+        emitSubprogram(env, *func, *proto);
+
+    // メモ化する場合は，本体の前でキャッシュを引き，本体の後で結果を保存する
+    // 古いコードから呼ばれ続けることがあるので，キャッシュは再定義されても解放しない
+    MemoTable* memo_table = nullptr;
+    llvm::Value* memo_args = nullptr;
+    if (proto->isMemo()) {
+        memo_table = env.memo_tables.emplace_back(std::make_unique<MemoTable>()).get();
+        memo_args = emitMemoLookup(env, *func, memo_table);
+    }
+
     if (auto retval = body->codegen(env)) {
-        env.builder.CreateRet(retval);  // finish off the function
+        retval = convert(env, retval, func->getReturnType());
+        if (memo_table)
+            emitMemoStore(env, memo_table, memo_args, func->arg_size(), retval);
+        env.builder->CreateRet(retval);  // finish off the function
+        env.builder->SetCurrentDebugLocation(llvm::DebugLoc());
+        markTailCalls(*func);
         llvm::verifyFunction(*func);
-        env.FPM->run(*func);
+        env.inlineCalls(*func);
+        // parforやreduceの本体は別の関数なので，それぞれ最適化する
+        std::vector<llvm::Function*> funcs{func};
+        funcs.insert(funcs.end(), env.outlined.begin(), env.outlined.end());
+        for (auto f : funcs) {
+            if (f != func)
+                llvm::verifyFunction(*f);
+            if (env.stats) {
+                env.stats->ir_before += f->getInstructionCount();
+                PhaseTimer timer{env.stats, Phase::optimize};
+                env.session->optimize(*f);
+                env.stats->ir_after += f->getInstructionCount();
+            } else {
+                env.session->optimize(*f);
+            }
+        }
         return func;
     } else {
+        env.builder->SetCurrentDebugLocation(llvm::DebugLoc());
+        // 切り出した関数は，外側から順に消せば使われていない
         func->eraseFromParent();
+        for (auto f : env.outlined)
+            f->eraseFromParent();
+        env.outlined.clear();
         return nullptr;
     }
 }
+
+bool FunctionAST::isPure(CodeGenEnv& env, const std::string& name) const
+{
+    // バッファを読むと，結果が引数の値だけでは決まらない
+    if (proto->hasBuffers())
+        return false;
+
+    std::unordered_set<std::string> callees;
+    body->collectCallees(callees);
+
+    // 呼び出し先が自分自身か純粋な関数だけなら純粋
+    // defは定義済みの関数しか呼べないので，呼び出しグラフを定義順に一度見ればよい
+    return std::all_of(callees.begin(), callees.end(), [&](const std::string& callee) {
+        return callee == name || env.isPure(callee);
+    });
+}
+
+bool FunctionAST::isCaching(CodeGenEnv& env, const std::string& name) const
+{
+    if (env.proto_func.at(name)->isMemo())
+        return true;
+
+    std::unordered_set<std::string> callees;
+    body->collectCallees(callees);
+    return std::any_of(callees.begin(), callees.end(), [&](const std::string& callee) {
+        auto fi = env.proto_func.find(callee);
+        return callee != name && fi != env.proto_func.end() && fi->second->isCaching();
+    });
+}
+
+bool FunctionAST::isMemoizable(CodeGenEnv& env, const std::string& name) const
+{
+    auto& p = env.proto_func.at(name);
+    if (!p->isPure() || !p->isDoubles())  // キャッシュはdoubleの引数と値を並べて持つ
+        return false;
+
+    if (p->isMemo())
+        return true;
+
+    if (!env.memoize || p->arity() != 1)
+        return false;
+
+    // 再帰しない関数はキャッシュしても得がない
+    std::unordered_set<std::string> callees;
+    body->collectCallees(callees);
+    return callees.count(name) > 0;
+}
 }  // namespace kaleidoscope
@@ -0,0 +1,65 @@
+#include <kaleidoscope/engine.hpp>
+#include <kaleidoscope/ast.hpp>
+
+#include <llvm/Support/TargetSelect.h>
+
+#include <cmath>
+#include <vector>
+
+namespace kaleidoscope
+{
+
+namespace
+{
+// 追い出されたdefのスタブから呼ばれ，コンパイルし直した版のアドレスを返す
+std::uint64_t materializeStub(CodeGenEnv::Stub* stub)
+{
+    stub->env->materializer(stub->name);
+    return stub->target.load(std::memory_order_acquire);
+}
+}  // namespace
+
+void Engine::registerHostSymbols()
+{
+    // 副作用のない関数にはreadnone/nounwindを付け，CSEやループ外への移動を許す
+    const std::vector<llvm::Attribute::AttrKind> pure = {
+        llvm::Attribute::ReadNone, llvm::Attribute::NoUnwind};
+
+    using unary = double (*)(double);
+    using binary = double (*)(double, double);
+    using ternary = double (*)(double, double, double);
+
+    JIT.addHostSymbol("sin", static_cast<unary>(::sin), pure);
+    JIT.addHostSymbol("cos", static_cast<unary>(::cos), pure);
+    JIT.addHostSymbol("tan", static_cast<unary>(::tan), pure);
+    JIT.addHostSymbol("atan", static_cast<unary>(::atan), pure);
+    JIT.addHostSymbol("atan2", static_cast<binary>(::atan2), pure);
+    JIT.addHostSymbol("sqrt", static_cast<unary>(::sqrt), pure);
+    JIT.addHostSymbol("exp", static_cast<unary>(::exp), pure);
+    JIT.addHostSymbol("log", static_cast<unary>(::log), pure);
+    JIT.addHostSymbol("pow", static_cast<binary>(::pow), pure);
+    JIT.addHostSymbol("fabs", static_cast<unary>(::fabs), pure);
+    JIT.addHostSymbol("floor", static_cast<unary>(::floor), pure);
+    JIT.addHostSymbol("ceil", static_cast<unary>(::ceil), pure);
+    JIT.addHostSymbol("fma", static_cast<ternary>(::fma), pure);
+
+    JIT.addHostSymbol("kaleidoscope_memo_find", &kaleidoscope_memo_find, {llvm::Attribute::NoUnwind});
+    JIT.addHostSymbol("kaleidoscope_memo_store", &kaleidoscope_memo_store, {llvm::Attribute::NoUnwind});
+    JIT.addHostSymbol("kaleidoscope_materialize", &materializeStub);
+    JIT.addHostSymbol("kaleidoscope_parallel_for", &kaleidoscope_parallel_for, {llvm::Attribute::NoUnwind});
+}
+
+NativeTarget::NativeTarget()
+{
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+}
+
+Engine::Engine(bool process_symbols, std::size_t threads)
+    : JIT{process_symbols}, session{JIT.getTargetMachine()}, threads{threads}
+{
+    registerHostSymbols();
+}
+
+}  // namespace kaleidoscope
@@ -1,59 +1,555 @@
 #include <kaleidoscope/interpreter.hpp>
+#include <kaleidoscope/library.hpp>
+#include <kaleidoscope/PerfMapListener.h>
+
+#include <llvm/Bitcode/BitcodeReader.h>
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <utility>
 
 namespace kaleidoscope
 {
+namespace
+{
+// submitやreloadで，構文解析した順に後からまとめて処理する項目
+struct Item
+{
+    enum class Kind
+    {
+        def,
+        external,
+        top_level,
+    } kind;
+    std::unique_ptr<FunctionAST> function;  // defと式
+    std::unique_ptr<PrototypeAST> proto;    // extern
+};
+}  // namespace
+
 void Interpreter::initialize()
 {
-    parser.setDefHandler([&](std::unique_ptr<FunctionAST> def) {
-        if (auto* code = def->codegen(env)) {
-            if (config.print_ir) {
-                llvm::outs() << "; parsed a function definition\n";
-                llvm::outs() << *code << '\n';
-            }
-            env.JIT->addModule(std::move(env.module));
-            env.initModAndPassManager("my cool jit");
-        } else {
-            std::cerr << "[function def] failed to cogen" << std::endl;
+    std::lock_guard lock{env.engine->mutex};
+    env.inline_threshold = config.inline_threshold;
+    env.memoize = config.memoize;
+    env.hot_swap = config.hot_swap;
+    env.context_recycle_units = config.context_recycle_units;
+    env.code_cache_limit = config.hot_swap ? config.code_cache_limit : 0;
+    // 追い出されたdefが呼ばれたときは，呼び出し元のコードが実行中なので，コンパイルし直す間は何も追い出さない
+    // ホストから直接スタブを呼んだ場合はrunningが0のままなので，ここで数える
+    env.materializer = [&](const std::string& name) {
+        std::unique_lock lock{env.engine->mutex};
+        ++running;
+        lock.unlock();
+        recompile(name);
+        lock.lock();
+        --running;
+    };
+    if (config.collect_stats)
+        env.stats = &stats;
+
+    if (!std::exchange(env.engine->listeners_attached, true))
+        attachListeners();
+    if (config.debug_info) {
+        env.debug_info = true;
+        env.source_file = config.source_file;
+        env.initModAndPassManager("my cool jit");  // 最初のmoduleにもコンパイル単位を作る
+    }
+
+    bindHandlers(parser);
+}
+
+void Interpreter::attachListeners()
+{
+    if (config.perf_map)
+        env.JIT->addEventListener(&llvm::orc::PerfMapListener::get());
+    if (config.jitdump) {
+        if (auto* listener = llvm::JITEventListener::createPerfJITEventListener())
+            env.JIT->addEventListener(listener);
+        else
+            std::cerr << "warning: jitdump is not supported by this LLVM build" << std::endl;
+    }
+    if (config.vtune) {
+        if (auto* listener = llvm::JITEventListener::createIntelJITEventListener())
+            env.JIT->addEventListener(listener);
+        else
+            std::cerr << "warning: VTune is not supported by this LLVM build" << std::endl;
+    }
+    if (config.gdb)
+        env.JIT->addEventListener(llvm::JITEventListener::createGDBRegistrationListener());
+}
+
+void Interpreter::bindHandlers(Parser& p)
+{
+    p.setHashConsing(config.hash_cons);
+    if (config.collect_stats)
+        p.setStats(&stats);
+
+    p.setDefHandler([&](std::unique_ptr<FunctionAST> def) { handleDef(std::move(def)); });
+    p.setExternHandler([&](std::unique_ptr<PrototypeAST> ext) { handleExtern(std::move(ext)); });
+    p.setTopLevelHandler([&](std::unique_ptr<FunctionAST> top) { handleTopLevel(std::move(top)); });
+}
+
+Interpreter::Compiled Interpreter::handleDef(std::unique_ptr<FunctionAST> def)
+{
+    Compiled compiled;
+    std::unique_ptr<FunctionAST> gradient;
+    std::vector<std::unique_ptr<PrototypeAST>> externs;
+    std::unique_lock lock{env.engine->mutex};
+    auto hash = def->hash();  // codegenで本体が簡単になる前の形で覚えておく
+    auto start = Stats::clock::now();
+
+    llvm::Function* code;
+    {
+        PhaseTimer timer{env.stats, Phase::codegen};
+        code = def->codegen(env);
+    }
+    if (code) {
+        if (config.print_ir) {
+            llvm::outs() << "; parsed a function definition\n";
+            llvm::outs() << *code << '\n';
         }
-    });
+        env.rememberForInlining(*code);
+        auto impl = code->getName().str();
+        llvm::orc::VModuleKey key;
+        {
+            PhaseTimer timer{env.stats, Phase::jit};
+            env.finalizeDebugInfo();
+            key = env.addModule(std::move(env.module));
+        }
+        env.initModAndPassManager("my cool jit");
 
-    parser.setExternHandler([&](std::unique_ptr<PrototypeAST> ext) {
-        if (auto* code = ext->codegen(env)) {
-            if (config.print_ir) {
-                llvm::outs() << "; parsed an external\n";
-                llvm::outs() << *code << '\n';
-            }
-            env.proto_func[ext->getName()] = std::move(ext);
-        } else {
-            std::cerr << "[external] failed to cogen" << std::endl;
+        auto& name = def->getProto().getName();
+        if (env.hot_swap) {
+            PhaseTimer timer{env.stats, Phase::lookup};
+            env.updateStub(name, impl, key);
+        }
+        if (env.stats) {
+            ++stats.defs;
+            stats.functions.emplace_back(name, Stats::clock::now() - start);
         }
-    });
 
-    parser.setTopLevelHandler([&](std::unique_ptr<FunctionAST> top) {
-        if (auto* code = top->codegen(env)) {
-            if (config.print_ir) {
-                llvm::outs() << "; parsed a top-level\n";
-                llvm::outs() << *code << '\n';
-            }
-            auto H = env.JIT->addModule(std::move(env.module));
-            env.initModAndPassManager("mod");
+        auto& info = defs[name];
+        info.hash = hash;
+        info.callees.clear();
+        def->collectCallees(info.callees);
+        info.inlined = env.inlined;
+        if (info.order == 0)
+            info.order = defs.size();
+        info.def = std::move(def);
+        info.gradient_of.clear();
 
-            auto ExprSymbol = env.JIT->findSymbol("__anon_expr");
-            assert(ExprSymbol && "__anon_expr is not found.");
+        // 自分で書いたd_<name>やexternは置き換えない
+        if (info.def->getProto().isGrad()) {
+            auto d_name = "d_" + name;
+            auto d = defs.find(d_name);
+            auto d_proto = env.proto_func.find(d_name);
+            if ((d != defs.end() && d->second.gradient_of != name) ||
+                (d_proto != env.proto_func.end() && d_proto->second->isExtern()))
+                std::cerr << "[function def] " << d_name << " is already defined; not differentiating " << name
+                          << std::endl;
+            else if (!(gradient = info.def->gradient(env, externs)))
+                std::cerr << "[function def] failed to differentiate " << name << std::endl;
+        }
 
-            double (*fp)() = reinterpret_cast<double (*)()>(static_cast<intptr_t>(*ExprSymbol.getAddress()));
+        if (running == 0)
+            env.evictCode();
+    } else {
+        std::cerr << "[function def] failed to cogen" << std::endl;
+    }
+    lock.unlock();
 
-            std::cout << "Evaluated to " << fp() << std::endl;
+    // @gradのdefには，微分したd_<name>も普通のdefとして定義する
+    // d_<name>はnameの本体を含むので，nameを呼んでインライン展開したものとして依存関係に入れる
+    if (gradient) {
+        auto name = gradient->getProto().getName().substr(2);
+        auto d_name = gradient->getProto().getName();
+        for (auto& ext : externs)
+            handleExtern(std::move(ext));
+        compiled.gradient = handleDef(std::move(gradient)).def;
+        lock.lock();
+        if (auto d = defs.find(d_name); d != defs.end()) {
+            d->second.callees.insert(name);
+            d->second.inlined.insert(name);
+            d->second.gradient_of = name;
+        }
+    }
+    compiled.def = code != nullptr;
+    return compiled;
+}
 
-            env.JIT->removeModule(H);
-        } else {
-            std::cerr << "[top level] failed to cogen" << std::endl;
+bool Interpreter::handleExtern(std::unique_ptr<PrototypeAST> ext)
+{
+    std::lock_guard lock{env.engine->mutex};
+    if (auto* code = ext->codegen(env)) {
+        if (config.print_ir) {
+            llvm::outs() << "; parsed an external\n";
+            llvm::outs() << *code << '\n';
         }
-    });
+        env.proto_func[ext->getName()] = std::move(ext);
+        return true;
+    }
+    std::cerr << "[external] failed to cogen" << std::endl;
+    return false;
+}
+
+bool Interpreter::handleTopLevel(std::unique_ptr<FunctionAST> top)
+{
+    std::unique_lock lock{env.engine->mutex};
+    llvm::Function* code;
+    {
+        PhaseTimer timer{env.stats, Phase::codegen};
+        code = top->codegen(env);
+    }
+    if (code) {
+        if (config.print_ir) {
+            llvm::outs() << "; parsed a top-level\n";
+            llvm::outs() << *code << '\n';
+        }
+        llvm::orc::VModuleKey H;
+        {
+            PhaseTimer timer{env.stats, Phase::jit};
+            env.finalizeDebugInfo();
+            H = env.addModule(std::move(env.module));
+        }
+        env.initModAndPassManager("mod");
+
+        double (*fp)();
+        {
+            PhaseTimer timer{env.stats, Phase::lookup};
+            auto ExprSymbol = env.JIT->findSymbol(env.symbolFor("__anon_expr"));
+            assert(ExprSymbol && "__anon_expr is not found.");
+
+            fp = reinterpret_cast<double (*)()>(static_cast<intptr_t>(*ExprSymbol.getAddress()));
+        }
+
+        // 実行中は他のセッションがコンパイルできるように放す
+        double result;
+        {
+            PhaseTimer timer{env.stats, Phase::execute};
+            ++running;
+            lock.unlock();
+            result = fp();
+            lock.lock();
+            --running;
+        }
+        if (env.stats)
+            ++stats.top_levels;
+        if (result_handler)
+            result_handler(result);
+        else
+            std::cout << "Evaluated to " << result << std::endl;
+
+        env.removeModule(H);
+        if (running == 0)
+            env.evictCode();
+        return true;
+    }
+    std::cerr << "[top level] failed to cogen" << std::endl;
+    return false;
 }
 
 bool Interpreter::run()
 {
     return parser.parse();
 }
-}  // namespace kaleidoscope
\ No newline at end of file
+
+bool Interpreter::load(const std::string& path)
+{
+    auto lib = readLibrary(path);
+    if (!lib)
+        return false;
+
+    std::lock_guard lock{env.engine->mutex};
+    std::unique_ptr<llvm::Module> module;
+    {
+        PhaseTimer timer{env.stats, Phase::jit};
+        auto parsed = llvm::parseBitcodeFile(lib->bitcode, *env.context);
+        if (!parsed) {
+            std::cerr << path << ": " << llvm::toString(parsed.takeError()) << std::endl;
+            return false;
+        }
+        module = std::move(*parsed);
+    }
+    if (module->getDataLayout() != env.JIT->getDataLayout()) {
+        std::cerr << path << ": built for a different target" << std::endl;
+        return false;
+    }
+
+    // ライブラリのdefもこのセッションの名前空間に入れる
+    for (auto& proto : lib->protos)
+        if (!proto->isExtern())
+            if (auto* func = module->getFunction(proto->getName()))
+                func->setName(env.symbolFor(proto->getName()));
+
+    {
+        PhaseTimer timer{env.stats, Phase::jit};
+        env.addModule(std::move(module));
+    }
+    for (auto& proto : lib->protos) {
+        if (env.stats && !proto->isExtern())
+            ++stats.defs;
+        auto name = proto->getName();
+        env.proto_func[name] = std::move(proto);
+    }
+    return true;
+}
+
+const Stats& Interpreter::getStats()
+{
+    std::lock_guard lock{env.engine->mutex};
+    // JITは他のセッションと共有しているので，このセッションのmoduleの分だけを数える
+    stats.code_bytes = 0;
+    for (auto key : env.module_keys)
+        stats.code_bytes += env.JIT->getEmittedCodeSize(key);
+    return stats;
+}
+
+bool Interpreter::recompile(const std::string& name)
+{
+    std::unique_lock lock{env.engine->mutex};
+    auto info = defs.find(name);
+    if (info == defs.end() || !info->second.def)  // 前回のcodegenに失敗している
+        return false;
+
+    auto hash = info->second.hash;  // 簡単にされた後の本体ではなく，元のソースのハッシュを残す
+    auto gradient_of = info->second.gradient_of;
+    auto def = std::move(info->second.def);
+    lock.unlock();
+    handleDef(std::move(def));
+    lock.lock();
+    defs.at(name).hash = hash;
+    defs.at(name).gradient_of = gradient_of;
+    return true;
+}
+
+std::vector<double> Interpreter::eval(const std::string& source, std::vector<std::string>* errors)
+{
+    std::vector<double> results;
+    auto saved = std::exchange(result_handler, [&](double value) { results.push_back(value); });
+
+    std::istringstream input{source};
+    Parser snippet{Tokenizer{input}};
+    bindHandlers(snippet);
+    if (errors) {
+        snippet.setErrorHandler([&](const std::string& reason) { errors->push_back(reason); });
+        snippet.setDefHandler([&](std::unique_ptr<FunctionAST> def) {
+            auto name = def->getProto().getName();
+            auto grad = def->getProto().isGrad();
+            auto compiled = handleDef(std::move(def));
+            if (!compiled.def)
+                errors->push_back("failed to compile " + name);
+            else if (grad && !compiled.gradient)
+                errors->push_back("failed to differentiate " + name);
+        });
+        snippet.setExternHandler([&](std::unique_ptr<PrototypeAST> ext) {
+            auto name = ext->getName();
+            if (!handleExtern(std::move(ext)))
+                errors->push_back("failed to declare " + name);
+        });
+        snippet.setTopLevelHandler([&](std::unique_ptr<FunctionAST> top) {
+            if (!handleTopLevel(std::move(top)))
+                errors->push_back("failed to compile a top-level expression");
+        });
+    }
+    while (snippet.parse())
+        ;
+
+    result_handler = std::move(saved);
+    return results;
+}
+
+std::optional<Interpreter::Entry> Interpreter::lookup(const std::string& name)
+{
+    std::lock_guard lock{env.engine->mutex};
+    auto proto = env.proto_func.find(name);
+    if (proto == env.proto_func.end() || name == "__anon_expr")
+        return std::nullopt;
+
+    auto sym = env.JIT->findSymbol(proto->second->isExtern() ? name : env.symbolFor(name));
+    if (!sym) {
+        llvm::consumeError(sym.takeError());
+        return std::nullopt;
+    }
+    auto addr = sym.getAddress();
+    if (!addr) {
+        llvm::consumeError(addr.takeError());
+        return std::nullopt;
+    }
+    return Entry{*addr, proto->second->arity(), proto->second->isDoubles()};
+}
+
+Interpreter::~Interpreter()
+{
+    if (submitted.valid())
+        submitted.wait();
+}
+
+std::vector<Interpreter::Pending> Interpreter::submit(const std::string& source)
+{
+    if (config.hot_swap) {
+        std::cerr << "warning: submit cannot be used with hot_swap" << std::endl;
+        return {};
+    }
+
+    struct Batch
+    {
+        std::vector<Item> items;
+        std::vector<std::promise<std::optional<Entry>>> entries;  // defの順．@gradならd_<name>の分が続く
+        std::promise<void> done;
+    };
+    auto batch = std::make_shared<Batch>();
+
+    // 構文解析は呼び出し元で済ませる．統計は取らない(コンパイル中のスレッドと同じ場所を書く)
+    std::istringstream input{source};
+    Parser snippet{Tokenizer{input}};
+    snippet.setHashConsing(config.hash_cons);
+    snippet.setDefHandler([&](std::unique_ptr<FunctionAST> def) {
+        batch->items.push_back({Item::Kind::def, std::move(def), nullptr});
+    });
+    snippet.setExternHandler([&](std::unique_ptr<PrototypeAST> ext) {
+        batch->items.push_back({Item::Kind::external, nullptr, std::move(ext)});
+    });
+    snippet.setTopLevelHandler([&](std::unique_ptr<FunctionAST>) {
+        std::cerr << "warning: top-level expressions are ignored by submit" << std::endl;
+    });
+    while (snippet.parse())
+        ;
+
+    std::vector<Pending> pending;
+    for (auto& item : batch->items) {
+        if (item.kind != Item::Kind::def)
+            continue;
+        auto& proto = item.function->getProto();
+        for (auto& name : proto.isGrad() ? std::vector{proto.getName(), "d_" + proto.getName()} : std::vector{proto.getName()})
+            pending.push_back({name, batch->entries.emplace_back().get_future().share()});
+    }
+
+    // 前のsubmitのコンパイルが終わるのを待ってから始める
+    // 前のバッチは先にプールに入っているので，待っている間に詰まることはない
+    auto previous = std::exchange(submitted, batch->done.get_future().share());
+    env.engine->pool().submit([this, batch, previous] {
+        if (previous.valid())
+            previous.wait();
+
+        std::size_t next = 0;
+        for (auto& item : batch->items) {
+            if (item.kind == Item::Kind::external) {
+                handleExtern(std::move(item.proto));
+                continue;
+            }
+            auto& def = item.function;
+            auto name = def->getProto().getName();
+            auto grad = def->getProto().isGrad();
+            auto compiled = handleDef(std::move(def));
+            batch->entries[next++].set_value(compiled.def ? lookup(name) : std::nullopt);
+            // d_<name>の微分やcodegenに失敗すれば，前に定義したd_<name>が残っていてもnullopt
+            if (grad)
+                batch->entries[next++].set_value(compiled.gradient ? lookup("d_" + name) : std::nullopt);
+        }
+        batch->done.set_value();
+    });
+    return pending;
+}
+
+std::unordered_set<std::string> Interpreter::dependents(const std::unordered_set<std::string>& changed) const
+{
+    // 呼び出し側がスタブを経由しないなら，古い定義にリンクされているので作り直す
+    // スタブを経由するなら，インライン展開した場合だけ作り直せばよい
+    auto depends = [&](const DefInfo& info, const std::string& callee) {
+        return env.hot_swap ? info.inlined.count(callee) > 0 : info.callees.count(callee) > 0;
+    };
+
+    std::unordered_set<std::string> dirty = changed;
+    std::vector<std::string> work(changed.begin(), changed.end());
+    while (!work.empty()) {
+        auto callee = std::move(work.back());
+        work.pop_back();
+        for (auto& [name, info] : defs)
+            if (name != callee && depends(info, callee) && dirty.insert(name).second)
+                work.push_back(name);
+    }
+    return dirty;
+}
+
+size_t Interpreter::reload(const std::string& filename)
+{
+    std::vector<Item> items;
+
+    Parser reparser{Tokenizer{filename}};
+    reparser.setHashConsing(config.hash_cons);
+    if (config.collect_stats)
+        reparser.setStats(&stats);
+    reparser.setDefHandler([&](std::unique_ptr<FunctionAST> def) { items.push_back({Item::Kind::def, std::move(def), nullptr}); });
+    reparser.setExternHandler(
+        [&](std::unique_ptr<PrototypeAST> ext) { items.push_back({Item::Kind::external, nullptr, std::move(ext)}); });
+    reparser.setTopLevelHandler(
+        [&](std::unique_ptr<FunctionAST> top) { items.push_back({Item::Kind::top_level, std::move(top), nullptr}); });
+    while (reparser.parse())
+        ;
+
+    std::unordered_set<std::string> dirty;
+    std::vector<std::pair<size_t, std::string>> rest;
+    std::vector<size_t> before(items.size(), std::numeric_limits<size_t>::max());
+    {
+        // defsはsubmitしたコンパイルがプールのスレッドで書き換える
+        std::lock_guard lock{env.engine->mutex};
+        // 内容が変わったdefと，それに依存するdefだけをコンパイルし直す
+        std::unordered_set<std::string> changed, in_file;
+        for (auto& item : items)
+            if (item.kind == Item::Kind::def) {
+                auto& def = item.function;
+                in_file.insert(def->getProto().getName());
+                auto prev = defs.find(def->getProto().getName());
+                if (prev == defs.end() || prev->second.hash != def->hash())
+                    changed.insert(def->getProto().getName());
+            }
+        dirty = dependents(changed);
+
+        // ファイルから消えたが，変わった定義に依存しているdefは前回のASTから作り直す
+        for (auto& name : dirty)
+            if (auto p = defs.find(name); p != defs.end() && !in_file.count(name))
+                rest.emplace_back(p->second.order, name);
+        std::sort(rest.begin(), rest.end());
+
+        // 前回からあるdefの最初に定義された順番で，ファイルの項目とrestを1つの列に並べて処理する
+        // 各項目には，そこから後で最初に出てくる前回からあるdefの順番を割り当て，それより前のrestを先に作り直す
+        for (size_t i = items.size(); i-- > 0;) {
+            if (i + 1 < items.size())
+                before[i] = before[i + 1];
+            if (items[i].kind == Item::Kind::def)
+                if (auto prev = defs.find(items[i].function->getProto().getName()); prev != defs.end())
+                    before[i] = prev->second.order;
+        }
+    }
+
+    size_t recompiled = 0;
+    auto next = rest.begin();
+    auto flush = [&](size_t order) {
+        for (; next != rest.end() && next->first < order; ++next)
+            if (recompile(next->second))
+                ++recompiled;
+    };
+    for (size_t i = 0; i < items.size(); ++i) {
+        flush(before[i]);
+        auto& item = items[i];
+        switch (item.kind) {
+        case Item::Kind::def:
+            if (dirty.erase(item.function->getProto().getName())) {
+                handleDef(std::move(item.function));
+                ++recompiled;
+            }
+            break;
+        case Item::Kind::external:
+            handleExtern(std::move(item.proto));
+            break;
+        case Item::Kind::top_level:
+            handleTopLevel(std::move(item.function));
+            break;
+        }
+    }
+    flush(std::numeric_limits<size_t>::max());
+
+    return recompiled;
+}
+}  // namespace kaleidoscope
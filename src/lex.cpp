@@ -11,7 +11,8 @@ Token Tokenizer::getToken()
 
     // consume space
     while (std::isspace(iss->peek())) {
-        iss->ignore();
+        if (iss->get() == '\n')
+            ++line;
     }
 
     // comment
@@ -19,7 +20,9 @@ Token Tokenizer::getToken()
         while (iss->peek() != EOF && iss->peek() != '\n' && iss->peek() != '\r')
             iss->ignore();
 
-        if (iss->get() != EOF) {  // consume \n or \r
+        if (auto c = iss->get(); c != EOF) {  // consume \n or \r
+            if (c == '\n')
+                ++line;
             return getToken();
         }
     }
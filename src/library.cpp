@@ -0,0 +1,257 @@
+#include <kaleidoscope/library.hpp>
+#include <kaleidoscope/parser.hpp>
+
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <cstring>
+#include <iostream>
+
+namespace kaleidoscope
+{
+
+namespace
+{
+constexpr char magic[4] = {'K', 'B', 'C', '\0'};
+constexpr std::uint32_t version = 3;
+constexpr std::size_t header_size = 32;
+constexpr std::uint32_t flag_extern = 1;
+constexpr std::uint32_t flag_pure = 2;
+constexpr std::uint32_t arg_buffer = 1;
+constexpr unsigned type_shift = 8;  // 型はフラグのbit8から
+
+std::uint32_t typeFlags(ValueType type)
+{
+    return static_cast<std::uint32_t>(type) << type_shift;
+}
+
+std::optional<ValueType> typeOf(std::uint32_t flags)
+{
+    auto type = (flags >> type_shift) & 0xff;
+    if (type > static_cast<std::uint32_t>(ValueType::i64))
+        return std::nullopt;
+    return static_cast<ValueType>(type);
+}
+
+void put32(std::string& out, std::uint32_t v)
+{
+    char buf[4];
+    llvm::support::endian::write32le(buf, v);
+    out.append(buf, 4);
+}
+
+void put64(std::string& out, std::uint64_t v)
+{
+    char buf[8];
+    llvm::support::endian::write64le(buf, v);
+    out.append(buf, 8);
+}
+
+void putString(std::string& out, const std::string& s)
+{
+    put32(out, s.size());
+    out += s;
+}
+
+// 範囲を確かめながら読む
+struct Reader
+{
+    const char* p;
+    const char* end;
+
+    bool read32(std::uint32_t& v)
+    {
+        if (end - p < 4)
+            return false;
+        v = llvm::support::endian::read32le(p);
+        p += 4;
+        return true;
+    }
+
+    bool readString(std::string& s)
+    {
+        std::uint32_t size;
+        if (!read32(size) || static_cast<std::size_t>(end - p) < size)
+            return false;
+        s.assign(p, size);
+        p += size;
+        return true;
+    }
+};
+
+std::nullopt_t broken(const std::string& path, const char* reason)
+{
+    std::cerr << path << ": " << reason << std::endl;
+    return std::nullopt;
+}
+}  // namespace
+
+bool precompileLibrary(const std::string& source, const std::string& output)
+{
+    // 全てのdefを1つのmoduleに入れる．ホスト側のポインタを埋め込むメモ化とスタブ，スレッドプールは使わない
+    CodeGenEnv env{"kbc"};
+    env.parallel = false;
+    std::vector<PrototypeAST*> protos;
+    bool ok = true;
+
+    Parser parser{Tokenizer{source}};
+    auto declare = [&](std::unique_ptr<PrototypeAST> ext) {
+        if (!env.module->getFunction(ext->getName()) && !ext->codegen(env)) {
+            ok = false;
+            return;
+        }
+        auto& proto = env.proto_func[ext->getName()] = std::move(ext);
+        protos.push_back(proto.get());
+    };
+    auto define = [&](FunctionAST& def) {
+        if (!def.codegen(env)) {
+            ok = false;
+            return false;
+        }
+        protos.push_back(env.proto_func.at(def.getProto().getName()).get());
+        return true;
+    };
+    parser.setExternHandler(declare);
+    parser.setDefHandler([&](std::unique_ptr<FunctionAST> def) {
+        if (def->getProto().isMemo()) {
+            std::cerr << "warning: @memo is ignored in a precompiled library: " << def->getProto().getName() << std::endl;
+            def->getProto().setMemo(false);
+        }
+        if (!define(*def) || !def->getProto().isGrad())
+            return;
+
+        // @gradのd_<name>もライブラリに入れる．自分で書いたd_<name>があれば置き換えない
+        if (auto d_name = "d_" + def->getProto().getName(); env.proto_func.count(d_name)) {
+            std::cerr << d_name << " is already defined; cannot differentiate " << def->getProto().getName() << std::endl;
+            ok = false;
+            return;
+        }
+        std::vector<std::unique_ptr<PrototypeAST>> externs;
+        auto gradient = def->gradient(env, externs);
+        if (!gradient) {
+            ok = false;
+            return;
+        }
+        for (auto& ext : externs)
+            declare(std::move(ext));
+        define(*gradient);
+    });
+    parser.setTopLevelHandler([&](std::unique_ptr<FunctionAST>) {
+        std::cerr << "warning: top-level expressions are ignored in a precompiled library" << std::endl;
+    });
+    while (parser.parse())
+        ;
+
+    if (!ok || llvm::verifyModule(*env.module, &llvm::errs())) {
+        std::cerr << source << ": failed to compile" << std::endl;
+        return false;
+    }
+
+    llvm::SmallVector<char, 0> bitcode;
+    {
+        llvm::raw_svector_ostream os{bitcode};
+        llvm::WriteBitcodeToFile(*env.module, os);
+    }
+
+    // 再定義されたものは最後の定義だけを書く
+    std::string table;
+    std::uint32_t count = 0;
+    for (auto* proto : protos) {
+        if (env.proto_func.at(proto->getName()).get() != proto)
+            continue;
+        ++count;
+        put32(table, (proto->isExtern() ? flag_extern : 0) | (proto->isPure() ? flag_pure : 0) |
+                         typeFlags(proto->getReturnType()));
+        put32(table, proto->getLine());
+        put32(table, proto->arity());
+        putString(table, proto->getName());
+        for (size_t i = 0; i < proto->arity(); ++i) {
+            put32(table, (proto->isBuffer(i) ? arg_buffer : 0) | typeFlags(proto->getType(i)));
+            putString(table, proto->getArgs()[i]);
+        }
+    }
+
+    auto offset = llvm::alignTo(header_size + table.size(), 16);  // bitcodeは4バイト境界にないと読めない
+    std::string header{magic, sizeof(magic)};
+    put32(header, version);
+    put32(header, count);
+    put32(header, 0);
+    put64(header, offset);
+    put64(header, bitcode.size());
+
+    std::error_code ec;
+    llvm::raw_fd_ostream os{output, ec, llvm::sys::fs::OF_None};
+    if (ec) {
+        std::cerr << output << ": " << ec.message() << std::endl;
+        return false;
+    }
+    os << header << table;
+    os.write_zeros(offset - header_size - table.size());
+    os.write(bitcode.data(), bitcode.size());
+    return true;
+}
+
+std::optional<Library> readLibrary(const std::string& path)
+{
+    // 大きなファイルはmmapされる．bitcodeはコピーせずにそのまま読む
+    auto file = llvm::MemoryBuffer::getFile(path, -1, false);
+    if (!file) {
+        std::cerr << path << ": " << file.getError().message() << std::endl;
+        return std::nullopt;
+    }
+
+    Library lib;
+    lib.file = std::move(*file);
+    auto data = lib.file->getBufferStart();
+    auto size = lib.file->getBufferSize();
+    if (size < header_size || std::memcmp(data, magic, sizeof(magic)) != 0)
+        return broken(path, "not a precompiled library");
+    if (llvm::support::endian::read32le(data + 4) != version)
+        return broken(path, "unsupported library version");
+
+    auto count = llvm::support::endian::read32le(data + 8);
+    auto offset = llvm::support::endian::read64le(data + 16);
+    auto bitcode_size = llvm::support::endian::read64le(data + 24);
+    if (offset < header_size || offset > size || bitcode_size > size - offset)
+        return broken(path, "truncated library");
+
+    Reader reader{data + header_size, data + offset};
+    for (std::uint32_t i = 0; i < count; ++i) {
+        std::uint32_t flags, line, arity;
+        std::string name;
+        if (!reader.read32(flags) || !reader.read32(line) || !reader.read32(arity) || !reader.readString(name) ||
+            arity > static_cast<std::size_t>(reader.end - reader.p) / 8)
+            return broken(path, "broken prototype table");
+        auto ret = typeOf(flags);
+        if (!ret)
+            return broken(path, "broken prototype table");
+        std::vector<std::string> args(arity);
+        std::vector<bool> buffers(arity);
+        std::vector<ValueType> types(arity);
+        for (std::uint32_t j = 0; j < arity; ++j) {
+            std::uint32_t arg_flags;
+            if (!reader.read32(arg_flags) || !reader.readString(args[j]))
+                return broken(path, "broken prototype table");
+            auto type = typeOf(arg_flags);
+            if (!type)
+                return broken(path, "broken prototype table");
+            buffers[j] = (arg_flags & arg_buffer) != 0;
+            types[j] = *type;
+        }
+
+        auto proto = std::make_unique<PrototypeAST>(
+            std::move(name), std::move(args), (flags & flag_extern) != 0, std::move(buffers), std::move(types), *ret);
+        proto->setPure((flags & flag_pure) != 0);
+        proto->setLine(line);
+        lib.protos.push_back(std::move(proto));
+    }
+
+    lib.bitcode = llvm::MemoryBufferRef{llvm::StringRef{data + offset, bitcode_size}, path};
+    return lib;
+}
+
+}  // namespace kaleidoscope
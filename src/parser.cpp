@@ -1,6 +1,9 @@
 #include <kaleidoscope/parser.hpp>
+#include <kaleidoscope/precedence.hpp>
 
+#include <optional>
 #include <unordered_map>
+#include <utility>
 
 namespace kaleidoscope
 {
@@ -8,7 +11,7 @@ namespace kaleidoscope
 struct ParserImpl
 {
     template <class... Msgs>
-    std::unique_ptr<ExprAST> logErrorE(Msgs&&... msgs)
+    ExprPtr logErrorE(Msgs&&... msgs)
     {
         ((std::cerr << "logErrorE: ") << ... << std::forward<Msgs>(msgs)) << std::endl;
         return nullptr;
@@ -21,27 +24,27 @@ struct ParserImpl
         return nullptr;
     }
 
-    std::unique_ptr<ExprAST> parseIdentifier()
+    ExprPtr parseIdentifier()
     {
         if (auto id = token::get_identifier(tokenizer.curToken()); !id.empty()) {
-            auto res = std::make_unique<VariableExprAST>(std::move(id));
+            auto res = factory.make<VariableExprAST>(std::move(id));
             tokenizer.getNextToken();  // consume itself
             return res;
         }
         return logErrorE("expected identifier in identifier");
     }
 
-    std::unique_ptr<ExprAST> parseNumExpr()
+    ExprPtr parseNumExpr()
     {
         if (auto num = token::get_num(tokenizer.curToken()); num.has_value()) {
-            auto res = std::make_unique<NumberExpAST>(num.value());
+            auto res = factory.make<NumberExpAST>(num.value());
             tokenizer.getNextToken();
             return res;
         }
         return logErrorE("expected number in number-expr");
     }
 
-    std::unique_ptr<ExprAST> parseParenExpr()
+    ExprPtr parseParenExpr()
     {
         if (!token::is_l_paren(tokenizer.curToken()))
             return logErrorE("expected '(' in paren-expr");
@@ -58,18 +61,21 @@ struct ParserImpl
         return expr;
     }
 
-    // identifier-expr ::= identifier | identifier '(' (expression (',' expression)*)? ')'
-    std::unique_ptr<ExprAST> parseIdentifierExpr()
+    // identifier-expr ::= identifier | identifier '(' (expression (',' expression)*)? ')' | index-expr
+    ExprPtr parseIdentifierExpr()
     {
         std::string id_name = token::get_identifier(tokenizer.curToken());
         if (id_name.empty())
             return logErrorE("expected identifier in identifier-expr");
 
-        if (!token::is_l_paren(tokenizer.getNextToken()))
-            return std::make_unique<VariableExprAST>(std::move(id_name));
+        if (token::is_l_bracket(tokenizer.getNextToken()))
+            return parseIndexExpr(std::move(id_name));
+
+        if (!token::is_l_paren(tokenizer.curToken()))
+            return factory.make<VariableExprAST>(std::move(id_name));
 
         // call
-        std::vector<std::unique_ptr<ExprAST>> args;
+        std::vector<ExprPtr> args;
         if (!token::is_r_paren(tokenizer.getNextToken())) {  // consume '(' and check ')'
             while (true) {
                 if (auto arg = parseExpression())
@@ -88,14 +94,184 @@ struct ParserImpl
         }
 
         tokenizer.getNextToken();  // consume ')'
-        return std::make_unique<CallExprAST>(std::move(id_name), std::move(args));
+        return factory.make<CallExprAST>(std::move(id_name), std::move(args));
     }
 
-    // primary ::= identifier-expr | number-expr | paren-expr
-    std::unique_ptr<ExprAST> parsePrimary()
+    // index-expr ::= identifier '[' expression ']' ('=' expression)?
+    ExprPtr parseIndexExpr(std::string name)
+    {
+        tokenizer.getNextToken();  // consume '['
+
+        auto index = parseExpression();
+        if (!index)
+            return nullptr;
+
+        if (!token::is_r_bracket(tokenizer.curToken()))
+            return logErrorE("expected ']' in index-expr. curTok: ", tokenizer.curToken());
+
+        if (!token::is_assign(tokenizer.getNextToken()))  // consume ']'
+            return factory.make<IndexExprAST>(std::move(name), std::move(index));
+
+        tokenizer.getNextToken();  // consume '='
+        auto value = parseExpression();
+        if (!value)
+            return nullptr;
+
+        return factory.make<StoreExprAST>(std::move(name), std::move(index), std::move(value));
+    }
+
+    // for-expr ::= 'for' identifier '=' expression ',' expression (',' expression)? 'in' expression
+    ExprPtr parseForExpr()
+    {
+        auto var = token::get_identifier(tokenizer.getNextToken());  // consume 'for'
+        if (var.empty())
+            return logErrorE("expected identifier after 'for'. curTok: ", tokenizer.curToken());
+
+        if (!token::is_assign(tokenizer.getNextToken()))  // consume identifier
+            return logErrorE("expected '=' after for. curTok: ", tokenizer.curToken());
+        tokenizer.getNextToken();  // consume '='
+
+        auto start = parseExpression();
+        if (!start)
+            return nullptr;
+
+        if (!token::is_comma(tokenizer.curToken()))
+            return logErrorE("expected ',' after for start value. curTok: ", tokenizer.curToken());
+        tokenizer.getNextToken();  // consume ','
+
+        auto end = parseExpression();
+        if (!end)
+            return nullptr;
+
+        ExprPtr step;
+        if (token::is_comma(tokenizer.curToken())) {
+            tokenizer.getNextToken();  // consume ','
+            step = parseExpression();
+            if (!step)
+                return nullptr;
+        } else {
+            step = factory.make<NumberExpAST>(1.0);
+        }
+
+        if (!token::is_in(tokenizer.curToken()))
+            return logErrorE("expected 'in' after for. curTok: ", tokenizer.curToken());
+        tokenizer.getNextToken();  // consume 'in'
+
+        auto body = parseExpression();
+        if (!body)
+            return nullptr;
+
+        return factory.make<ForExprAST>(std::move(var), std::move(start), std::move(end), std::move(step), std::move(body));
+    }
+
+    // parallel-loop ::= identifier '=' expression ',' expression 'in' expression
+    // curTokenは変数名．opが空ならparfor
+    ExprPtr parseParallelLoop(std::string op)
+    {
+        auto var = token::get_identifier(tokenizer.curToken());
+        if (var.empty())
+            return logErrorE("expected identifier in parallel loop. curTok: ", tokenizer.curToken());
+
+        if (!token::is_assign(tokenizer.getNextToken()))  // consume identifier
+            return logErrorE("expected '=' in parallel loop. curTok: ", tokenizer.curToken());
+        tokenizer.getNextToken();  // consume '='
+
+        auto start = parseExpression();
+        if (!start)
+            return nullptr;
+
+        if (!token::is_comma(tokenizer.curToken()))
+            return logErrorE("expected ',' after start value. curTok: ", tokenizer.curToken());
+        tokenizer.getNextToken();  // consume ','
+
+        auto end = parseExpression();
+        if (!end)
+            return nullptr;
+
+        if (!token::is_in(tokenizer.curToken()))
+            return logErrorE("expected 'in' in parallel loop. curTok: ", tokenizer.curToken());
+        tokenizer.getNextToken();  // consume 'in'
+
+        auto body = parseExpression();
+        if (!body)
+            return nullptr;
+
+        return factory.make<ParallelExprAST>(std::move(op), std::move(var), std::move(start), std::move(end), std::move(body));
+    }
+
+    // parfor-expr ::= 'parfor' parallel-loop
+    ExprPtr parseParforExpr()
+    {
+        tokenizer.getNextToken();  // consume 'parfor'
+        return parseParallelLoop("");
+    }
+
+    // reduce-expr ::= 'reduce' '(' ('+' | '*' | 'min' | 'max') ',' parallel-loop ')'
+    ExprPtr parseReduceExpr()
+    {
+        if (!token::is_l_paren(tokenizer.getNextToken()))  // consume 'reduce'
+            return logErrorE("expected '(' after reduce. curTok: ", tokenizer.curToken());
+
+        auto& tok = tokenizer.getNextToken();  // consume '('
+        auto op = token::is_punc(tok) ? token::get_punc(tok) : token::get_identifier(tok);
+        if (op != "+" && op != "*" && op != "min" && op != "max")
+            return logErrorE("unknown reduction operator. curTok: ", tok);
+
+        if (!token::is_comma(tokenizer.getNextToken()))  // consume op
+            return logErrorE("expected ',' after reduction operator. curTok: ", tokenizer.curToken());
+        tokenizer.getNextToken();  // consume ','
+
+        auto loop = parseParallelLoop(std::move(op));
+        if (!loop)
+            return nullptr;
+
+        if (!token::is_r_paren(tokenizer.curToken()))
+            return logErrorE("expected ')' in reduce. curTok: ", tokenizer.curToken());
+        tokenizer.getNextToken();  // consume ')'
+        return loop;
+    }
+
+    // if-expr ::= 'if' expression 'then' expression 'else' expression
+    ExprPtr parseIfExpr()
+    {
+        tokenizer.getNextToken();  // consume 'if'
+
+        auto cond = parseExpression();
+        if (!cond)
+            return nullptr;
+
+        if (!token::is_then(tokenizer.curToken()))
+            return logErrorE("expected 'then' in if-expr. curTok: ", tokenizer.curToken());
+        tokenizer.getNextToken();  // consume 'then'
+
+        auto then = parseExpression();
+        if (!then)
+            return nullptr;
+
+        if (!token::is_else(tokenizer.curToken()))
+            return logErrorE("expected 'else' in if-expr. curTok: ", tokenizer.curToken());
+        tokenizer.getNextToken();  // consume 'else'
+
+        auto els = parseExpression();
+        if (!els)
+            return nullptr;
+
+        return factory.make<IfExprAST>(std::move(cond), std::move(then), std::move(els));
+    }
+
+    // primary ::= identifier-expr | number-expr | paren-expr | if-expr | for-expr | parfor-expr | reduce-expr
+    ExprPtr parsePrimary()
     {
         if (token::is_identifier(tokenizer.curToken())) {
             return parseIdentifierExpr();
+        } else if (token::is_if(tokenizer.curToken())) {
+            return parseIfExpr();
+        } else if (token::is_for(tokenizer.curToken())) {
+            return parseForExpr();
+        } else if (token::is_parfor(tokenizer.curToken())) {
+            return parseParforExpr();
+        } else if (token::is_reduce(tokenizer.curToken())) {
+            return parseReduceExpr();
         } else if (token::is_num(tokenizer.curToken())) {
             return parseNumExpr();
         } else if (token::is_l_paren(tokenizer.curToken())) {
@@ -107,7 +283,7 @@ struct ParserImpl
 
     // binop-rhs ::= (binop primary)*
     // binop = '+' | '-' | ...
-    std::unique_ptr<ExprAST> parseBinOpRHS(int expr_prio, std::unique_ptr<ExprAST> lhs)
+    ExprPtr parseBinOpRHS(int expr_prio, ExprPtr lhs)
     {
         while (true) {
             auto binop = token::get_punc(tokenizer.curToken());
@@ -132,12 +308,12 @@ struct ParserImpl
                     return nullptr;
             }
 
-            lhs = std::make_unique<BinaryExprAST>(std::move(binop), std::move(lhs), std::move(rhs));
+            lhs = factory.make<BinaryExprAST>(std::move(binop), std::move(lhs), std::move(rhs));
         }
     }
 
     // expression ::= primary binop-rhs
-    std::unique_ptr<ExprAST> parseExpression()
+    ExprPtr parseExpression()
     {
         auto lhs = parsePrimary();
         if (!lhs)
@@ -146,25 +322,56 @@ struct ParserImpl
         return parseBinOpRHS(0, std::move(lhs));
     }
 
-    // prototype ::= identifier '(' (identifier (',' identifier)*)? ')'
-    std::unique_ptr<PrototypeAST> parsePrototype()
+    // type-annotation ::= ':' ('f64' | 'f32' | 'i64')
+    // curTokenが':'でなければf64
+    std::optional<ValueType> parseTypeAnnotation()
+    {
+        if (!token::is_colon(tokenizer.curToken()))
+            return ValueType::f64;
+
+        auto type = parseValueType(token::get_identifier(tokenizer.getNextToken()));  // consume ':'
+        if (!type) {
+            logErrorP("unknown type. curTok: ", tokenizer.curToken());
+            return std::nullopt;
+        }
+        tokenizer.getNextToken();  // consume type
+        return type;
+    }
+
+    // prototype ::= identifier '(' (param (',' param)*)? ')' type-annotation?
+    // param ::= identifier ('[' ']')? type-annotation?
+    std::unique_ptr<PrototypeAST> parsePrototype(bool is_extern = false)
     {
         if (!token::is_identifier(tokenizer.curToken())) {
             return logErrorP("expected function name in prototype");
         }
 
         std::string fn_name = token::get_identifier(tokenizer.curToken());
+        auto line = tokenizer.curLine();
         if (!token::is_l_paren(tokenizer.getNextToken())) {
             return logErrorP("expected '(' in prototype. curTok: ", tokenizer.curToken());
         }
 
         std::vector<std::string> arg_names;
+        std::vector<bool> buffers;
+        std::vector<ValueType> types;
         while (true) {
             if (!token::is_identifier(tokenizer.getNextToken()))
                 return logErrorP("expected identifier in prototype. curTok: ", tokenizer.curToken());
             arg_names.push_back(token::get_identifier(tokenizer.curToken()));
 
             tokenizer.getNextToken();
+            buffers.push_back(token::is_l_bracket(tokenizer.curToken()));
+            if (buffers.back() && !token::is_r_bracket(tokenizer.getNextToken()))  // consume '['
+                return logErrorP("expected ']' in prototype. curTok: ", tokenizer.curToken());
+            if (buffers.back())
+                tokenizer.getNextToken();  // consume ']'
+
+            auto type = parseTypeAnnotation();
+            if (!type)
+                return nullptr;
+            types.push_back(*type);
+
             if (token::is_comma(tokenizer.curToken())) {
                 continue;
             } else if (token::is_r_paren(tokenizer.curToken())) {
@@ -175,14 +382,21 @@ struct ParserImpl
             }
         }
 
-        return std::make_unique<PrototypeAST>(std::move(fn_name), std::move(arg_names));
+        auto ret = parseTypeAnnotation();
+        if (!ret)
+            return nullptr;
+
+        auto proto = std::make_unique<PrototypeAST>(
+            std::move(fn_name), std::move(arg_names), is_extern, std::move(buffers), std::move(types), *ret);
+        proto->setLine(line);
+        return proto;
     }
 
     // external ::= 'extern' prototype
     std::unique_ptr<PrototypeAST> parseExtern()
     {
         tokenizer.getNextToken();  // consume 'extern'
-        return parsePrototype();
+        return parsePrototype(true);
     }
 
     // definition ::= 'def' prototype expression
@@ -201,11 +415,43 @@ struct ParserImpl
         return std::make_unique<FunctionAST>(std::move(proto), std::move(body));
     }
 
+    // attributed-definition ::= ('@' identifier)+ definition
+    std::unique_ptr<FunctionAST> parseAttributedDefinition()
+    {
+        bool memo = false, grad = false;
+        while (token::is_at(tokenizer.curToken())) {
+            auto attr = token::get_identifier(tokenizer.getNextToken());  // consume '@'
+            if (attr == "memo") {
+                memo = true;
+            } else if (attr == "grad") {
+                grad = true;
+            } else {
+                logErrorP("unknown attribute. curTok: ", tokenizer.curToken());
+                return nullptr;
+            }
+            tokenizer.getNextToken();  // consume attribute
+        }
+
+        if (!token::is_def(tokenizer.curToken())) {
+            logErrorP("expected 'def' after attribute. curTok: ", tokenizer.curToken());
+            return nullptr;
+        }
+
+        auto def = parseDefinition();
+        if (def) {
+            def->getProto().setMemo(memo);
+            def->getProto().setGrad(grad);
+        }
+        return def;
+    }
+
     // toplevelexpr ::= expression
     std::unique_ptr<FunctionAST> parseTopLevelExpr()
     {
+        auto line = tokenizer.curLine();
         if (auto expr = parseExpression()) {
             auto proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>{});
+            proto->setLine(line);
             return std::make_unique<FunctionAST>(std::move(proto), std::move(expr));
         }
         return nullptr;
@@ -215,6 +461,7 @@ struct ParserImpl
         : tokenizer{std::move(tok)} {}
 
     Tokenizer tokenizer;
+    ExprFactory factory;
 
     std::unordered_map<std::string, int> binop_prio;
 
@@ -230,33 +477,53 @@ struct ParserImpl
 Parser::Parser(Tokenizer&& tok)
     : impl{std::make_shared<ParserImpl>(std::move(tok))}
 {
-    impl->binop_prio["<"] = 10;
-    impl->binop_prio[">"] = 10;
-    impl->binop_prio["+"] = 20;
-    impl->binop_prio["-"] = 20;
-    impl->binop_prio["*"] = 40;
-    impl->binop_prio["/"] = 40;
+    for (auto& [op, prio] : binop_precedence)
+        impl->binop_prio[std::string{op}] = prio;
+}
+
+void Parser::setHashConsing(bool enabled)
+{
+    impl->factory.enabled = enabled;
+}
+
+void Parser::setStats(Stats* s)
+{
+    stats = s;
+    impl->tokenizer.stats = s;
 }
 
 bool Parser::parse()
 {
+    PhaseTimer timer{stats, Phase::parse};
+
+    // 部分木の共有は1つの定義の中だけにして，表が際限なく大きくならないようにする
+    impl->factory.clear();
+    if (stats)  // 前の定義のために作ったノードを数える
+        stats->ast_nodes += std::exchange(impl->factory.created, 0);
+
     const auto& token = impl->tokenizer.getNextToken();
 
     if (token::is_eof(token)) {
         return false;
     } else if (token::is_semicolon(token)) {
         parse();
-    } else if (token::is_def(token)) {
-        auto def = impl->parseDefinition();
-        if (def_handler && def)
+    } else if (token::is_def(token) || token::is_at(token)) {
+        auto def = token::is_def(token) ? impl->parseDefinition() : impl->parseAttributedDefinition();
+        if (!def)
+            error("syntax error in a definition");
+        else if (def_handler)
             def_handler(std::move(def));
     } else if (token::is_extern(token)) {
         auto proto = impl->parseExtern();
-        if (extern_handler && proto)
+        if (!proto)
+            error("syntax error in an extern");
+        else if (extern_handler)
             extern_handler(std::move(proto));
     } else {
         auto toplevel = impl->parseTopLevelExpr();
-        if (toplevel_handler && toplevel)
+        if (!toplevel)
+            error("syntax error in a top-level expression");
+        else if (toplevel_handler)
             toplevel_handler(std::move(toplevel));
     }
     return true;
@@ -0,0 +1,108 @@
+#include <kaleidoscope/runtime.hpp>
+#include <kaleidoscope/thread_pool.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+
+namespace
+{
+std::string memoKey(const double* args, std::uint64_t n)
+{
+    return std::string(reinterpret_cast<const char*>(args), n * sizeof(double));
+}
+
+using ParallelBody = void (*)(void*, std::int64_t, std::int64_t, std::int64_t);
+
+// 手の空いたスレッドが次のチャンクを取っていく．遅く始まったスレッドは取るものがなければすぐ終わる
+struct ParallelLoop
+{
+    ParallelBody body;
+    void* ctx;
+    std::int64_t begin;
+    std::uint64_t n;  // 回数．INT64_MAXを超えることもある
+    std::int64_t chunks;
+    std::atomic<std::int64_t> next{0};
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::int64_t done = 0;
+
+    // チャンクkの先頭．端数は前のチャンクに1つずつ配る
+    std::int64_t chunkBegin(std::int64_t k) const
+    {
+        auto c = static_cast<std::uint64_t>(chunks);
+        auto u = static_cast<std::uint64_t>(k);
+        return static_cast<std::int64_t>(static_cast<std::uint64_t>(begin) + u * (n / c) + std::min(u, n % c));
+    }
+
+    void run()
+    {
+        for (auto k = next.fetch_add(1, std::memory_order_relaxed); k < chunks;
+             k = next.fetch_add(1, std::memory_order_relaxed)) {
+            body(ctx, chunkBegin(k), chunkBegin(k + 1), k);
+            std::lock_guard lock{mutex};
+            if (++done == chunks)
+                finished.notify_all();
+        }
+    }
+};
+}  // namespace
+
+extern "C" {
+const double* kaleidoscope_memo_find(kaleidoscope::MemoTable* table, const double* args, std::uint64_t n)
+{
+    // unordered_mapの要素はrehashしても移動せず，一度入れた値は書き換えないので，ポインタを返してよい
+    auto key = memoKey(args, n);
+    std::lock_guard lock{table->mutex};
+    if (auto p = table->entries.find(key); p != table->entries.end())
+        return &p->second;
+    return nullptr;
+}
+
+void kaleidoscope_memo_store(kaleidoscope::MemoTable* table, const double* args, std::uint64_t n, double value)
+{
+    // 純粋な関数なので，同じ引数で先に入れられた値も同じ
+    auto key = memoKey(args, n);
+    std::lock_guard lock{table->mutex};
+    table->entries.try_emplace(std::move(key), value);
+}
+
+std::int64_t kaleidoscope_parallel_for(kaleidoscope::ThreadPool* pool, ParallelBody body, void* ctx, std::int64_t begin,
+    std::int64_t end)
+{
+    if (begin >= end)
+        return 0;
+
+    // プールがないときやプールのスレッドからは，呼び出し元だけで1つのチャンクとして回す
+    if (!pool || kaleidoscope::ThreadPool::onWorkerThread()) {
+        body(ctx, begin, end, 0);
+        return 1;
+    }
+
+    // 回数はuint64で数える．チャンクが1つなら呼び出し元で回す
+    auto n = static_cast<std::uint64_t>(end) - static_cast<std::uint64_t>(begin);
+    auto chunks = static_cast<std::int64_t>(std::min<std::uint64_t>(
+        {n, static_cast<std::uint64_t>(kaleidoscope::max_parallel_chunks), (pool->size() + 1) * 4}));
+    if (chunks <= 1) {
+        body(ctx, begin, end, 0);
+        return 1;
+    }
+
+    // ctxは呼び出し元のスタックにあるが，チャンクを取れたスレッドしか触らないので，全て終わるのを待てばよい
+    auto loop = std::make_shared<ParallelLoop>();
+    loop->body = body;
+    loop->ctx = ctx;
+    loop->begin = begin;
+    loop->n = n;
+    loop->chunks = chunks;
+    for (std::size_t i = 0; i < std::min<std::size_t>(pool->size(), chunks - 1); ++i)
+        pool->submit([loop] { loop->run(); });
+
+    loop->run();
+    std::unique_lock lock{loop->mutex};
+    loop->finished.wait(lock, [&] { return loop->done == loop->chunks; });
+    return chunks;
+}
+}
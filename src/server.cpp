@@ -0,0 +1,421 @@
+#include <kaleidoscope/server.hpp>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <sstream>
+
+namespace kaleidoscope
+{
+
+namespace
+{
+constexpr std::size_t max_header = 4096;
+constexpr std::size_t max_arity = 8;
+
+struct Request
+{
+    enum class Kind
+    {
+        eval,
+        call,
+        quit,
+        invalid,
+    } kind;
+    std::string name;  // CALLの関数名，invalidなら理由
+    std::string body;  // EVALのソース，CALLの引数の行
+    std::size_t rows = 0;
+};
+
+// bufの先頭に完全な要求が1つ届いていれば取り出す
+std::optional<Request> takeRequest(std::string& buf)
+{
+    auto eol = buf.find('\n');
+    if (eol == std::string::npos) {
+        if (buf.size() > max_header) {
+            buf.clear();
+            return Request{Request::Kind::invalid, "request line too long"};
+        }
+        return std::nullopt;
+    }
+
+    std::istringstream header{buf.substr(0, eol)};
+    std::string command;
+    header >> command;
+
+    if (command == "QUIT") {
+        buf.erase(0, eol + 1);
+        return Request{Request::Kind::quit};
+    }
+
+    if (command == "EVAL") {
+        std::size_t bytes = 0;
+        if (!(header >> bytes)) {
+            buf.erase(0, eol + 1);
+            return Request{Request::Kind::invalid, "usage: EVAL <bytes>"};
+        }
+        if (buf.size() < eol + 1 + bytes)
+            return std::nullopt;
+        Request req{Request::Kind::eval, {}, buf.substr(eol + 1, bytes)};
+        buf.erase(0, eol + 1 + bytes);
+        return req;
+    }
+
+    if (command == "CALL") {
+        Request req{Request::Kind::call};
+        if (!(header >> req.name >> req.rows)) {
+            buf.erase(0, eol + 1);
+            return Request{Request::Kind::invalid, "usage: CALL <name> <rows>"};
+        }
+        // 引数の行が全部届くまで待つ
+        auto end = eol;
+        for (std::size_t i = 0; i < req.rows; ++i) {
+            end = buf.find('\n', end + 1);
+            if (end == std::string::npos)
+                return std::nullopt;
+        }
+        req.body = buf.substr(eol + 1, end - eol);
+        buf.erase(0, end + 1);
+        return req;
+    }
+
+    buf.erase(0, eol + 1);
+    return Request{Request::Kind::invalid, "unknown command: " + command};
+}
+
+template <std::size_t... I>
+double invokeWith(llvm::JITTargetAddress addr, const double* args, std::index_sequence<I...>)
+{
+    using Fn = double (*)(decltype((void)I, double())...);
+    return reinterpret_cast<Fn>(static_cast<intptr_t>(addr))(args[I]...);
+}
+
+double invoke(llvm::JITTargetAddress addr, std::size_t arity, const double* args)
+{
+    switch (arity) {
+    case 0: return invokeWith(addr, args, std::make_index_sequence<0>{});
+    case 1: return invokeWith(addr, args, std::make_index_sequence<1>{});
+    case 2: return invokeWith(addr, args, std::make_index_sequence<2>{});
+    case 3: return invokeWith(addr, args, std::make_index_sequence<3>{});
+    case 4: return invokeWith(addr, args, std::make_index_sequence<4>{});
+    case 5: return invokeWith(addr, args, std::make_index_sequence<5>{});
+    case 6: return invokeWith(addr, args, std::make_index_sequence<6>{});
+    case 7: return invokeWith(addr, args, std::make_index_sequence<7>{});
+    case 8: return invokeWith(addr, args, std::make_index_sequence<8>{});
+    }
+    std::abort();
+}
+
+void appendValue(std::string& out, double value)
+{
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.17g\n", value);
+    out += buf;
+}
+
+std::string error(const std::string& reason)
+{
+    return "ERR " + reason + "\n";
+}
+}  // namespace
+
+Server::Server(Interpreter& interpreter, std::string socket_path)
+    : interpreter{interpreter}, socket_path{std::move(socket_path)}, pool{interpreter.getEngine().pool()}
+{
+}
+
+Server::~Server()
+{
+    {
+        std::unique_lock lock{done_mutex};
+        idle.wait(lock, [&] { return in_flight == 0; });
+    }
+    for (auto& [id, conn] : connections)
+        ::close(conn.fd);
+    for (int fd : {listen_fd, epoll_fd, wake_fd})
+        if (fd >= 0)
+            ::close(fd);
+    if (listen_fd >= 0)
+        ::unlink(socket_path.c_str());
+}
+
+void Server::stop()
+{
+    stopping = true;
+    std::uint64_t one = 1;
+    if (wake_fd >= 0)
+        (void)::write(wake_fd, &one, sizeof(one));  // シグナルハンドラからも呼べるようにwriteだけ
+}
+
+bool Server::listen()
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "socket path too long: " << socket_path << std::endl;
+        return false;
+    }
+    std::strcpy(addr.sun_path, socket_path.c_str());
+
+    listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        std::perror("socket");
+        return false;
+    }
+    ::unlink(socket_path.c_str());  // 前に落ちたサーバーのソケットが残っていることがある
+    if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(listen_fd, SOMAXCONN) < 0) {
+        std::perror(socket_path.c_str());
+        return false;
+    }
+
+    epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || wake_fd < 0) {
+        std::perror("epoll");
+        return false;
+    }
+
+    // 接続以外のfdはdata.u64に番号0を入れ，fdで区別する
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.u64 = UINT64_MAX;
+    ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+    return true;
+}
+
+bool Server::run()
+{
+    if (!listen())
+        return false;
+
+    epoll_event events[64];
+    while (!stopping) {
+        int n = ::epoll_wait(epoll_fd, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            std::perror("epoll_wait");
+            return false;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            auto id = events[i].data.u64;
+            if (id == 0) {
+                accept();
+            } else if (id == UINT64_MAX) {
+                std::uint64_t count;
+                while (::read(wake_fd, &count, sizeof(count)) > 0)
+                    ;
+                collect();
+            } else if (connections.count(id)) {
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    receive(id, events[i].events & (EPOLLHUP | EPOLLERR));
+                if (connections.count(id) && (events[i].events & EPOLLOUT))
+                    send(id);
+            }
+        }
+    }
+    return true;
+}
+
+void Server::accept()
+{
+    for (;;) {
+        int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+
+        auto id = next_id++;
+        connections.emplace(id, Connection{fd});
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = id;
+        ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+void Server::receive(std::uint64_t id, bool hangup)
+{
+    auto& conn = connections.at(id);
+    char buf[65536];
+    for (;;) {
+        auto n = ::read(conn.fd, buf, sizeof(buf));
+        if (n > 0) {
+            conn.in.append(buf, n);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n < 0 && errno == EINTR)
+            continue;
+        // 書き込み側だけが閉じられたなら，届いた要求には答える
+        // 相手が両方閉じたかエラーなら応答は届かないので，処理中の要求があっても捨てる
+        if (n < 0 || hangup) {
+            close(id);
+            return;
+        }
+        conn.peer_closed = true;
+        break;
+    }
+    dispatch(id);
+}
+
+// 届いた要求を順に処理し，応答を送る．EVALとCALLはプールに投げ，終わるまで次の要求は取り出さない
+void Server::dispatch(std::uint64_t id)
+{
+    auto& conn = connections.at(id);
+    while (!conn.busy && !conn.closing) {
+        auto req = takeRequest(conn.in);
+        if (!req)
+            break;
+        if (req->kind == Request::Kind::quit) {
+            conn.closing = true;
+        } else if (req->kind == Request::Kind::invalid) {
+            conn.out += error(req->name);
+        } else {
+            conn.busy = true;
+            {
+                std::lock_guard lock{done_mutex};
+                ++in_flight;
+            }
+            pool.submit([this, id, req = std::move(*req)] {
+                auto response = req.kind == Request::Kind::eval ? evaluate(req.body) : call(req.name, req.body, req.rows);
+                // in_flightが0になった後はthisが壊れているかもしれないので，全部ロックの中で済ませる
+                std::lock_guard lock{done_mutex};
+                done.emplace_back(id, std::move(response));
+                std::uint64_t one = 1;
+                (void)::write(wake_fd, &one, sizeof(one));
+                --in_flight;
+                idle.notify_all();
+            });
+        }
+    }
+    send(id);
+}
+
+void Server::collect()
+{
+    std::vector<std::pair<std::uint64_t, std::string>> finished;
+    {
+        std::lock_guard lock{done_mutex};
+        finished.swap(done);
+    }
+
+    for (auto& [id, response] : finished) {
+        auto conn = connections.find(id);
+        if (conn == connections.end())  // 処理中に閉じられた
+            continue;
+        conn->second.busy = false;
+        conn->second.out += response;
+        dispatch(id);
+    }
+}
+
+void Server::send(std::uint64_t id)
+{
+    auto& conn = connections.at(id);
+    while (!conn.out.empty()) {
+        auto n = ::write(conn.fd, conn.out.data(), conn.out.size());
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n < 0) {
+            close(id);
+            return;
+        }
+        conn.out.erase(0, n);
+    }
+
+    if (conn.out.empty() && (conn.closing || (conn.peer_closed && !conn.busy))) {
+        close(id);
+        return;
+    }
+    watch(id);
+}
+
+// 送り残しがあるときだけ書き込み可能を待つ
+void Server::watch(std::uint64_t id)
+{
+    auto& conn = connections.at(id);
+    epoll_event ev{};
+    // 相手が書き込みを閉じた後はEOFで読み込み可能のままになるので，読み込みは待たない
+    ev.events = (conn.peer_closed ? 0 : EPOLLIN) | (conn.out.empty() ? 0 : EPOLLOUT);
+    ev.data.u64 = id;
+    ::epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &ev);
+}
+
+void Server::close(std::uint64_t id)
+{
+    auto conn = connections.find(id);
+    ::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->second.fd, nullptr);
+    ::close(conn->second.fd);
+    connections.erase(conn);
+}
+
+std::string Server::evaluate(const std::string& source)
+{
+    std::vector<double> results;
+    std::vector<std::string> errors;
+    {
+        std::unique_lock lock{exec_mutex};
+        results = interpreter.eval(source, &errors);
+    }
+    if (!errors.empty()) {
+        std::string reason;
+        for (auto& e : errors)
+            reason += (reason.empty() ? "" : "; ") + e;
+        return error(reason);
+    }
+
+    std::string out = "OK " + std::to_string(results.size()) + "\n";
+    for (auto value : results)
+        appendValue(out, value);
+    return out;
+}
+
+std::string Server::call(const std::string& name, const std::string& rows, std::size_t count)
+{
+    // 実行し終えるまで共有ロックを持ち，その間は定義が差し替えられたりmoduleが消えたりしない
+    std::shared_lock lock{exec_mutex};
+
+    auto entry = interpreter.lookup(name);
+    if (!entry)
+        return error("unknown function: " + name);
+    if (entry->arity > max_arity)
+        return error("too many parameters: " + name);
+    if (!entry->doubles)
+        return error("only functions of doubles can be called: " + name);
+
+    std::string out = "OK " + std::to_string(count) + "\n";
+    std::istringstream input{rows};
+    std::string line;
+    std::vector<double> args(entry->arity);
+    for (std::size_t row = 0; row < count && std::getline(input, line); ++row) {
+        std::istringstream fields{line};
+        std::size_t n = 0;
+        double value;
+        while (fields >> value) {
+            if (n == args.size())
+                return error("too many arguments in row " + std::to_string(row + 1));
+            args[n++] = value;
+        }
+        if (n != args.size() || !fields.eof())
+            return error("expected " + std::to_string(args.size()) + " numbers in row " + std::to_string(row + 1));
+        appendValue(out, invoke(entry->address, entry->arity, args.data()));
+    }
+    return out;
+}
+
+}  // namespace kaleidoscope
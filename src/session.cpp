@@ -0,0 +1,43 @@
+#include <kaleidoscope/session.hpp>
+
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar/NewGVN.h>
+#include <llvm/Transforms/Scalar/Reassociate.h>
+#include <llvm/Transforms/Scalar/SimplifyCFG.h>
+#include <llvm/Transforms/Scalar/TailRecursionElimination.h>
+#include <llvm/Transforms/Vectorize/LoopVectorize.h>
+
+namespace kaleidoscope
+{
+
+CompileSession::CompileSession(llvm::TargetMachine& TM) : PB(&TM)
+{
+    // TargetIRAnalysisなどはTMから作られるので，TMはセッションより長生きする必要がある
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    FPM.addPass(llvm::InstCombinePass());
+    FPM.addPass(llvm::ReassociatePass());
+    FPM.addPass(llvm::NewGVNPass());
+    FPM.addPass(llvm::SimplifyCFGPass());
+    FPM.addPass(llvm::TailCallElimPass());
+
+    // forでバッファを回すループをベクトル化し，後始末をする
+    // ループのない関数ではほとんど何もしない
+    FPM.addPass(llvm::LoopVectorizePass());
+    FPM.addPass(llvm::InstCombinePass());
+    FPM.addPass(llvm::SimplifyCFGPass());
+}
+
+void CompileSession::optimize(llvm::Function& func)
+{
+    FPM.run(func, FAM);
+
+    // funcはこの後JITに渡されて消えるので，アドレスをキーにした解析結果を残さない
+    FAM.clear(func, func.getName());
+}
+
+}  // namespace kaleidoscope
@@ -0,0 +1,160 @@
+#include <kaleidoscope/ast.hpp>
+
+#include <cmath>
+#include <optional>
+
+namespace kaleidoscope
+{
+
+// codegenより前にASTを簡単にしておき，LLVMに渡すIRを小さくする
+// 浮動小数点の結果が変わる変形(x + 0 -> x, 定数の並べ替えなど)はしない
+
+namespace
+{
+std::optional<double> constantOf(const ExprAST& e)
+{
+    if (auto num = dynamic_cast<const NumberExpAST*>(&e))
+        return num->getValue();
+    return std::nullopt;
+}
+
+bool isConstant(const ExprAST& e, double val)
+{
+    auto c = constantOf(e);
+    return c && std::memcmp(&*c, &val, sizeof(double)) == 0;
+}
+
+// 子を簡単にして，変わったら置き換える．子がその場で変わった(オペランドの入れ替えなど)場合も真
+// 親のハッシュは子のハッシュから計算するので，子のハッシュが変わったら親も計算し直す必要がある
+bool simplifyChild(ExprPtr& child)
+{
+    auto before = child->hash();
+    if (auto s = child->simplify()) {
+        child = std::move(s);
+        return true;
+    }
+    return child->hash() != before;
+}
+
+// BinaryExprAST::codegenと同じ意味で計算する
+std::optional<double> fold(const std::string& op, double l, double r)
+{
+    if (op == "+")
+        return l + r;
+    if (op == "-")
+        return l - r;
+    if (op == "*")
+        return l * r;
+    if (op == "<")  // unordered less than
+        return (std::isnan(l) || std::isnan(r) || l < r) ? 1.0 : 0.0;
+    if (op == ">")
+        return (std::isnan(l) || std::isnan(r) || l > r) ? 1.0 : 0.0;
+    return std::nullopt;
+}
+}  // namespace
+
+ExprPtr BinaryExprAST::simplify()
+{
+    bool changed = simplifyChild(lhs);
+    changed |= simplifyChild(rhs);
+
+    auto l = constantOf(*lhs);
+    auto r = constantOf(*rhs);
+    if (l && r)
+        if (auto v = fold(op, *l, *r))
+            return std::make_shared<NumberExpAST>(*v);
+
+    // 加算と乗算は可換なので，定数を右に，それ以外はハッシュ順に並べる
+    // (1 + x)と(x + 1)が同じ形になり，codegenでCSEされる
+    if ((op == "+" || op == "*") && (l || (!r && lhs->hash() > rhs->hash()))) {
+        std::swap(lhs, rhs);
+        changed = true;
+    }
+
+    // 単位元: x * 1 -> x, x - 0 -> x
+    // このノードは他の親と共有されていることがあるので，子はmoveせずにコピーして返す
+    if ((op == "*" && isConstant(*rhs, 1.0)) || (op == "-" && isConstant(*rhs, 0.0)))
+        return lhs;
+
+    if (changed)
+        invalidateHash();
+    return nullptr;
+}
+
+ExprPtr CallExprAST::simplify()
+{
+    bool changed = false;
+    for (auto& arg : args)
+        changed |= simplifyChild(arg);
+
+    if (changed)
+        invalidateHash();
+    return nullptr;
+}
+
+ExprPtr IfExprAST::simplify()
+{
+    bool changed = simplifyChild(cond);
+    changed |= simplifyChild(then);
+    changed |= simplifyChild(els);
+
+    // 条件が定数なら片方だけ残す．IfExprAST::codegenと同じく，NaNは偽
+    if (auto c = constantOf(*cond))
+        return (!std::isnan(*c) && *c != 0.0) ? then : els;
+
+    if (changed)
+        invalidateHash();
+    return nullptr;
+}
+
+ExprPtr IndexExprAST::simplify()
+{
+    if (simplifyChild(index))
+        invalidateHash();
+    return nullptr;
+}
+
+ExprPtr StoreExprAST::simplify()
+{
+    bool changed = simplifyChild(index);
+    changed |= simplifyChild(value);
+
+    if (changed)
+        invalidateHash();
+    return nullptr;
+}
+
+ExprPtr SeqExprAST::simplify()
+{
+    bool changed = false;
+    for (auto& e : exprs)
+        changed |= simplifyChild(e);
+
+    if (changed)
+        invalidateHash();
+    return nullptr;
+}
+
+ExprPtr ParallelExprAST::simplify()
+{
+    bool changed = false;
+    for (auto* e : {&start, &end, &body})
+        changed |= simplifyChild(*e);
+
+    if (changed)
+        invalidateHash();
+    return nullptr;
+}
+
+ExprPtr ForExprAST::simplify()
+{
+    bool changed = false;
+    for (auto* e : {&start, &end, &step, &body})
+        changed |= simplifyChild(*e);
+
+    if (changed)
+        invalidateHash();
+    return nullptr;
+}
+
+}  // namespace kaleidoscope
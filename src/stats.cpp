@@ -0,0 +1,140 @@
+#include <kaleidoscope/stats.hpp>
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+
+namespace kaleidoscope
+{
+
+namespace
+{
+double toMillis(Stats::clock::duration d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+std::vector<std::pair<std::string, Stats::clock::duration>> slowest(const Stats& stats, std::size_t n)
+{
+    auto funcs = stats.functions;
+    n = std::min(n, funcs.size());
+    std::partial_sort(funcs.begin(), funcs.begin() + n, funcs.end(),
+        [](const auto& a, const auto& b) { return a.second > b.second; });
+    funcs.resize(n);
+    return funcs;
+}
+
+// 関数名に使える文字しか来ないが，念のためJSONの文字列としてエスケープする
+void writeJSONString(std::ostream& os, const std::string& str)
+{
+    os << '"';
+    for (char c : str) {
+        if (c == '"' || c == '\\')
+            os << '\\' << c;
+        else if (static_cast<unsigned char>(c) < 0x20)
+            os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec << std::setfill(' ');
+        else
+            os << c;
+    }
+    os << '"';
+}
+}  // namespace
+
+const char* phaseName(Phase phase)
+{
+    switch (phase) {
+    case Phase::lex:
+        return "lex";
+    case Phase::parse:
+        return "parse";
+    case Phase::codegen:
+        return "codegen";
+    case Phase::optimize:
+        return "optimize";
+    case Phase::jit:
+        return "jit";
+    case Phase::lookup:
+        return "lookup";
+    case Phase::execute:
+        return "execute";
+    case Phase::none:
+        break;
+    }
+    return "none";
+}
+
+void Stats::printPhases(std::ostream& os) const
+{
+    Stats::clock::duration total{};
+    for (auto t : time)
+        total += t;
+
+    os << "=== phases ===\n";
+    for (std::size_t i = 0; i < phase_count; ++i) {
+        auto share = total.count() ? 100.0 * time[i].count() / total.count() : 0.0;
+        os << std::left << std::setw(10) << phaseName(static_cast<Phase>(i)) << std::right
+           << std::setw(12) << std::fixed << std::setprecision(3) << toMillis(time[i]) << " ms"
+           << std::setw(8) << std::setprecision(1) << share << " %"
+           << std::setw(10) << calls[i] << " calls\n";
+    }
+    os << std::left << std::setw(10) << "total" << std::right
+       << std::setw(12) << std::setprecision(3) << toMillis(total) << " ms\n";
+    os.unsetf(std::ios_base::floatfield);
+    os << std::setprecision(6);
+}
+
+void Stats::print(std::ostream& os, std::size_t top_n) const
+{
+    printPhases(os);
+
+    os << "=== counts ===\n"
+       << "tokens          " << tokens << '\n'
+       << "ast nodes       " << ast_nodes << '\n'
+       << "defs            " << defs << '\n'
+       << "top-levels      " << top_levels << '\n'
+       << "ir before opt   " << ir_before << '\n'
+       << "ir after opt    " << ir_after << '\n'
+       << "machine code    " << code_bytes << " bytes\n"
+       << "context resets  " << contexts << '\n';
+
+    auto funcs = slowest(*this, top_n);
+    if (funcs.empty())
+        return;
+    os << "=== slowest defs ===\n";
+    for (auto& [name, t] : funcs)
+        os << std::setw(12) << std::fixed << std::setprecision(3) << toMillis(t) << " ms  " << name << '\n';
+    os.unsetf(std::ios_base::floatfield);
+    os << std::setprecision(6);
+}
+
+void Stats::printJSON(std::ostream& os, std::size_t top_n) const
+{
+    os << "{\"phases\":{";
+    for (std::size_t i = 0; i < phase_count; ++i) {
+        if (i)
+            os << ',';
+        os << '"' << phaseName(static_cast<Phase>(i)) << "\":{\"ms\":" << toMillis(time[i])
+           << ",\"calls\":" << calls[i] << '}';
+    }
+    os << "},\"counts\":{"
+       << "\"tokens\":" << tokens
+       << ",\"ast_nodes\":" << ast_nodes
+       << ",\"defs\":" << defs
+       << ",\"top_levels\":" << top_levels
+       << ",\"ir_before\":" << ir_before
+       << ",\"ir_after\":" << ir_after
+       << ",\"code_bytes\":" << code_bytes
+       << ",\"contexts\":" << contexts
+       << "},\"slowest\":[";
+    auto funcs = slowest(*this, top_n);
+    for (std::size_t i = 0; i < funcs.size(); ++i) {
+        if (i)
+            os << ',';
+        os << "{\"name\":";
+        writeJSONString(os, funcs[i].first);
+        os << ",\"ms\":" << toMillis(funcs[i].second) << '}';
+    }
+    os << "]}" << std::endl;
+}
+
+}  // namespace kaleidoscope
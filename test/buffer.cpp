@@ -0,0 +1,196 @@
+// バッファを受け取るdefや型を注釈したdef，parforやreduceをJITし，C++で同じ計算をした結果と比べる
+
+#include <kaleidoscope/interpreter.hpp>
+#include <kaleidoscope/library.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <sstream>
+#include <vector>
+
+#include "check.hpp"
+
+using namespace kaleidoscope;
+using namespace kaleidoscope::test;
+
+namespace
+{
+template <class Fn>
+Fn function(Interpreter& jit, const std::string& name)
+{
+    auto entry = jit.lookup(name);
+    if (!entry || entry->doubles) {
+        std::cerr << name << ": not compiled by the JIT" << std::endl;
+        return nullptr;
+    }
+    return reinterpret_cast<Fn>(static_cast<intptr_t>(entry->address));
+}
+
+}  // namespace
+
+int main()
+{
+    std::istringstream no_input;
+    Interpreter jit{no_input, "test-buffer"};
+    jit.eval(R"(
+        def axpy(a, xs[], ys[]) for i = 0, len(ys) in ys[i] = a * xs[i] + ys[i];
+        def sumFrom(xs[], i) if i < len(xs) then xs[i] + sumFrom(xs, i + 1) else 0;
+        def odd(xs[], ys[]) for i = 1, len(xs), 2 in ys[i] = xs[i - 1] * 2;
+        def shadow(i, xs[]) (for i = 0, len(xs) in xs[i] = i) + i;
+        def scale(a: f32, xs[]: f32) for i = 0, len(xs) in xs[i] = xs[i] * a + 0.5;
+        def squares(xs[]: i64) for i = 0, len(xs) in xs[i] = i * i - 3;
+        def paxpy(a, xs[], ys[]) parfor i = 0, len(ys) in ys[i] = a * xs[i] + ys[i];
+        def dot(xs[], ys[]) reduce(+, i = 0, len(xs) in xs[i] * ys[i]);
+        def imax(xs[]: i64): i64 reduce(max, i = 0, len(xs) in xs[i]);
+    )");
+
+    using Axpy = double (*)(double, double*, std::int64_t, double*, std::int64_t);
+    using SumFrom = double (*)(double*, std::int64_t, double);
+    using Odd = double (*)(double*, std::int64_t, double*, std::int64_t);
+    using Shadow = double (*)(double, double*, std::int64_t);
+    using Scale = double (*)(float, float*, std::int64_t);
+    using Squares = double (*)(std::int64_t*, std::int64_t);
+    using Dot = double (*)(double*, std::int64_t, double*, std::int64_t);
+    using IMax = std::int64_t (*)(std::int64_t*, std::int64_t);
+    auto axpy = function<Axpy>(jit, "axpy");
+    auto sum_from = function<SumFrom>(jit, "sumFrom");
+    auto odd = function<Odd>(jit, "odd");
+    auto shadow = function<Shadow>(jit, "shadow");
+    auto scale = function<Scale>(jit, "scale");
+    auto squares = function<Squares>(jit, "squares");
+    auto paxpy = function<Axpy>(jit, "paxpy");
+    auto dot = function<Dot>(jit, "dot");
+    auto imax = function<IMax>(jit, "imax");
+    if (!axpy || !sum_from || !odd || !shadow || !scale || !squares || !paxpy || !dot || !imax)
+        return 1;
+
+    // ベクトル化したループの端数も通るように，ベクトル幅の倍数からずらした長さにする
+    constexpr std::size_t n = 1003;
+    std::vector<double> xs(n), ys(n);
+    std::iota(xs.begin(), xs.end(), 0.5);
+    std::iota(ys.begin(), ys.end(), -100.0);
+
+    bool ok = true;
+
+    auto expected = ys;
+    for (std::size_t i = 0; i < n; ++i)
+        expected[i] = 3 * xs[i] + ys[i];
+    axpy(3, xs.data(), n, ys.data(), n);
+    ok &= check("axpy", expected, ys);
+
+    ok &= check("sumFrom", std::accumulate(xs.begin() + 10, xs.end(), 0.0), sum_from(xs.data(), n, 10));
+
+    std::vector<double> zs(n, -1.0);
+    expected = zs;
+    for (std::size_t i = 1; i < n; i += 2)
+        expected[i] = xs[i - 1] * 2;
+    odd(xs.data(), n, zs.data(), n);
+    ok &= check("odd", expected, zs);
+
+    std::vector<double> is(n);
+    expected.resize(n);
+    std::iota(expected.begin(), expected.end(), 0.0);
+    auto outer = shadow(-7, is.data(), n);
+    ok &= check("shadow", expected, is);
+    ok &= check("shadow outer", -7, outer);
+
+    // f32はf32のまま計算する(0.5もf32)
+    std::vector<float> fs(n), fexpected(n);
+    std::iota(fs.begin(), fs.end(), 0.25f);
+    for (std::size_t i = 0; i < n; ++i)
+        fexpected[i] = fs[i] * 1.1f + 0.5f;
+    scale(1.1f, fs.data(), n);
+    ok &= check("scale", fexpected, fs);
+
+    std::vector<std::int64_t> ns(n), nexpected(n);
+    for (std::size_t i = 0; i < n; ++i)
+        nexpected[i] = static_cast<std::int64_t>(i * i) - 3;
+    squares(ns.data(), n);
+    ok &= check("squares", nexpected, ns);
+
+    // i + 2がlastの先で溢れても，ループはlastの手前で止まる
+    jit.eval("def nearMax(xs[]: i64, first: i64, last: i64) for i = first, last, 2 in xs[0] = xs[0] + 1;");
+    if (auto near_max = function<double (*)(std::int64_t*, std::int64_t, std::int64_t, std::int64_t)>(jit, "nearMax")) {
+        constexpr auto max = std::numeric_limits<std::int64_t>::max();
+        std::vector<std::int64_t> count = {0};
+        near_max(count.data(), 1, max - 5, max);
+        ok &= check("nearMax", 3, count[0]);
+    } else {
+        ok = false;
+    }
+
+    // 並列に回しても結果は同じ．reduceの和は順序が変わるので，丸めの起きない整数の値で比べる
+    std::iota(ys.begin(), ys.end(), -100.0);
+    expected = ys;
+    for (std::size_t i = 0; i < n; ++i)
+        expected[i] = 3 * xs[i] + ys[i];
+    paxpy(3, xs.data(), n, ys.data(), n);
+    ok &= check("paxpy", expected, ys);
+
+    std::iota(xs.begin(), xs.end(), -500.0);
+    std::iota(ys.begin(), ys.end(), 7.0);
+    ok &= check("dot", std::inner_product(xs.begin(), xs.end(), ys.begin(), 0.0),
+        dot(xs.data(), n, ys.data(), n));
+    ok &= check("dot empty", 0, dot(xs.data(), 0, ys.data(), 0));
+
+    for (std::size_t i = 0; i < n; ++i)
+        ns[i] = static_cast<std::int64_t>((i * 7919) % n) - 500;
+    ok &= check("imax", *std::max_element(ns.begin(), ns.end()), imax(ns.data(), n));
+
+    // 書き込みの後では，前に読んだ値から計算した式を使い回さない．引数だけの式は使い回してよい
+    jit.eval("def reread(a, xs[]) xs[0] * a + a * a + (xs[0] = 5) + xs[0] * a + a * a;");
+    if (auto reread = function<Shadow>(jit, "reread")) {
+        std::vector<double> one = {1};
+        ok &= check("reread", 2 + 4 + 5 + 10 + 4, reread(2, one.data(), 1));
+    } else {
+        ok = false;
+    }
+
+    // 同じバッファを2つのバッファの引数に渡す呼び出しはnoaliasに反するのでコンパイルしない
+    jit.eval("def selfAxpy(a, xs[]) axpy(a, xs, xs);");
+    ok &= check("selfAxpy rejected", false, jit.lookup("selfAxpy").has_value());
+
+    // プールのスレッドから呼ぶと，そのスレッドだけで回る
+    std::iota(ys.begin(), ys.end(), -100.0);
+    expected = ys;
+    for (std::size_t i = 0; i < n; ++i)
+        expected[i] = 3 * xs[i] + ys[i];
+    std::promise<double> on_pool;
+    jit.getEngine().pool().submit([&] {
+        paxpy(3, xs.data(), n, ys.data(), n);
+        on_pool.set_value(dot(xs.data(), n, xs.data(), n));
+    });
+    auto dot_on_pool = on_pool.get_future().get();
+    ok &= check("paxpy on pool", expected, ys);
+    ok &= check("dot on pool", std::inner_product(xs.begin(), xs.end(), xs.begin(), 0.0), dot_on_pool);
+
+    // 事前コンパイルしたライブラリはプールを持たないので，呼び出し元だけで回す
+    auto dir = std::filesystem::temp_directory_path();
+    auto source = (dir / "test-buffer-parallel.ks").string();
+    auto library = (dir / "test-buffer-parallel.kbc").string();
+    std::ofstream{source} << "def pdot(xs[], ys[]) reduce(+, i = 0, len(xs) in xs[i] * ys[i]);\n"
+                          << "def pfill(xs[]) parfor i = 0, len(xs) in xs[i] = i * 2;\n";
+    Interpreter lib{no_input, "test-buffer-lib"};
+    if (!precompileLibrary(source, library) || !lib.load(library))
+        return 1;
+    auto pdot = function<Dot>(lib, "pdot");
+    auto pfill = function<double (*)(double*, std::int64_t)>(lib, "pfill");
+    if (!pdot || !pfill)
+        return 1;
+    ok &= check("library reduce", std::inner_product(xs.begin(), xs.end(), ys.begin(), 0.0),
+        pdot(xs.data(), n, ys.data(), n));
+    for (std::size_t i = 0; i < n; ++i)
+        expected[i] = 2.0 * i;
+    pfill(zs.data(), n);
+    ok &= check("library parfor", expected, zs);
+    std::filesystem::remove(source);
+    std::filesystem::remove(library);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+// テストで共通に使う比べ方．食い違いは表示し，テストのmainは1で終わる
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace kaleidoscope::test
+{
+// libmの呼び出しや最適化による丸めの差は許す
+inline bool same(double a, double b)
+{
+    if (std::isnan(a) || std::isnan(b))
+        return std::isnan(a) && std::isnan(b);
+    return a == b || std::abs(a - b) <= 1e-12 * std::max(std::abs(a), std::abs(b));
+}
+
+// expectedはactualの型に合わせて比べる
+template <class T>
+bool check(const std::string& name, const std::type_identity_t<T>& expected, const T& actual)
+{
+    bool ok = expected == actual;
+    (ok ? std::cout : std::cerr) << name << ": expected " << expected << ", got " << actual << std::endl;
+    return ok;
+}
+
+// 要素ごとに比べ，最初の5つの食い違いだけを表示する
+template <class T>
+bool check(const std::string& name, const std::vector<T>& expected, const std::vector<T>& actual)
+{
+    std::size_t mismatches = 0;
+    if (expected.size() != actual.size()) {
+        ++mismatches;
+        std::cerr << name << ": expected " << expected.size() << " elements, got " << actual.size() << std::endl;
+    }
+    for (std::size_t i = 0; i < std::min(expected.size(), actual.size()); ++i)
+        if (expected[i] != actual[i] && mismatches++ < 5)
+            std::cerr << name << '[' << i << "]: expected " << expected[i] << ", got " << actual[i] << std::endl;
+    std::cout << name << ": " << expected.size() << " elements, " << mismatches << " mismatches" << std::endl;
+    return mismatches == 0;
+}
+}  // namespace kaleidoscope::test
@@ -1,5 +1,7 @@
 #include <kaleidoscope/parser.hpp>
 
+#include <llvm/Support/TargetSelect.h>
+
 #include <fstream>
 #include <iostream>
 #include <memory>
@@ -19,10 +21,13 @@ int main(int argc, char** argv)
         }
     }();
 
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
     CodeGenEnv env{"my cool jit"};
 
-    parser.setDefHandler([&](const FunctionAST& def) {
-        if (auto code = def.codegen(env)) {
+    parser.setDefHandler([&](std::unique_ptr<FunctionAST> def) {
+        if (auto code = def->codegen(env)) {
             llvm::outs() << "; parsed a function definition\n";
             llvm::outs() << *code << '\n';
         } else {
@@ -30,19 +35,21 @@ int main(int argc, char** argv)
         }
     });
 
-    parser.setExternHandler([&](const PrototypeAST& ext) {
-        if (auto code = ext.codegen(env)) {
+    parser.setExternHandler([&](std::unique_ptr<PrototypeAST> ext) {
+        if (auto code = ext->codegen(env)) {
             llvm::outs() << "; parsed an external\n";
             llvm::outs() << *code << '\n';
+            env.proto_func[ext->getName()] = std::move(ext);
         } else {
             std::cerr << "[external] failed to cogen" << std::endl;
         }
     });
 
-    parser.setTopLevelHandler([&](const FunctionAST& top) {
-        if (auto code = top.codegen(env)) {
+    parser.setTopLevelHandler([&](std::unique_ptr<FunctionAST> top) {
+        if (auto code = top->codegen(env)) {
             llvm::outs() << "; parsed a top level expression\n";
             llvm::outs() << *code << '\n';
+            code->eraseFromParent();  // 次のトップレベルの式も__anon_exprになる
         } else {
             std::cerr << "[top level] failed to cogen" << std::endl;
         }
@@ -0,0 +1,111 @@
+// @gradで作ったd_<name>の偏微分を，手で微分した式と比べる
+
+#include <kaleidoscope/interpreter.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "check.hpp"
+
+using namespace kaleidoscope;
+using namespace kaleidoscope::test;
+
+namespace
+{
+using Gradient = double (*)(double, double, double*, std::int64_t);
+using Expected = std::function<std::vector<double>(double, double)>;  // 値，xでの偏微分，yでの偏微分
+
+bool compare(Interpreter& jit, const std::string& name, const std::vector<double>& values, const Expected& expected)
+{
+    auto entry = jit.lookup("d_" + name);
+    if (!entry || entry->arity != 3) {
+        std::cerr << name << ": gradient not compiled by the JIT" << std::endl;
+        return false;
+    }
+    auto d = reinterpret_cast<Gradient>(static_cast<intptr_t>(entry->address));
+
+    std::size_t inputs = 0, mismatches = 0;
+    for (auto x : values) {
+        for (auto y : values) {
+            ++inputs;
+            double grad[2] = {-1, -1};
+            std::vector<double> actual{d(x, y, grad, 2), grad[0], grad[1]};
+            auto want = expected(x, y);
+            for (std::size_t i = 0; i < want.size(); ++i)
+                if (!same(want[i], actual[i]) && mismatches++ < 5)
+                    std::cerr << name << '(' << x << ", " << y << ")[" << i << "]: expected " << want[i] << ", got "
+                              << actual[i] << std::endl;
+        }
+    }
+    std::cout << name << ": " << inputs << " inputs, " << mismatches << " mismatches" << std::endl;
+    return mismatches == 0;
+}
+}  // namespace
+
+int main()
+{
+    std::istringstream no_input;
+    Interpreter jit{no_input, "test-gradient"};
+    jit.eval(R"(
+        extern sin(x);
+        extern exp(x);
+        extern log(x);
+        extern pow(x, y);
+        extern sqrt(x);
+        extern fabs(x);
+        @grad def rosen(x, y) (1 - x) * (1 - x) + 100 * (y - x * x) * (y - x * x);
+        @grad def wave(x, y) sin(x * y) + exp(0 - x) * y;
+        @grad def branch(x, y) if x > 0 then log(x) * y else x * x * x;
+        @memo @grad def powers(x, y) pow(x, 3) + sqrt(y) * fabs(x) + (x < y) * 5;
+    )");
+
+    const std::vector<double> values = {-2.5, -1, 0.5, 1, 3};
+    const std::vector<double> positive = {0.25, 0.5, 1, 3, 7.5};
+
+    bool ok = true;
+    ok &= compare(jit, "rosen", values, [](double x, double y) {
+        auto r = y - x * x;
+        return std::vector<double>{(1 - x) * (1 - x) + 100 * r * r, -2 * (1 - x) - 400 * x * r, 200 * r};
+    });
+    ok &= compare(jit, "wave", values, [](double x, double y) {
+        return std::vector<double>{std::sin(x * y) + std::exp(-x) * y, std::cos(x * y) * y - std::exp(-x) * y,
+                                   std::cos(x * y) * x + std::exp(-x)};
+    });
+    // 選ばれなかった枝の微分(x <= 0 での 1/x)は計算しない
+    ok &= compare(jit, "branch", values, [](double x, double y) {
+        if (x > 0)
+            return std::vector<double>{std::log(x) * y, y / x, std::log(x)};
+        return std::vector<double>{x * x * x, 3 * x * x, 0};
+    });
+    ok &= compare(jit, "powers", positive, [](double x, double y) {
+        return std::vector<double>{
+            std::pow(x, 3) + std::sqrt(y) * x + (x < y) * 5, 3 * std::pow(x, 2) + std::sqrt(y), 0.5 / std::sqrt(y) * x};
+    });
+
+    // gradが短ければ何も書かずに値だけを返す
+    if (auto entry = jit.lookup("d_rosen")) {
+        auto d = reinterpret_cast<Gradient>(static_cast<intptr_t>(entry->address));
+        double grad[2] = {-1, -1};
+        if (auto value = d(0.5, 1, grad, 1); !same(value, 0.25 + 100 * 0.75 * 0.75) || grad[0] != -1 || grad[1] != -1) {
+            std::cerr << "d_rosen wrote to a short grad: " << value << ' ' << grad[0] << ' ' << grad[1] << std::endl;
+            ok = false;
+        }
+    }
+
+    // 自分で書いたd_<name>は@gradで置き換えない
+    jit.eval(R"(
+        def d_own(x, y, grad[]) 42;
+        @grad def own(x, y) x * y;
+    )");
+    if (auto entry = jit.lookup("d_own"); !entry || reinterpret_cast<Gradient>(static_cast<intptr_t>(entry->address))(
+                                                          2, 3, nullptr, 0) != 42) {
+        std::cerr << "d_own was replaced by @grad" << std::endl;
+        ok = false;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+// hot_swapで，再帰するdefの定義と再定義がスタブ経由で呼び出し元に反映されるかを確かめる
+// code_cache_limitで追い出されたdefが，次に呼ばれたときにコンパイルし直されるかも確かめる
+
+#include <kaleidoscope/interpreter.hpp>
+
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+
+#include "check.hpp"
+
+using namespace kaleidoscope;
+using namespace kaleidoscope::test;
+
+namespace
+{
+using Unary = double (*)(double);
+
+Unary function(Interpreter& jit, const std::string& name)
+{
+    auto entry = jit.lookup(name);
+    if (!entry) {
+        std::cerr << name << ": not compiled by the JIT" << std::endl;
+        return nullptr;
+    }
+    return reinterpret_cast<Unary>(static_cast<intptr_t>(entry->address));
+}
+
+}  // namespace
+
+int main()
+{
+    std::istringstream no_input;
+    Interpreter::Config config;
+    config.hot_swap = true;
+    Interpreter jit{no_input, "test-hotswap", config};
+
+    // 最初の定義で，本体が自分自身のスタブを呼ぶ
+    jit.eval(R"(
+        def fib(x) if x < 3 then 1 else fib(x - 1) + fib(x - 2);
+        def twice(x) fib(x) * 2;
+    )");
+    auto fib = function(jit, "fib");
+    auto twice = function(jit, "twice");
+    if (!fib || !twice)
+        return 1;
+
+    bool ok = true;
+    ok &= check("fib", 6765, fib(20));
+    ok &= check("twice", 13530, twice(20));
+
+    // 再定義すると，前に取ったアドレスからも新しい本体が呼ばれる
+    auto values = jit.eval(R"(
+        def fib(x) if x < 3 then 2 else fib(x - 1) + fib(x - 2);
+        fib(20);
+    )");
+    ok &= check("redefined fib (eval)", 13530, values.size() == 1 ? values[0] : -1);
+    ok &= check("redefined fib", 13530, fib(20));
+    ok &= check("twice after redefinition", 27060, twice(20));
+    ok &= check("same stub", 1, function(jit, "fib") == fib);
+
+    // 上限が1byteなら，defを定義したりトップレベルの式を評価したりするたびに全てのdefのコードが追い出される
+    // 追い出されたdefは，スタブが呼ばれたときにコンパイルし直す．その回数はstats.defsに数えられる
+    std::istringstream no_input_evicting;
+    Interpreter::Config small = config;
+    small.code_cache_limit = 1;
+    small.collect_stats = true;
+    Interpreter evicting{no_input_evicting, "test-hotswap-evict", small};
+    evicting.eval(R"(
+        def fib(x) if x < 3 then 1 else fib(x - 1) + fib(x - 2);
+        def sq(x) x * x;
+        def sumsq(x, y) sq(x) + sq(y);
+    )");
+    auto defs = [&] { return static_cast<double>(evicting.getStats().defs); };
+    ok &= check("defined", 3, defs());
+
+    // ホストからスタブを呼ぶ
+    auto evicted_fib = function(evicting, "fib");
+    if (!evicted_fib)
+        return 1;
+    ok &= check("evicted fib", 6765, evicted_fib(20));
+    ok &= check("recompiled fib", 4, defs());
+
+    // トップレベルの式から呼ぶと，sumsqとその中で呼ぶsqをコンパイルし直す
+    values = evicting.eval("sumsq(3, 4);");
+    ok &= check("evicted sumsq", 25, values.size() == 1 ? values[0] : -1);
+    ok &= check("recompiled sumsq and sq", 6, defs());
+
+    // 式の評価が終わると，コンパイルし直したfibもまた追い出される
+    ok &= check("evicted fib again", 6765, evicted_fib(20));
+    ok &= check("recompiled fib again", 7, defs());
+
+    return ok ? 0 : 1;
+}
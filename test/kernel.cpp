@@ -0,0 +1,99 @@
+// コンパイル時のkernelとJITに同じソースを渡し，同じ入力で同じ値を返すかを確かめる
+
+#include <kaleidoscope/interpreter.hpp>
+#include <kaleidoscope/kernel.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <tuple>
+#include <vector>
+
+#include "check.hpp"
+
+using namespace kaleidoscope;
+using namespace kaleidoscope::test;
+
+namespace
+{
+template <std::size_t... I>
+double callJIT(llvm::JITTargetAddress addr, const std::array<double, sizeof...(I)>& args, std::index_sequence<I...>)
+{
+    using Fn = double (*)(decltype((void)I, double())...);
+    return reinterpret_cast<Fn>(static_cast<intptr_t>(addr))(args[I]...);
+}
+
+// valuesの全ての組み合わせを引数にして比べる
+template <ct::FixedString Source>
+bool compare(Interpreter& jit, const std::string& name, const std::vector<double>& values)
+{
+    constexpr auto kernel = ct::kernel<Source>;
+    constexpr auto arity = ct::Kernel<Source>::arity;
+
+    jit.eval(std::string{Source.view()});
+    auto entry = jit.lookup(name);
+    if (!entry || entry->arity != arity) {
+        std::cerr << name << ": not compiled by the JIT" << std::endl;
+        return false;
+    }
+
+    std::size_t combinations = 1;
+    for (std::size_t i = 0; i < arity; ++i)
+        combinations *= values.size();
+
+    std::size_t mismatches = 0;
+    std::array<double, arity> args;
+    for (std::size_t c = 0; c < combinations; ++c) {
+        auto rest = c;
+        for (auto& arg : args) {
+            arg = values[rest % values.size()];
+            rest /= values.size();
+        }
+
+        auto expected = callJIT(entry->address, args, std::make_index_sequence<arity>{});
+        auto actual = std::apply(kernel, args);
+        if (!same(expected, actual) && mismatches++ < 5) {
+            std::cerr << name << '(';
+            for (std::size_t i = 0; i < arity; ++i)
+                std::cerr << (i ? ", " : "") << args[i];
+            std::cerr << "): jit " << expected << ", kernel " << actual << std::endl;
+        }
+    }
+    std::cout << name << ": " << combinations << " inputs, " << mismatches << " mismatches" << std::endl;
+    return mismatches == 0;
+}
+}  // namespace
+
+int main()
+{
+    constexpr auto nan = std::numeric_limits<double>::quiet_NaN();
+    constexpr auto inf = std::numeric_limits<double>::infinity();
+    const std::vector<double> values = {-2.5, -1, -0.0, 0, 0.5, 1, 3, 1e300, -inf, nan};
+
+    std::istringstream no_input;
+    Interpreter jit{no_input, "test-kernel"};
+
+    bool ok = true;
+    ok &= compare<"def poly(x, y) (x * x + 3 * x * y - y) * (x - y) + 1;">(jit, "poly", values);
+    ok &= compare<"def prec(a, b, c) a + b * c - a * b < c + 1 * a - b > a;">(jit, "prec", values);
+    ok &= compare<"def cmp(a, b) (a < b) + (a > b) * 2 + if a - b then 4 else 8;">(jit, "cmp", values);
+    ok &= compare<"# 再帰\ndef fib(x) if x < 3 then 1 else fib(x - 1) + fib(x - 2);">(
+        jit, "fib", {-1, 0, 1, 2, 3, 7.5, 10, 15, 20, nan});
+    ok &= compare<R"(
+        extern sin(x);
+        extern sqrt(x);
+        def sq(x) x * x;
+        @memo def wave(x, y) sin(x) * sqrt(sq(y) + 1) > 0.5 + 0.125;
+    )">(jit, "wave", values);
+    ok &= compare<R"(
+        extern fma(a, b, c);
+        extern pow(x, y);
+        extern fabs(x);
+        extern floor(x);
+        def mix(x, y, z) fma(x, y, z) - pow(fabs(x), 2) + 1.5 * floor(z) - 12345678901234567890.25;
+    )">(jit, "mix", values);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,122 @@
+// precompileLibraryで書いた.kbcを読み直し，Interpreter::loadしたdefを呼んで確かめる
+// バッファ引数(版2から)と型付きの引数や戻り値(版3から)の表も読めているかを見る
+
+#include <kaleidoscope/interpreter.hpp>
+#include <kaleidoscope/library.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <vector>
+
+#include "check.hpp"
+
+using namespace kaleidoscope;
+using namespace kaleidoscope::test;
+
+namespace
+{
+template <class Fn>
+Fn function(Interpreter& jit, const std::string& name, bool doubles)
+{
+    auto entry = jit.lookup(name);
+    if (!entry || entry->doubles != doubles) {
+        std::cerr << name << ": not loaded from the library" << std::endl;
+        return nullptr;
+    }
+    return reinterpret_cast<Fn>(static_cast<intptr_t>(entry->address));
+}
+
+const PrototypeAST* find(const Library& lib, const std::string& name)
+{
+    for (auto& proto : lib.protos)
+        if (proto->getName() == name)
+            return proto.get();
+    return nullptr;
+}
+}  // namespace
+
+int main()
+{
+    auto dir = std::filesystem::temp_directory_path();
+    auto source = (dir / "test-library.ks").string();
+    auto library = (dir / "test-library.kbc").string();
+    auto old_library = (dir / "test-library-v2.kbc").string();
+    std::ofstream{source} << "extern sin(x);\n"
+                          << "def sq(x) x * x;\n"
+                          << "def wave(x) sin(x) * sq(x);\n"
+                          << "def axpy(a, xs[], ys[]) for i = 0, len(ys) in ys[i] = a * xs[i] + ys[i];\n"
+                          << "def scale(a: f32, xs[]: f32) for i = 0, len(xs) in xs[i] = xs[i] * a + 0.5;\n"
+                          << "def isq(n: i64): i64 n * n - 3;\n"
+                          << "@grad def norm2(x, y) x * x + y * y;\n"
+                          << "sq(4);\n";
+    if (!precompileLibrary(source, library))
+        return 1;
+
+    bool ok = true;
+
+    // 表: externとdef，バッファの引数，引数と戻り値の型
+    auto lib = readLibrary(library);
+    if (!lib)
+        return 1;
+    auto sin = find(*lib, "sin");
+    auto axpy_proto = find(*lib, "axpy");
+    auto scale_proto = find(*lib, "scale");
+    auto isq_proto = find(*lib, "isq");
+    if (!sin || !axpy_proto || !scale_proto || !isq_proto || !find(*lib, "d_norm2")) {
+        std::cerr << "missing prototypes in " << library << std::endl;
+        return 1;
+    }
+    ok &= check("sin is extern", true, sin->isExtern());
+    ok &= check("axpy buffers", true, axpy_proto->getBuffers() == std::vector<bool>{false, true, true});
+    ok &= check("scale types", true, scale_proto->getTypes() == std::vector<ValueType>{ValueType::f32, ValueType::f32});
+    ok &= check("scale buffers", true, scale_proto->getBuffers() == std::vector<bool>{false, true});
+    ok &= check("isq types", true,
+        isq_proto->getTypes() == std::vector<ValueType>{ValueType::i64} && isq_proto->getReturnType() == ValueType::i64);
+
+    // 読み込んだdefを呼ぶ
+    std::istringstream no_input;
+    Interpreter jit{no_input, "test-library"};
+    if (!jit.load(library))
+        return 1;
+    auto sq = function<double (*)(double)>(jit, "sq", true);
+    auto wave = function<double (*)(double)>(jit, "wave", true);
+    auto axpy = function<double (*)(double, double*, std::int64_t, double*, std::int64_t)>(jit, "axpy", false);
+    auto scale = function<double (*)(float, float*, std::int64_t)>(jit, "scale", false);
+    auto isq = function<std::int64_t (*)(std::int64_t)>(jit, "isq", false);
+    auto d_norm2 = function<double (*)(double, double, double*, std::int64_t)>(jit, "d_norm2", false);
+    if (!sq || !wave || !axpy || !scale || !isq || !d_norm2)
+        return 1;
+
+    ok &= check("sq", 6.25, sq(2.5));
+    ok &= check("wave", std::sin(2.0) * 4, wave(2));
+    std::vector<double> xs = {1, 2, 3}, ys = {10, 20, 30};
+    axpy(2, xs.data(), xs.size(), ys.data(), ys.size());
+    ok &= check("axpy", true, ys == std::vector<double>{12, 24, 36});
+    std::vector<float> fs = {1, 2, 3};
+    scale(2, fs.data(), fs.size());
+    ok &= check("scale", true, fs == std::vector<float>{2.5f, 4.5f, 6.5f});
+    ok &= check<std::int64_t>("isq", 1 << 20, isq(1024) + 3);
+    double grad[2];
+    ok &= check("d_norm2", 25.0, d_norm2(3, 4, grad, 2));
+    ok &= check("d_norm2 grad", true, grad[0] == 6 && grad[1] == 8);
+
+    // 読み込んだdefは後から評価するソースでも使える
+    auto results = jit.eval("sq(3) + isq(2);");
+    ok &= check("eval", 10.0, results.size() == 1 ? results[0] : -1);
+
+    // 版が違うファイルは読まない
+    std::ifstream in{library, std::ios::binary};
+    std::vector<char> bytes{std::istreambuf_iterator<char>{in}, {}};
+    bytes[4] = 2;
+    std::ofstream{old_library, std::ios::binary}.write(bytes.data(), bytes.size());
+    ok &= check("old version rejected", false, readLibrary(old_library).has_value());
+
+    for (auto& path : {source, library, old_library})
+        std::filesystem::remove(path);
+    return ok ? 0 : 1;
+}
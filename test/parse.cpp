@@ -5,15 +5,15 @@ using namespace kaleidoscope;
 int main() {
     Parser parser{Tokenizer{std::cin}};
 
-    parser.setDefHandler([](auto &) {
+    parser.setDefHandler([](std::unique_ptr<FunctionAST>) {
         std::cout << "parsed a function definition" << std::endl;
     });
 
-    parser.setExternHandler([](auto &) {
+    parser.setExternHandler([](std::unique_ptr<PrototypeAST>) {
         std::cout << "parsed an external" << std::endl;
     });
 
-    parser.setTopLevelHandler([](auto &) {
+    parser.setTopLevelHandler([](std::unique_ptr<FunctionAST>) {
         std::cout << "parsed a top level expression" << std::endl;
     });
 
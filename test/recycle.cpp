@@ -0,0 +1,91 @@
+// context_recycle_unitsを小さくしてLLVMContextを何度も作り直し，結果とインライン展開が変わらないかを確かめる
+// インライン展開用のIRはbitcodeにして新しいcontextへ移すので，作り直した後のdefでも展開されるはず
+
+#include <kaleidoscope/interpreter.hpp>
+
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace kaleidoscope;
+
+namespace
+{
+constexpr int levels = 12;
+
+// f0は小さいのでインライン展開される．fiはf(i-1)(3)を定数に畳めるかどうかで命令数が変わる
+std::string makeSource()
+{
+    std::ostringstream src;
+    src << "def f0(x) x * x + x * 3 + 1;\nf0(2);\n";
+    for (int i = 1; i < levels; ++i) {
+        auto prev = "f" + std::to_string(i - 1);
+        src << "def f" << i << "(x) " << prev << "(3) + " << prev << "(x) * 2;\n"
+            << 'f' << i << "(2);\n";
+    }
+    return src.str();
+}
+
+double expected(int level, double x)
+{
+    return level == 0 ? x * x + x * 3 + 1 : expected(level - 1, 3) + expected(level - 1, x) * 2;
+}
+
+struct Run
+{
+    std::vector<double> results;
+    std::size_t ir_after;
+    std::size_t contexts;
+};
+
+Run run(unsigned recycle_units, unsigned inline_threshold)
+{
+    std::istringstream no_input;
+    Interpreter::Config config;
+    config.collect_stats = true;
+    config.context_recycle_units = recycle_units;
+    config.inline_threshold = inline_threshold;
+    Interpreter jit{no_input, "test-recycle", config};
+    auto results = jit.eval(makeSource());
+    auto& stats = jit.getStats();
+    return {results, stats.ir_after, stats.contexts};
+}
+}  // namespace
+
+int main()
+{
+    auto recycled = run(2, 32);
+    auto kept = run(0, 32);
+    auto not_inlined = run(2, 0);
+
+    bool ok = true;
+    if (recycled.results.size() != levels) {
+        std::cerr << "expected " << levels << " results, got " << recycled.results.size() << std::endl;
+        return 1;
+    }
+    for (int i = 0; i < levels; ++i)
+        if (recycled.results[i] != expected(i, 2)) {
+            std::cerr << 'f' << i << "(2): expected " << expected(i, 2) << ", got " << recycled.results[i] << std::endl;
+            ok = false;
+        }
+
+    std::cout << "contexts: " << recycled.contexts << ", IR after optimization: " << recycled.ir_after
+              << " (without recycling " << kept.ir_after << ", without inlining " << not_inlined.ir_after << ")"
+              << std::endl;
+    if (recycled.contexts < levels / 2) {
+        std::cerr << "LLVMContext was recycled only " << recycled.contexts << " times" << std::endl;
+        ok = false;
+    }
+    if (kept.contexts != 0 || kept.results != recycled.results) {
+        std::cerr << "results differ without recycling" << std::endl;
+        ok = false;
+    }
+    // 作り直しても展開されていれば，作り直さない場合と同じIRになり，展開しない場合より小さい
+    if (recycled.ir_after != kept.ir_after || recycled.ir_after >= not_inlined.ir_after) {
+        std::cerr << "inlining changed after recycling the context" << std::endl;
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}
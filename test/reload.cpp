@@ -0,0 +1,52 @@
+// reloadで，ファイルから消えたdefも定義された順番どおりに作り直され，依存するdefが新しい本体を使うかを確かめる
+
+#include <kaleidoscope/interpreter.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "check.hpp"
+
+using namespace kaleidoscope;
+using namespace kaleidoscope::test;
+
+namespace
+{
+}  // namespace
+
+int main()
+{
+    auto source = (std::filesystem::temp_directory_path() / "test-reload.ks").string();
+    std::istringstream no_input;
+    Interpreter jit{no_input, "test-reload"};
+    std::vector<double> results;
+    jit.setResultHandler([&](double value) { results.push_back(value); });
+
+    std::ofstream{source} << "def base(x) x + 1;\n"
+                          << "def mid(x) base(x) * 2;\n"
+                          << "def top(x) mid(x) + 100;\n"
+                          << "top(1);\n";
+    bool ok = true;
+    ok &= check("first load", 3, jit.reload(source));
+    ok &= check("top(1) before", 104, results.empty() ? -1 : results.back());
+
+    // midはファイルから消えたが，baseに依存するので前回のASTから作り直す
+    // topはmidをインライン展開しているので，midを作り直してからでないと古いbaseが残る
+    std::ofstream{source} << "def base(x) x + 2;\n"
+                          << "def top(x) mid(x) + 100;\n"
+                          << "top(1);\n";
+    ok &= check("second load", 3, jit.reload(source));
+    ok &= check("top(1) after", 106, results.empty() ? -1 : results.back());
+
+    // 変わっていなければ何も作り直さず，トップレベルの式だけを評価し直す
+    results.clear();
+    ok &= check("unchanged", 0, jit.reload(source));
+    ok &= check("top(1) unchanged", 106, results.empty() ? -1 : results.back());
+
+    std::filesystem::remove(source);
+    return ok ? 0 : 1;
+}
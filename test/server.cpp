@@ -0,0 +1,146 @@
+// Unixドメインソケット越しにServerへEVAL，CALL，QUITを送り，応答を確かめる
+
+#include <kaleidoscope/server.hpp>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "check.hpp"
+
+using namespace kaleidoscope;
+using namespace kaleidoscope::test;
+
+namespace
+{
+// サーバーがlistenするまで繰り返し接続する
+int connectTo(const std::string& path)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    for (int retry = 0; retry < 500; ++retry) {
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+            return fd;
+        if (fd >= 0)
+            ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return -1;
+}
+
+struct Client
+{
+    int fd;
+    std::string buf;
+
+    void send(const std::string& request)
+    {
+        for (std::size_t sent = 0; sent < request.size();) {
+            auto n = ::write(fd, request.data() + sent, request.size() - sent);
+            if (n <= 0)
+                return;
+            sent += n;
+        }
+    }
+
+    // 改行までを1行読む．接続が閉じられていれば空
+    std::string line()
+    {
+        for (;;) {
+            if (auto eol = buf.find('\n'); eol != std::string::npos) {
+                auto l = buf.substr(0, eol);
+                buf.erase(0, eol + 1);
+                return l;
+            }
+            char chunk[256];
+            auto n = ::read(fd, chunk, sizeof(chunk));
+            if (n <= 0)
+                return {};
+            buf.append(chunk, n);
+        }
+    }
+
+    // 応答の見出しの行と，OKなら続く値の行
+    std::string reply()
+    {
+        auto head = line();
+        std::string out = head + "\n";
+        if (head.rfind("OK ", 0) == 0)
+            for (auto rows = std::stoul(head.substr(3)); rows > 0; --rows)
+                out += line() + "\n";
+        return out;
+    }
+};
+
+}  // namespace
+
+int main()
+{
+    auto path = (std::filesystem::temp_directory_path() / ("test-server-" + std::to_string(::getpid()) + ".sock")).string();
+    std::istringstream no_input;
+    Interpreter jit{no_input, "test-server"};
+    Server server{jit, path};
+    bool served = true;
+    std::thread loop{[&] { served = server.run(); }};
+
+    bool ok = true;
+    Client client{connectTo(path)};
+    if (client.fd < 0) {
+        std::cerr << "cannot connect to " << path << std::endl;
+        ok = false;
+    } else {
+        std::string source = "def add(x, y) x + y;\nadd(1, 2);\n";
+        client.send("EVAL " + std::to_string(source.size()) + "\n" + source);
+        ok &= check("EVAL", "OK 1\n3\n", client.reply());
+
+        std::string bad = "def bad(x) y;\n";
+        client.send("EVAL " + std::to_string(bad.size()) + "\n" + bad);
+        ok &= check("EVAL error", "ERR failed to compile bad\n", client.reply());
+
+        client.send("CALL add 2\n1 2\n3 4.5\n");
+        ok &= check("CALL", "OK 2\n3\n7.5\n", client.reply());
+
+        // 失敗しても接続はそのまま使える
+        client.send("CALL nosuch 1\n1\n");
+        ok &= check("CALL unknown", "ERR unknown function: nosuch\n", client.reply());
+        client.send("CALL add 1\n1\n");
+        ok &= check("CALL arity", "ERR expected 2 numbers in row 1\n", client.reply());
+        client.send("HELLO\n");
+        ok &= check("unknown command", "ERR unknown command: HELLO\n", client.reply());
+
+        client.send("QUIT\n");
+        ok &= check("QUIT", "\n", client.reply());
+        ::close(client.fd);
+    }
+
+    // 要求を送ってから書き込み側だけを閉じても，全部に答えてから閉じる
+    Client half{connectTo(path)};
+    if (half.fd < 0) {
+        std::cerr << "cannot connect to " << path << std::endl;
+        ok = false;
+    } else {
+        std::string source = "def mul(x, y) x * y;\n";
+        half.send("EVAL " + std::to_string(source.size()) + "\n" + source + "CALL mul 1\n6 7\nCALL add 1\n1 1\n");
+        ::shutdown(half.fd, SHUT_WR);
+        ok &= check("half-closed EVAL", "OK 0\n", half.reply());
+        ok &= check("half-closed CALL mul", "OK 1\n42\n", half.reply());
+        ok &= check("half-closed CALL add", "OK 1\n2\n", half.reply());
+        ok &= check("half-closed end", "\n", half.reply());
+        ::close(half.fd);
+    }
+
+    server.stop();
+    loop.join();
+    ok &= served;
+    std::filesystem::remove(path);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,87 @@
+// submitしたdefがバックグラウンドでコンパイルされ，futureから呼べるようになるかを確かめる
+
+#include <kaleidoscope/interpreter.hpp>
+
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+
+#include "check.hpp"
+
+using namespace kaleidoscope;
+using namespace kaleidoscope::test;
+
+namespace
+{
+template <class Fn>
+Fn function(const Interpreter::Pending& pending)
+{
+    auto entry = pending.entry.get();
+    if (!entry) {
+        std::cerr << pending.name << ": not compiled by the JIT" << std::endl;
+        return nullptr;
+    }
+    return reinterpret_cast<Fn>(static_cast<intptr_t>(entry->address));
+}
+
+}  // namespace
+
+int main()
+{
+    std::istringstream no_input;
+    Interpreter jit{no_input, "test-submit"};
+
+    // 2つ目のバッチは1つ目のdefを呼ぶ．1つ目を待たずに投げてよい
+    auto first = jit.submit(R"(
+        def sq(x) x * x;
+        @grad def norm2(x, y) x * x + y * y;
+        def fib(x) if x < 3 then 1 else fib(x - 1) + fib(x - 2);
+    )");
+    auto second = jit.submit(R"(
+        extern fabs(x);
+        def dist(x, y) fabs(sq(x) - fib(y));
+        def broken(x) undefined(x);
+    )");
+    if (first.size() != 4 || second.size() != 2 || first[2].name != "d_norm2") {
+        std::cerr << "unexpected pending definitions" << std::endl;
+        return 1;
+    }
+
+    // 後に投げたものから待っても，前のバッチは終わっている
+    using Binary = double (*)(double, double);
+    using Gradient = double (*)(double, double, double*, std::int64_t);
+    auto dist = function<Binary>(second[0]);
+    auto fib = function<double (*)(double)>(first[3]);
+    auto norm2 = function<Binary>(first[1]);
+    auto d_norm2 = function<Gradient>(first[2]);
+    if (!dist || !fib || !norm2 || !d_norm2)
+        return 1;
+
+    bool ok = true;
+    ok &= check("dist", 39, dist(4, 10));
+    ok &= check("fib", 6765, fib(20));
+    ok &= check("norm2", 25, norm2(3, 4));
+    double grad[2];
+    d_norm2(3, 4, grad, 2);
+    ok &= check("d_norm2 x", 6, grad[0]);
+    ok &= check("d_norm2 y", 8, grad[1]);
+    ok &= check("broken", 0, second[1].entry.get().has_value());
+
+    // 再定義したnorm2は微分できない(defの呼び出しを含む)．前のd_norm2が残っていても，そのfutureはnulloptになる
+    auto third = jit.submit("@grad def norm2(x, y) sq(x) + sq(y);");
+    if (third.size() != 2 || third[1].name != "d_norm2") {
+        std::cerr << "unexpected pending definitions" << std::endl;
+        return 1;
+    }
+    ok &= check("redefined norm2", 1, third[0].entry.get().has_value());
+    ok &= check("redefined d_norm2", 0, third[1].entry.get().has_value());
+
+    // hot_swapでは，ホストが実行中の古い版を捨てうるので受け付けない
+    std::istringstream no_input_swap;
+    Interpreter::Config swap;
+    swap.hot_swap = true;
+    Interpreter swapping{no_input_swap, "test-submit-swap", swap};
+    ok &= check("hot_swap rejected", 0, swapping.submit("def one(x) 1;").size());
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,27 @@
+// 合成した.ksプログラムを標準出力に書く
+// usage: ksgen [--defs N] [--depth N] ... > out.ks
+
+#include "../bench/generator.hpp"
+
+#include <exception>
+#include <iostream>
+
+using namespace kaleidoscope;
+
+int main(int argc, char** argv)
+{
+    bench::CorpusShape shape;
+    for (int i = 1; i < argc; i += 2) {
+        bool ok = false;
+        try {
+            ok = i + 1 < argc && bench::setShapeOption(shape, argv[i], argv[i + 1]);
+        } catch (const std::exception&) {  // 数値になっていない
+        }
+        if (!ok) {
+            std::cerr << "usage: " << argv[0] << " [options]\n" << bench::shapeOptionsHelp();
+            return 1;
+        }
+    }
+
+    std::cout << bench::generateCorpus(shape);
+}